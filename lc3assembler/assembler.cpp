@@ -2,6 +2,9 @@
 
 #include <assert.h>
 #include <bitset>
+#include <fmt/core.h>
+#include <map>
+#include <ostream>
 
 Writer::Writer(const std::string& filename)
     : m_outpuStream(filename, std::ios::binary)
@@ -51,4 +54,21 @@ void Assembler::gnenerate(Writer& writer)
             writer.write(binaryInstruction);
         }
     }
-}
\ No newline at end of file
+}
+
+void Assembler::writeSymbols(std::ostream& out) const
+{
+    // the program starts with .ORIG, labels are relative to it
+    uint16_t origin = m_instructions.front().instruction->generate(0);
+    std::multimap<uint16_t, std::string> byAddress;
+    for (const auto& [label, offset] : SymbolTable::the().labels()) {
+        byAddress.insert({static_cast<uint16_t>(origin + offset), label});
+    }
+    out << "// Symbol table\n"
+        << "// Scope level 0:\n"
+        << "//\tSymbol Name       Page Address\n"
+        << "//\t----------------  ------------\n";
+    for (const auto& [address, label] : byAddress) {
+        out << fmt::format("//\t{:<16}  {:04X}\n", label, address);
+    }
+}
@@ -18,6 +18,9 @@ class Assembler {
   public:
     Assembler(std::vector<InstructionWithAddress>& instructions);
     void gnenerate(Writer& writer);
+    // the labels in the format lc3as writes its .sym files in, what
+    // lc3emulator --symbols reads
+    void writeSymbols(std::ostream& out) const;
 
     template <uint16_t bitcount = 9>
     static std::string toBinaryString(uint16_t number)
@@ -1,6 +1,7 @@
 #include <exception>
 #include <filesystem>
 #include <fmt/core.h>
+#include <fstream>
 #include <iostream>
 
 #include "assembler.hpp"
@@ -33,6 +34,14 @@ int main(int argc, char* argv[])
         assembler.gnenerate(writer);
         std::cout << fmt::format("Writing assembler output to: `{}`\n",
                                  outFileName);
+
+        // next to the output, like lc3as does
+        auto symbolFileName =
+            std::filesystem::path(outFileName).replace_extension(".sym");
+        std::ofstream symbolFile(symbolFileName);
+        assembler.writeSymbols(symbolFile);
+        std::cout << fmt::format("Writing symbol table to: `{}`\n",
+                                 symbolFileName.string());
     }
     catch (std::exception e) {
         std::cout << fmt::format("LC3 ASSEMBLER ERROR: {}\n", e.what());
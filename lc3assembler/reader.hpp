@@ -37,6 +37,12 @@ class SymbolTable {
         return m_labelsOffset.at(label);
     }
 
+    // label -> offset from .ORIG
+    const std::map<std::string, uint16_t>& labels() const
+    {
+        return m_labelsOffset;
+    }
+
     SymbolTable(const SymbolTable&) = delete;
     SymbolTable& operator=(SymbolTable&) = delete;
 
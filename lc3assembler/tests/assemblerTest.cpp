@@ -1,4 +1,6 @@
+#include <filesystem>
 #include <gtest/gtest.h>
+#include <sstream>
 
 #include "../assembler.hpp"
 #include "../reader.hpp"
@@ -302,6 +304,32 @@ TEST(Instructions, TrapInstruction)
               expectedResult);
 }
 
+TEST(Assembler, SymbolFile)
+{
+    auto path = std::filesystem::temp_directory_path() / "lc3SymbolTest.lc3";
+    {
+        std::ofstream source(path);
+        source << ".ORIG x3000\n"
+                  "LD R0, VALUE\n"
+                  "LOOP ADD R0, R0, #-1\n"
+                  "BRp LOOP\n"
+                  "HALT\n"
+                  "VALUE .FILL #3\n"
+                  ".END\n";
+    }
+    Reader reader(path.string());
+    auto instructions = reader.readFile();
+    std::filesystem::remove(path);
+    Assembler assembler(instructions);
+    std::ostringstream symbols;
+    assembler.writeSymbols(symbols);
+    // addresses are absolute, in lc3as's layout
+    ASSERT_NE(symbols.str().find("//\tLOOP              3001\n"),
+              std::string::npos);
+    ASSERT_NE(symbols.str().find("//\tVALUE             3004\n"),
+              std::string::npos);
+}
+
 int main(int argc, char* argv[])
 {
     ::testing::InitGoogleTest(&argc, argv);
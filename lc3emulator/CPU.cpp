@@ -1,338 +1,1609 @@
 #include "CPU.hpp"
+#include "mappedfile.hpp"
+#include "os.hpp"
 
+#include <algorithm>
 #include <assert.h>
 #include <bitset>
+#include <cstring>
 #include <fmt/core.h>
 #include <fstream>
 #include <iostream>
+#include <iterator>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define LC3_LOADER_SSE2 1
+#include <emmintrin.h>
+#else
+#define LC3_LOADER_SSE2 0
+#endif
 
 namespace {
-uint16_t retrieveBits(uint16_t insturction, uint8_t start, uint8_t size)
+// Machine snapshot file, every field in host byte order:
+//   SnapshotHeader
+//   uint16_t deviceState[deviceStateSize]   see Memory::deviceState
+//   uint16_t pages[pageCount]               ascending page numbers
+//   uint16_t words[pageCount][Memory::PAGE_SIZE]
+// Pages that aren't listed are all zeros.
+struct SnapshotHeader {
+    char magic[4];
+    uint16_t version;
+    uint16_t pc;
+    uint16_t conditionValue;
+    uint16_t registers[CPU::NUMBER_OF_REGISTERS];
+    uint16_t processorStatus;
+    uint16_t savedUserStack;
+    uint16_t savedSupervisorStack;
+    uint16_t deviceStateSize;
+    uint16_t pageCount;
+};
+
+constexpr char SNAPSHOT_MAGIC[4] = {'L', 'C', '3', 'S'};
+// a file written on a machine of the other byte order reads as 0x0100
+constexpr uint16_t SNAPSHOT_VERSION = 3;
+// how often the keyboard is looked at while its interrupt is enabled, or
+// while a bounded run skips a polling loop
+constexpr uint64_t KEYBOARD_POLL_INTERVAL = 10000;
+constexpr uint32_t PAGE_COUNT =
+    (std::numeric_limits<uint16_t>::max() + 1) / Memory::PAGE_SIZE;
+
+// memcpy(), or swapping the bytes of every word on the way
+void copyWords(uint16_t* destination, const uint8_t* source, uint32_t count,
+               bool isSwapped)
 {
-    assert(start <= 15 && start >= 0);
-    uint16_t mask = (1 << size) - 1;
-    uint16_t res = (insturction >> (start - size + 1)) & mask;
-    return res;
+    if (!isSwapped) {
+        std::memcpy(destination, source, count * sizeof(uint16_t));
+        return;
+    }
+    uint32_t i = 0;
+#if LC3_LOADER_SSE2
+    for (; i + 8 <= count; i += 8) {
+        __m128i words = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(source + i * sizeof(uint16_t)));
+        words =
+            _mm_or_si128(_mm_slli_epi16(words, 8), _mm_srli_epi16(words, 8));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i), words);
+    }
+#endif
+    for (; i < count; ++i) {
+        uint16_t word;
+        std::memcpy(&word, source + i * sizeof(uint16_t), sizeof word);
+        destination[i] = (word << 8) | (word >> 8);
+    }
 }
+} // namespace
 
-uint16_t signExtend(uint16_t offset, uint8_t bitCount)
+bool parseEngine(const std::string& name, Engine& engine)
 {
-    if ((offset >> (bitCount - 1)) & 0x1) {
-        offset |= (0xFFFF << bitCount);
+    if (name == "switch") {
+        engine = Engine::SWITCH;
+    }
+    else if (name == "threaded") {
+        engine = Engine::THREADED;
+    }
+    else if (name == "block") {
+        engine = Engine::BLOCK;
+    }
+    else if (name == "jit") {
+        engine = Engine::JIT;
+    }
+    else {
+        return false;
     }
-    return offset;
+    return true;
 }
 
-uint16_t signExtendRetriveBits(uint16_t insturction, uint8_t start,
-                               uint8_t size)
+CPU::CPU(Engine engine)
+    : m_registers{}, m_conditionValue(0), m_processorStatus(USER_MODE),
+      m_savedUserStack(0), m_savedSupervisorStack(SUPERVISOR_STACK),
+      m_engine(engine), m_runResult{}, m_budget(0), m_withheldBudget(0),
+      m_canWaitForInput(false), m_instructionCount(0), m_cycleCount(0),
+      m_cycleModel(CycleModel::standard()),
+      m_cycleTable(cycleTable(m_cycleModel)), m_profiler(nullptr),
+      m_tracer(nullptr), m_inputLog(nullptr),
+      m_ownedIo(std::make_unique<TerminalIo>()), m_io(m_ownedIo.get()),
+      m_output(m_io), m_snapshot{}
 {
-    return signExtend(retrieveBits(insturction, start, size), size);
+    m_memory.keyboard().connect(m_io, &m_output);
+    m_memory.display().connect(&m_output);
+    const auto& os = builtInOs();
+    m_memory.assign(OsImage::TRAP_VECTOR_TABLE, os.words.data(),
+                    os.words.size());
+    m_nativeTraps.set();
 }
 
-Register getDestinationRegisterNumber(uint16_t insturction)
+uint8_t CPU::conditionBits(uint16_t value)
 {
-    return static_cast<Register>(retrieveBits(insturction, 11, 3));
+    if (value >> 15) {
+        return 0b100;
+    }
+    return value == 0 ? 0b010 : 0b001;
 }
 
-Register getSourceBaseRegisterNumber(uint16_t insturction)
+CPU::ConditionalCode CPU::conditionalCodes() const
 {
-    return static_cast<Register>(retrieveBits(insturction, 8, 3));
+    uint8_t bits = conditionBits(m_conditionValue);
+    return {.N = (bits & 0b100) != 0,
+            .Z = (bits & 0b010) != 0,
+            .P = (bits & 0b001) != 0};
 }
-} // namespace
 
-CPU::CPU() : m_registers{}, m_conditionalCodes{false, false, false} {}
+void CPU::setConditionalCodes(Register destinationRegisterNumber)
+{
+    m_conditionValue = m_registers[destinationRegisterNumber];
+}
 
-InstructionOpCode CPU::getOpCode(uint16_t instruction) const
+uint16_t CPU::processorStatus() const
 {
-    return static_cast<InstructionOpCode>(retrieveBits(instruction, 15, 4));
+    return m_processorStatus | conditionBits(m_conditionValue);
 }
 
-void CPU::setConditionalCodes(Register destinationRegisterNumber)
+void CPU::setProcessorStatus(uint16_t processorStatus)
+{
+    m_processorStatus = processorStatus & (USER_MODE | PRIORITY_LEVEL);
+    // any value with the same n/z/p bits will do
+    m_conditionValue = (processorStatus & 0b100)   ? 0x8000
+                       : (processorStatus & 0b010) ? 0
+                                                   : 1;
+}
+
+void CPU::updatePrivilege()
+{
+    m_memory.setPrivileged(!isUserMode() ||
+                           (m_memory.attributes(m_pc) & PROTECTED));
+}
+
+void CPU::snapshot()
+{
+    m_memory.snapshot();
+    m_snapshot = {.registers = m_registers,
+                  .pc = m_pc,
+                  .conditionValue = m_conditionValue,
+                  .processorStatus = m_processorStatus,
+                  .savedUserStack = m_savedUserStack,
+                  .savedSupervisorStack = m_savedSupervisorStack};
+}
+
+void CPU::reset()
+{
+    // blocks over restored words are dropped by the next run()
+    m_memory.restore();
+    m_registers = m_snapshot.registers;
+    m_pc = m_snapshot.pc;
+    m_conditionValue = m_snapshot.conditionValue;
+    m_processorStatus = m_snapshot.processorStatus;
+    m_savedUserStack = m_snapshot.savedUserStack;
+    m_savedSupervisorStack = m_snapshot.savedSupervisorStack;
+    // devices were restored too, their events are scheduled again
+    m_events.clear();
+    updatePrivilege();
+}
+
+void CPU::saveSnapshot(const std::string& path) const
 {
-    auto destinationRegisterNumberValue =
-        m_registers[destinationRegisterNumber];
-    if (destinationRegisterNumberValue >> 15) {
-        m_conditionalCodes = {.N = true, .Z = false, .P = false};
+    auto words = m_memory.words();
+    std::vector<uint16_t> pages;
+    for (uint32_t page = 0; page < PAGE_COUNT; ++page) {
+        auto first = words.begin() + page * Memory::PAGE_SIZE;
+        if (std::any_of(first, first + Memory::PAGE_SIZE,
+                        [](uint16_t word) { return word != 0; })) {
+            pages.push_back(page);
+        }
     }
-    else if (destinationRegisterNumberValue == 0) {
-        m_conditionalCodes = {.N = false, .Z = true, .P = false};
+    auto deviceState = m_memory.deviceState();
+
+    SnapshotHeader header{};
+    std::copy(std::begin(SNAPSHOT_MAGIC), std::end(SNAPSHOT_MAGIC),
+              header.magic);
+    header.version = SNAPSHOT_VERSION;
+    header.pc = m_pc;
+    header.conditionValue = m_conditionValue;
+    std::copy(m_registers.begin(), m_registers.end(), header.registers);
+    header.processorStatus = m_processorStatus;
+    header.savedUserStack = m_savedUserStack;
+    header.savedSupervisorStack = m_savedSupervisorStack;
+    header.deviceStateSize = deviceState.size();
+    header.pageCount = pages.size();
+
+    std::ofstream ofs(path, std::ios::binary);
+    auto writeWords = [&](const uint16_t* data, size_t count) {
+        ofs.write(reinterpret_cast<const char*>(data),
+                  count * sizeof(uint16_t));
+    };
+    ofs.write(reinterpret_cast<const char*>(&header), sizeof header);
+    writeWords(deviceState.data(), deviceState.size());
+    writeWords(pages.data(), pages.size());
+    for (uint16_t page : pages) {
+        writeWords(&words[page * Memory::PAGE_SIZE], Memory::PAGE_SIZE);
     }
-    else {
-        m_conditionalCodes = {.N = false, .Z = false, .P = true};
+    if (!ofs) {
+        throw std::runtime_error(
+            fmt::format("Couldn't write a snapshot: `{}`", path));
     }
 }
 
-void CPU::load(const std::string& fileToRun)
+void CPU::loadSnapshot(const std::string& path)
 {
-    std::ifstream ifs(fileToRun, std::ios::binary);
-    if (!ifs.is_open()) {
-        throw std::runtime_error(
-            fmt::format("Couldn't open a file: `{}`", fileToRun));
+    MappedFile file(path);
+    auto invalid = [&](const char* problem) {
+        return std::runtime_error(
+            fmt::format("Invalid snapshot `{}`: {}", path, problem));
+    };
+
+    SnapshotHeader header;
+    if (file.size() < sizeof header) {
+        throw invalid("truncated header");
+    }
+    std::memcpy(&header, file.data(), sizeof header);
+    if (!std::equal(std::begin(SNAPSHOT_MAGIC), std::end(SNAPSHOT_MAGIC),
+                    header.magic)) {
+        throw invalid("not a snapshot file");
+    }
+    if (header.version != SNAPSHOT_VERSION) {
+        throw invalid("unsupported version or byte order");
+    }
+    size_t expectedSize =
+        sizeof header +
+        (header.deviceStateSize + header.pageCount +
+         size_t(header.pageCount) * Memory::PAGE_SIZE) *
+            sizeof(uint16_t);
+    if (header.pageCount > PAGE_COUNT || file.size() != expectedSize) {
+        throw invalid("wrong size");
     }
 
-    uint16_t origin;
-    ifs.read(reinterpret_cast<char*>(&origin), sizeof origin);
-    m_pc = origin;
+    // the header has an even size, so everything after it is aligned
+    auto* deviceState =
+        reinterpret_cast<const uint16_t*>(file.data() + sizeof header);
+    auto* pages = deviceState + header.deviceStateSize;
+    auto* words = pages + header.pageCount;
+    for (uint16_t i = 0; i < header.pageCount; ++i) {
+        if (pages[i] >= PAGE_COUNT || (i > 0 && pages[i] <= pages[i - 1])) {
+            throw invalid("bad page table");
+        }
+    }
+    if (!m_memory.setDeviceState({deviceState, header.deviceStateSize})) {
+        throw invalid("device state doesn't match");
+    }
 
-    while (!ifs.eof()) {
-        uint16_t data;
-        ifs.read(reinterpret_cast<char*>(&data), sizeof data);
-        if (!ifs.fail()) {
-            m_memory.write(origin++, data);
+    static const std::array<uint16_t, Memory::PAGE_SIZE> zeros{};
+    const uint16_t* nextPage = pages;
+    for (uint32_t page = 0; page < PAGE_COUNT; ++page) {
+        const uint16_t* source = zeros.data();
+        if (nextPage != words && *nextPage == page) {
+            source = words + (nextPage - pages) * Memory::PAGE_SIZE;
+            ++nextPage;
         }
+        m_memory.assign(page * Memory::PAGE_SIZE, source, Memory::PAGE_SIZE);
     }
-    dumpMemory(m_pc, 5);
+    std::copy(std::begin(header.registers), std::end(header.registers),
+              m_registers.begin());
+    m_pc = header.pc;
+    m_conditionValue = header.conditionValue;
+    m_processorStatus = header.processorStatus & (USER_MODE | PRIORITY_LEVEL);
+    m_savedUserStack = header.savedUserStack;
+    m_savedSupervisorStack = header.savedSupervisorStack;
+    m_events.clear();
+    updatePrivilege();
 }
 
-void CPU::emulate(uint16_t instruction)
+void CPU::setIo(IoDevice& io)
 {
-    try {
-        auto opCode = getOpCode(instruction);
-        switch (opCode) {
-        case InstructionOpCode::ADD: {
-            Register destinationRegisterNumber =
-                getDestinationRegisterNumber(instruction);
-            Register sourceRegisterNumber =
-                getSourceBaseRegisterNumber(instruction);
-            if ((instruction >> 5) & 0x1) {
-                uint16_t immediateValue = signExtendRetriveBits(instruction, 4, 5);
-                m_registers[destinationRegisterNumber] =
-                    m_registers[sourceRegisterNumber] + immediateValue;
+    m_io = &io;
+    m_inputLog = nullptr;
+    m_output.setDevice(&io);
+    m_memory.keyboard().connect(&io, &m_output);
+}
+
+void CPU::setInputLog(InputLog& log)
+{
+    setIo(log);
+    m_inputLog = &log;
+}
+
+void CPU::setConsole(std::istream& input, std::ostream& output)
+{
+    auto streams = std::make_unique<StreamIo>(input, output);
+    setIo(*streams);
+    m_ownedIo = std::move(streams);
+}
+
+void CPU::flushOutput() { m_output.flush(); }
+
+void CPU::setNativeTrap(uint8_t vector, bool isNative)
+{
+    m_nativeTraps[vector] = isNative;
+}
+
+void CPU::setCycleModel(const CycleModel& model)
+{
+    m_cycleModel = model;
+    m_cycleTable = cycleTable(model);
+    // blocks and native code have the old cycles built in
+    for (auto& block : m_blocks) {
+        block.reset();
+    }
+    if (m_jit) {
+        m_jit->flush();
+    }
+}
+
+void CPU::load(const std::string& fileToRun, bool dumpLoadedWords)
+{
+    load(std::vector<std::string>{fileToRun}, dumpLoadedWords);
+}
+
+void CPU::load(const std::vector<std::string>& images, bool dumpLoadedWords)
+{
+    struct Segment {
+        std::unique_ptr<MappedFile> file;
+        uint16_t origin;
+        uint32_t size;
+        bool isSwapped;
+    };
+
+    std::vector<Segment> segments;
+    std::vector<bool> isLoaded(std::numeric_limits<uint16_t>::max() + 1);
+    for (const auto& image : images) {
+        auto file = std::make_unique<MappedFile>(image);
+        if (file->size() < sizeof(uint16_t) || file->size() % 2 != 0) {
+            throw std::runtime_error(fmt::format(
+                "Invalid image `{}`: odd size or no origin", image));
+        }
+
+        uint16_t origin;
+        std::memcpy(&origin, file->data(), sizeof origin);
+        // User programs can't start in system space, so an origin that
+        // only leaves it once its bytes are swapped gives the order away.
+        // Segments that can't be told apart that way (a trap handler in
+        // system space, say) are taken to be in the order of the program.
+        uint16_t swappedOrigin = (origin << 8) | (origin >> 8);
+        bool isSystem = m_memory.attributes(origin) & PROTECTED;
+        bool isSwappedSystem = m_memory.attributes(swappedOrigin) & PROTECTED;
+        bool isSwapped = isSystem != isSwappedSystem
+                             ? isSystem
+                             : !segments.empty() && segments.front().isSwapped;
+        if (isSwapped) {
+            origin = swappedOrigin;
+        }
+
+        // segments after the program may replace parts of the OS
+        uint8_t forbidden = READ_ONLY | DEVICE;
+        if (segments.empty()) {
+            forbidden |= PROTECTED;
+        }
+        uint32_t size = file->size() / sizeof(uint16_t) - 1;
+        for (uint32_t address = origin; address < uint32_t(origin) + size;
+             ++address) {
+            if (address > std::numeric_limits<uint16_t>::max() ||
+                (m_memory.attributes(address) & forbidden)) {
+                throw std::runtime_error(fmt::format(
+                    "Program doesn't fit in user memory, address: {}",
+                    address));
             }
-            else {
-                Register secondSource =
-                    static_cast<Register>(retrieveBits(instruction, 2, 3));
-                m_registers[destinationRegisterNumber] =
-                    m_registers[sourceRegisterNumber] +
-                    m_registers[secondSource];
+            if (isLoaded[address]) {
+                throw std::runtime_error(fmt::format(
+                    "`{}` overlaps an earlier segment at address: {}", image,
+                    address));
             }
-            setConditionalCodes(destinationRegisterNumber);
-            break;
+            isLoaded[address] = true;
         }
-        case InstructionOpCode::AND: {
-            Register destinationRegisterNumber =
-                getDestinationRegisterNumber(instruction);
-            Register sourceRegisterNumber =
-                getSourceBaseRegisterNumber(instruction);
-            if ((instruction >> 5) & 0x1) {
-                uint16_t immediateValue = signExtendRetriveBits(instruction, 4, 5);
-                m_registers[destinationRegisterNumber] =
-                    m_registers[sourceRegisterNumber] & immediateValue;
+        segments.push_back({std::move(file), origin, size, isSwapped});
+    }
+
+    for (const auto& segment : segments) {
+        const uint8_t* words = segment.file->data() + sizeof(uint16_t);
+        m_memory.assign(segment.origin, segment.size,
+                        [&](uint16_t* destination, uint32_t count) {
+                            copyWords(destination, words, count,
+                                      segment.isSwapped);
+                        });
+        m_memory.predecode(segment.origin, segment.size);
+    }
+    if (!segments.empty()) {
+        m_pc = segments.front().origin;
+        updatePrivilege();
+    }
+    if (dumpLoadedWords) {
+        dumpMemory(m_pc, 5);
+    }
+}
+
+void CPU::emulate(uint16_t instruction) { execute(decode(instruction)); }
+
+template <bool isImmediate>
+void CPU::add(DecodedInstruction instruction)
+{
+    Register destinationRegisterNumber =
+        static_cast<Register>(instruction.destinationRegister);
+    if constexpr (isImmediate) {
+        m_registers[destinationRegisterNumber] =
+            m_registers[instruction.sourceRegister] +
+            instruction.immediateValue;
+    }
+    else {
+        m_registers[destinationRegisterNumber] =
+            m_registers[instruction.sourceRegister] +
+            m_registers[instruction.secondSourceRegister];
+    }
+    setConditionalCodes(destinationRegisterNumber);
+}
+
+template <bool isImmediate>
+void CPU::bitwiseAnd(DecodedInstruction instruction)
+{
+    Register destinationRegisterNumber =
+        static_cast<Register>(instruction.destinationRegister);
+    if constexpr (isImmediate) {
+        m_registers[destinationRegisterNumber] =
+            m_registers[instruction.sourceRegister] &
+            instruction.immediateValue;
+    }
+    else {
+        m_registers[destinationRegisterNumber] =
+            m_registers[instruction.sourceRegister] &
+            m_registers[instruction.secondSourceRegister];
+    }
+    setConditionalCodes(destinationRegisterNumber);
+}
+
+template <uint8_t nzp>
+void CPU::branch(DecodedInstruction instruction)
+{
+    // the condition value is the flags' source, so every mask turns into a
+    // single signed comparison
+    int16_t value = static_cast<int16_t>(m_conditionValue);
+    bool isTaken = true;
+    if constexpr (nzp == 0b100) {
+        isTaken = value < 0;
+    }
+    else if constexpr (nzp == 0b010) {
+        isTaken = value == 0;
+    }
+    else if constexpr (nzp == 0b001) {
+        isTaken = value > 0;
+    }
+    else if constexpr (nzp == 0b110) {
+        isTaken = value <= 0;
+    }
+    else if constexpr (nzp == 0b101) {
+        isTaken = value != 0;
+    }
+    else if constexpr (nzp == 0b011) {
+        isTaken = value >= 0;
+    }
+
+    // NOTE: if the offset is negative it'll be a huge number that will
+    //       overflow with PC, therfore wrap it around, so that is how
+    //       PC can move backwards
+    if (isTaken) {
+        m_pc += instruction.immediateValue;
+    }
+}
+
+void CPU::jump(DecodedInstruction instruction)
+{
+    m_pc = m_registers[instruction.sourceRegister];
+}
+
+template <bool isImmediate>
+void CPU::jumpToSubroutine(DecodedInstruction instruction)
+{
+    m_registers[R7] = m_pc;
+    // is JSR
+    if constexpr (isImmediate) {
+        m_pc += instruction.immediateValue;
+    }
+    else {
+        m_pc = m_registers[instruction.sourceRegister];
+    }
+}
+
+bool CPU::stop(StopReason reason, uint16_t pc, uint16_t detail)
+{
+    // run() fills in the counts and where to continue
+    m_runResult = {.reason = reason,
+                   .pc = pc,
+                   .detail = detail,
+                   .instructionsRetired = 0,
+                   .cycles = 0,
+                   .finalPc = 0};
+    return false;
+}
+
+bool CPU::memoryFault(uint16_t pc)
+{
+    auto [fault, address] = m_memory.takeFault();
+    if (fault == MemoryFault::MACHINE_HALTED ||
+        fault == MemoryFault::UNSUPPORTED_TRAP) {
+        // the built-in OS stops on behalf of the TRAP that called it, the
+        // same as the native trap would have
+        uint16_t vector = 0;
+        if (builtInOs().isCode(pc)) {
+            pc = m_registers[R7] - 1;
+            vector = m_memory.words()[pc] & 0xFF;
+        }
+        return fault == MemoryFault::MACHINE_HALTED
+                   ? stop(StopReason::HALT, pc)
+                   : stop(StopReason::UNSUPPORTED_TRAP, pc, vector);
+    }
+    if (fault == MemoryFault::RESCHEDULE) {
+        endSlice();
+        return true;
+    }
+    return stop(fault == MemoryFault::ILLEGAL_WRITE ? StopReason::ILLEGAL_WRITE
+                                                    : StopReason::ILLEGAL_READ,
+                pc, address);
+}
+
+bool CPU::load(DecodedInstruction instruction)
+{
+    Register destinationRegisterNumber =
+        static_cast<Register>(instruction.destinationRegister);
+    uint16_t value = m_memory[m_pc + instruction.immediateValue];
+    if (m_memory.hasFault()) {
+        return memoryFault(m_pc - 1);
+    }
+    m_registers[destinationRegisterNumber] = value;
+    setConditionalCodes(destinationRegisterNumber);
+    return true;
+}
+
+bool CPU::loadIndirect(DecodedInstruction instruction)
+{
+    Register destinationRegisterNumber =
+        static_cast<Register>(instruction.destinationRegister);
+    // a faulting pointer read gives address 0, that fault is the one kept
+    uint16_t address = m_memory[m_pc + instruction.immediateValue];
+    uint16_t value = m_memory[address];
+    if (m_memory.hasFault()) {
+        return memoryFault(m_pc - 1);
+    }
+    m_registers[destinationRegisterNumber] = value;
+    setConditionalCodes(destinationRegisterNumber);
+    if (isKeyboardSpin(m_pc - 1, address, value)) {
+        return idleUntilKey(m_pc - 1);
+    }
+    return true;
+}
+
+bool CPU::loadBaseOffset(DecodedInstruction instruction)
+{
+    Register destinationRegisterNumber =
+        static_cast<Register>(instruction.destinationRegister);
+    uint16_t value = m_memory[m_registers[instruction.sourceRegister] +
+                              instruction.immediateValue];
+    if (m_memory.hasFault()) {
+        return memoryFault(m_pc - 1);
+    }
+    m_registers[destinationRegisterNumber] = value;
+    setConditionalCodes(destinationRegisterNumber);
+    return true;
+}
+
+void CPU::loadEffectiveAddress(DecodedInstruction instruction)
+{
+    Register destinationRegisterNumber =
+        static_cast<Register>(instruction.destinationRegister);
+    m_registers[destinationRegisterNumber] = m_pc + instruction.immediateValue;
+    setConditionalCodes(destinationRegisterNumber);
+}
+
+void CPU::bitwiseNot(DecodedInstruction instruction)
+{
+    Register destinationRegisterNumber =
+        static_cast<Register>(instruction.destinationRegister);
+    m_registers[destinationRegisterNumber] =
+        ~(m_registers[instruction.sourceRegister]);
+    setConditionalCodes(destinationRegisterNumber);
+}
+
+bool CPU::store(DecodedInstruction instruction)
+{
+    m_memory.write(m_pc + instruction.immediateValue,
+                   m_registers[instruction.destinationRegister]);
+    return !m_memory.hasFault() || memoryFault(m_pc - 1);
+}
+
+bool CPU::storeIndirect(DecodedInstruction instruction)
+{
+    m_memory.write(m_memory[m_pc + instruction.immediateValue],
+                   m_registers[instruction.destinationRegister]);
+    return !m_memory.hasFault() || memoryFault(m_pc - 1);
+}
+
+bool CPU::storeBaseOffset(DecodedInstruction instruction)
+{
+    m_memory.write(m_registers[instruction.sourceRegister] +
+                       instruction.immediateValue,
+                   m_registers[instruction.destinationRegister]);
+    return !m_memory.hasFault() || memoryFault(m_pc - 1);
+}
+
+bool CPU::trap(DecodedInstruction instruction)
+{
+    uint8_t vector = instruction.immediateValue;
+    uint16_t routine =
+        m_memory.words()[OsImage::TRAP_VECTOR_TABLE + vector];
+    if (!m_nativeTraps[vector] || routine != builtInOs().trapRoutines[vector]) {
+        return callTrapRoutine(routine);
+    }
+    // the same as the routines of the built-in OS, which TRAP returns from
+    m_registers[R7] = m_pc;
+    switch (static_cast<Traps>(vector)) {
+    case Traps::GETC: {
+        // whatever prompted for the input has to be visible first
+        m_output.flush();
+        if (awaitLoggedInput()) {
+            return true;
+        }
+        char charFromKeyboard = m_memory.keyboard().takeInput();
+        m_registers[R0] = charFromKeyboard;
+        break;
+    }
+    case Traps::T_OUT: {
+        m_output.put(m_registers[R0]);
+        break;
+    }
+    case Traps::PUTS: {
+        uint16_t stringPointer = m_registers[R0];
+        // Copied straight out of memory, only words that need a checked
+        // read (devices, system space) go through operator[].
+        while (true) {
+            uint16_t length = m_memory.plainStringLength(stringPointer);
+            m_output.putWords(&m_memory.words()[stringPointer], length);
+            stringPointer += length;
+            uint16_t character = m_memory[stringPointer];
+            if (character == 0) {
+                break;
             }
-            else {
-                Register secondSourceReigsterNumber =
-                    static_cast<Register>(retrieveBits(instruction, 2, 3));
-                m_registers[destinationRegisterNumber] =
-                    m_registers[sourceRegisterNumber] &
-                    m_registers[secondSourceReigsterNumber];
+            m_output.put(character);
+            ++stringPointer;
+        }
+        m_output.put('\n');
+        break;
+    }
+    case Traps::T_IN: {
+        m_output.flush();
+        if (awaitLoggedInput()) {
+            return true;
+        }
+        char charFromKeyboard = m_memory.keyboard().takeInput();
+        m_output.put(charFromKeyboard);
+        m_registers[R0] = charFromKeyboard;
+        break;
+    }
+    case Traps::PUTSP: {
+        // two characters a word, low byte first
+        uint16_t stringPointer = m_registers[R0];
+        while (uint16_t twoChars = m_memory[stringPointer++]) {
+            m_output.put(static_cast<char>(twoChars));
+            if (twoChars >> 8) {
+                m_output.put(static_cast<char>(twoChars >> 8));
             }
-            setConditionalCodes(destinationRegisterNumber);
-            break;
         }
-        case InstructionOpCode::BR: {
-            uint8_t n = (instruction >> 11) & 0x1;
-            uint8_t z = (instruction >> 10) & 0x1;
-            uint8_t p = (instruction >> 9) & 0x1;
+        break;
+    }
+    case Traps::HALT: {
+        m_output.write("HALT\n", 5);
+        return stop(StopReason::HALT, m_pc - 1);
+    }
+    default:
+        return stop(StopReason::UNSUPPORTED_TRAP, m_pc - 1,
+                    instruction.immediateValue);
+    }
+    // string traps read memory until they see a zero, a fault reads as one
+    return !m_memory.hasFault() || memoryFault(m_pc - 1);
+}
 
-            // NOTE: if the offset is negative it'll be a huge number that will
-            //       overflow with PC, therfore wrap it around, so that is how
-            //       PC can move backwards
-            uint16_t labelOffset = signExtendRetriveBits(instruction, 8, 9);
+bool CPU::callTrapRoutine(uint16_t routine)
+{
+    m_registers[R7] = m_pc;
+    m_pc = routine;
+    updatePrivilege();
+    return true;
+}
 
-            if ((n && m_conditionalCodes.N) || (z && m_conditionalCodes.Z) ||
-                (p && m_conditionalCodes.P)) {
-                m_pc += labelOffset;
-            }
-            else if (n == 0 && z == 0 && p == 0) {
-                m_pc += labelOffset;
+bool CPU::executePrivileged(uint16_t pc)
+{
+    auto instruction = m_memory.fetchPrivileged(pc);
+    m_cycleCount += m_cycleTable[static_cast<uint8_t>(instruction.handler)];
+    bool isRunning = execute(instruction);
+    updatePrivilege();
+    return isRunning;
+}
+
+void CPU::push(uint16_t value)
+{
+    m_memory.write(--m_registers[R6], value);
+}
+
+uint16_t CPU::pop() { return m_memory[m_registers[R6]++]; }
+
+bool CPU::awaitLoggedInput()
+{
+    if (!m_inputLog || m_memory.keyboard().poll() || !m_inputLog->hold()) {
+        return false;
+    }
+    ++m_budget;
+    m_cycleCount -= m_cycleTable[static_cast<uint8_t>(Handler::TRAP)];
+    --m_pc;
+    endSlice();
+    return true;
+}
+
+bool CPU::returnFromInterrupt(DecodedInstruction)
+{
+    // a privilege mode violation, there is no handler to take it
+    if (isUserMode()) {
+        return stop(StopReason::RTI, m_pc - 1);
+    }
+    uint16_t pc = m_pc - 1;
+    uint16_t returnPc = pop();
+    uint16_t processorStatus = pop();
+    if (m_memory.hasFault()) {
+        return memoryFault(pc);
+    }
+    m_pc = returnPc;
+    setProcessorStatus(processorStatus);
+    if (isUserMode()) {
+        m_savedSupervisorStack = m_registers[R6];
+        m_registers[R6] = m_savedUserStack;
+    }
+    updatePrivilege();
+    // an interrupt that waited for a lower priority level may be taken now
+    endSlice();
+    return true;
+}
+
+bool CPU::illegalOpCode(DecodedInstruction instruction)
+{
+    if (instruction.handler == Handler::UNDECODED) {
+        // Memory::fetch doesn't decode words it can't fetch
+        uint16_t pc = m_pc - 1;
+        if (m_memory.attributes(pc) & BREAKPOINT) {
+            m_pc = pc;
+            return stop(StopReason::BREAKPOINT, pc, pc);
+        }
+        if (m_memory.isPrivileged()) {
+            return executePrivileged(pc);
+        }
+        return stop(StopReason::ILLEGAL_READ, pc, pc);
+    }
+    return stop(StopReason::ILLEGAL_OPCODE, m_pc - 1,
+                static_cast<uint16_t>(instruction.opCode));
+}
+
+bool CPU::execute(DecodedInstruction instruction)
+{
+    switch (instruction.handler) {
+    case Handler::BR:
+        branch<0b000>(instruction);
+        break;
+    case Handler::BR_P:
+        branch<0b001>(instruction);
+        break;
+    case Handler::BR_Z:
+        branch<0b010>(instruction);
+        break;
+    case Handler::BR_ZP:
+        branch<0b011>(instruction);
+        break;
+    case Handler::BR_N:
+        branch<0b100>(instruction);
+        break;
+    case Handler::BR_NP:
+        branch<0b101>(instruction);
+        break;
+    case Handler::BR_NZ:
+        branch<0b110>(instruction);
+        break;
+    case Handler::BR_NZP:
+        branch<0b111>(instruction);
+        break;
+    case Handler::ADD_REGISTER:
+        add<false>(instruction);
+        break;
+    case Handler::ADD_IMMEDIATE:
+        add<true>(instruction);
+        break;
+    case Handler::AND_REGISTER:
+        bitwiseAnd<false>(instruction);
+        break;
+    case Handler::AND_IMMEDIATE:
+        bitwiseAnd<true>(instruction);
+        break;
+    case Handler::JSR:
+        jumpToSubroutine<true>(instruction);
+        break;
+    case Handler::JSRR:
+        jumpToSubroutine<false>(instruction);
+        break;
+    case Handler::JMP_RET:
+        jump(instruction);
+        break;
+    case Handler::LD:
+        return load(instruction);
+    case Handler::LDI:
+        return loadIndirect(instruction);
+    case Handler::LDR:
+        return loadBaseOffset(instruction);
+    case Handler::LEA:
+        loadEffectiveAddress(instruction);
+        break;
+    case Handler::NOT:
+        bitwiseNot(instruction);
+        break;
+    case Handler::ST:
+        return store(instruction);
+    case Handler::STI:
+        return storeIndirect(instruction);
+    case Handler::STR:
+        return storeBaseOffset(instruction);
+    case Handler::TRAP:
+        return trap(instruction);
+    case Handler::RTI:
+        return returnFromInterrupt(instruction);
+    default:
+        return illegalOpCode(instruction);
+    }
+    return true;
+}
+
+bool CPU::isKeyboardSpin(uint16_t pc, uint16_t address, uint16_t value)
+{
+    if (address != Keyboard::STATUS_REGISTER) {
+        return false;
+    }
+    // taken on what KBSR read, so it never falls through until a key comes
+    auto next = m_memory.isPrivileged() ? m_memory.fetchPrivileged(pc + 1)
+                                        : m_memory.fetch(pc + 1);
+    if (next.immediateValue != static_cast<uint16_t>(-2)) {
+        return false;
+    }
+    return (next.handler == Handler::BR_Z && value == 0) ||
+           (next.handler == Handler::BR_ZP && (value >> 15) == 0);
+}
+
+bool CPU::idleUntilKey(uint16_t pc)
+{
+    if (m_canWaitForInput) {
+        // the next LDI sees the key, nothing else could end the loop
+        while (!m_io->hasInputEnded()) {
+            if (m_io->waitForInput(100)) {
+                return true;
             }
-            break;
         }
-        case InstructionOpCode::JMP_RET: {
-            Register baseRegisterNumber =
-                getSourceBaseRegisterNumber(instruction);
-            m_pc = m_registers[baseRegisterNumber];
-            break;
+        return stop(StopReason::END_OF_INPUT, pc);
+    }
+    // a profile or a trace sees every turn
+    if (isObserved()) {
+        return true;
+    }
+    // Every turn of the loop leaves the same registers and flags, only
+    // where the budget runs out depends on how much of it is left. The
+    // turns cost what they would have. At most a poll interval is skipped,
+    // the LDI after it reads KBSR again.
+    uint64_t skipped = std::min(m_budget, KEYBOARD_POLL_INTERVAL);
+    uint32_t loadCycles = m_cycleTable[static_cast<uint8_t>(Handler::LDI)];
+    uint32_t branchCycles = m_cycleTable[static_cast<uint8_t>(
+        m_memory.fetchPrivileged(pc + 1).handler)];
+    m_cycleCount += skipped / 2 * (loadCycles + branchCycles) +
+                    skipped % 2 * branchCycles;
+    m_pc = skipped % 2 == 0 ? pc + 1 : pc;
+    m_budget -= skipped;
+    return true;
+}
+
+void CPU::emulateSwitch()
+{
+    // User is responsible for not mixing data and insturctions
+    // as emulator can't differentiate insturction from
+    // raw data.
+    while (m_budget != 0) {
+        --m_budget;
+        auto instruction = m_memory.fetch(m_pc++);
+        m_cycleCount +=
+            m_cycleTable[static_cast<uint8_t>(instruction.handler)];
+        if (!execute(instruction)) {
+            return;
         }
-        case InstructionOpCode::JSR_JSRR: {
-            m_registers[R7] = m_pc;
-            // is JSR
-            if ((instruction >> 11) & 0x1) {
-                uint16_t offset = signExtendRetriveBits(instruction, 10, 11);
-                m_pc += offset;
+    }
+    stop(StopReason::BUDGET_EXHAUSTED, m_pc);
+}
+
+void CPU::emulateObserved()
+{
+    while (m_budget != 0) {
+        --m_budget;
+        uint16_t pc = m_pc;
+        auto instruction = m_memory.fetch(m_pc++);
+        uint64_t cycleCount = m_cycleCount;
+        m_cycleCount +=
+            m_cycleTable[static_cast<uint8_t>(instruction.handler)];
+        // system space code is only decoded when it runs
+        auto observed = instruction.isDecoded()
+                            ? instruction
+                            : m_memory.fetchPrivileged(pc);
+        Registers registers = m_registers;
+        uint16_t address = m_tracer ? storeAddress(pc, observed) : 0;
+        bool isRunning = execute(instruction);
+        if (m_tracer) {
+            trace(pc, observed, isRunning, registers, address);
+        }
+        if (m_profiler) {
+            m_profiler->count(pc, observed.opCode,
+                              m_cycleCount - cycleCount);
+        }
+        if (!isRunning) {
+            return;
+        }
+        if (!m_profiler) {
+            continue;
+        }
+        switch (observed.opCode) {
+        case InstructionOpCode::JSR_JSRR:
+            m_profiler->call(m_pc);
+            break;
+        case InstructionOpCode::JMP_RET:
+            if (observed.sourceRegister == R7) {
+                m_profiler->ret();
             }
-            else {
-                Register baseRegisterNumber =
-                    getSourceBaseRegisterNumber(instruction);
-                m_pc = m_registers[baseRegisterNumber];
+            break;
+        case InstructionOpCode::TRAP:
+            // native traps come back right away
+            if (m_pc != uint16_t(pc + 1)) {
+                m_profiler->call(m_pc);
             }
             break;
-        }
-        case InstructionOpCode::LD: {
-            Register destinationRegisterNumber =
-                getDestinationRegisterNumber(instruction);
-            uint16_t labelOffset = signExtendRetriveBits(instruction, 8, 9);
-            m_registers[destinationRegisterNumber] =
-                m_memory[m_pc + labelOffset];
-            setConditionalCodes(destinationRegisterNumber);
+        case InstructionOpCode::RTI:
+            m_profiler->ret();
+            break;
+        default:
             break;
         }
-        case InstructionOpCode::LDI: {
-            Register destinationRegisterNumber =
-                getDestinationRegisterNumber(instruction);
-            uint16_t labelOffset = signExtendRetriveBits(instruction, 8, 9);
+    }
+    stop(StopReason::BUDGET_EXHAUSTED, m_pc);
+}
 
-            m_registers[destinationRegisterNumber] =
-                m_memory[m_memory[m_pc + labelOffset]];
-            setConditionalCodes(destinationRegisterNumber);
-            break;
+uint16_t CPU::storeAddress(uint16_t pc,
+                           DecodedInstruction instruction) const
+{
+    uint16_t target = pc + 1 + instruction.immediateValue;
+    switch (instruction.opCode) {
+    case InstructionOpCode::ST:
+        return target;
+    case InstructionOpCode::STR:
+        return m_registers[instruction.sourceRegister] +
+               instruction.immediateValue;
+    case InstructionOpCode::STI:
+        // read without side effects, pointers don't live in device
+        // registers
+        return m_memory.words()[target];
+    default:
+        return 0;
+    }
+}
+
+void CPU::trace(uint16_t pc, DecodedInstruction instruction, bool isRunning,
+                const Registers& registers, uint16_t storeAddress)
+{
+    TraceRecord record{.pc = pc,
+                       .instruction = m_memory.words()[pc],
+                       .registerMask = 0,
+                       .registers = m_registers,
+                       .hasMemoryWrite = false,
+                       .address = 0,
+                       .value = 0};
+    for (uint8_t i = 0; i < NUMBER_OF_REGISTERS; ++i) {
+        if (m_registers[i] != registers[i]) {
+            record.registerMask |= 1 << i;
         }
-        case InstructionOpCode::LDR: {
-            Register destinationRegisterNumber =
-                getDestinationRegisterNumber(instruction);
-            Register baseRegisterNumber =
-                getSourceBaseRegisterNumber(instruction);
-            uint16_t immediateValue = signExtendRetriveBits(instruction, 5, 6);
+    }
+    switch (instruction.opCode) {
+    case InstructionOpCode::ST:
+    case InstructionOpCode::STR:
+    case InstructionOpCode::STI:
+        // a store that faulted didn't write anything
+        if (isRunning || m_runResult.reason != StopReason::ILLEGAL_WRITE) {
+            record.hasMemoryWrite = true;
+            record.address = storeAddress;
+            record.value = registers[instruction.destinationRegister];
+        }
+        break;
+    default:
+        break;
+    }
+    m_tracer->record(record);
+}
+
+void CPU::emulateThreaded()
+{
+#if defined(__GNUC__)
+    // Direct-threaded dispatch: every handler ends with its own indirect
+    // jump to the next handler, so the branch predictor can learn
+    // per-instruction successor patterns instead of sharing the single
+    // indirect branch of the switch.
+    static const void* const dispatchTable[] = {
+        &&handleUNDECODED,   &&handleBR,     &&handleBR_P,   &&handleBR_Z,
+        &&handleBR_ZP,  &&handleBR_N,   &&handleBR_NP,  &&handleBR_NZ,
+        &&handleBR_NZP, &&handleADD_R,  &&handleADD_I,  &&handleAND_R,
+        &&handleAND_I,  &&handleJSR,    &&handleJSRR,   &&handleLD,
+        &&handleST,     &&handleLDR,    &&handleSTR,    &&handleRTI,
+        &&handleNOT,    &&handleLDI,    &&handleSTI,    &&handleJMP,
+        &&handleNON,    &&handleLEA,    &&handleTRAP};
+    static_assert(std::size(dispatchTable) ==
+                  static_cast<size_t>(Handler::TRAP) + 1);
+    DecodedInstruction instruction;
+    // Kept in a register and added to m_cycleCount before handlers that
+    // can stop the emulator, or charge cycles themselves, run. Every label
+    // charges its own handler, so the dispatch path stays as short as it
+    // was.
+    uint64_t cycles = 0;
+    const CycleTable cycleTable = m_cycleTable;
 
+#define DISPATCH()                                                             \
+    if (m_budget == 0) {                                                       \
+        goto budgetExhausted;                                                  \
+    }                                                                          \
+    --m_budget;                                                                \
+    instruction = m_memory.fetch(m_pc++);                                      \
+    goto* dispatchTable[static_cast<uint8_t>(instruction.handler)]
+#define CHARGE(handler)                                                        \
+    cycles += cycleTable[static_cast<uint8_t>(Handler::handler)]
+#define DISPATCH_IF(isRunning)                                                 \
+    m_cycleCount += cycles;                                                    \
+    cycles = 0;                                                                \
+    if (!(isRunning)) {                                                        \
+        return;                                                                \
+    }                                                                          \
+    DISPATCH()
+
+    DISPATCH();
+handleBR:
+    CHARGE(BR);
+    branch<0b000>(instruction);
+    DISPATCH();
+handleBR_P:
+    CHARGE(BR_P);
+    branch<0b001>(instruction);
+    DISPATCH();
+handleBR_Z:
+    CHARGE(BR_Z);
+    branch<0b010>(instruction);
+    DISPATCH();
+handleBR_ZP:
+    CHARGE(BR_ZP);
+    branch<0b011>(instruction);
+    DISPATCH();
+handleBR_N:
+    CHARGE(BR_N);
+    branch<0b100>(instruction);
+    DISPATCH();
+handleBR_NP:
+    CHARGE(BR_NP);
+    branch<0b101>(instruction);
+    DISPATCH();
+handleBR_NZ:
+    CHARGE(BR_NZ);
+    branch<0b110>(instruction);
+    DISPATCH();
+handleBR_NZP:
+    CHARGE(BR_NZP);
+    branch<0b111>(instruction);
+    DISPATCH();
+handleADD_R:
+    CHARGE(ADD_REGISTER);
+    add<false>(instruction);
+    DISPATCH();
+handleADD_I:
+    CHARGE(ADD_IMMEDIATE);
+    add<true>(instruction);
+    DISPATCH();
+handleAND_R:
+    CHARGE(AND_REGISTER);
+    bitwiseAnd<false>(instruction);
+    DISPATCH();
+handleAND_I:
+    CHARGE(AND_IMMEDIATE);
+    bitwiseAnd<true>(instruction);
+    DISPATCH();
+handleJSR:
+    CHARGE(JSR);
+    jumpToSubroutine<true>(instruction);
+    DISPATCH();
+handleJSRR:
+    CHARGE(JSRR);
+    jumpToSubroutine<false>(instruction);
+    DISPATCH();
+handleLD:
+    CHARGE(LD);
+    DISPATCH_IF(load(instruction));
+handleST:
+    CHARGE(ST);
+    DISPATCH_IF(store(instruction));
+handleLDR:
+    CHARGE(LDR);
+    DISPATCH_IF(loadBaseOffset(instruction));
+handleSTR:
+    CHARGE(STR);
+    DISPATCH_IF(storeBaseOffset(instruction));
+handleRTI:
+    CHARGE(RTI);
+    DISPATCH_IF(returnFromInterrupt(instruction));
+handleNOT:
+    CHARGE(NOT);
+    bitwiseNot(instruction);
+    DISPATCH();
+handleLDI:
+    CHARGE(LDI);
+    DISPATCH_IF(loadIndirect(instruction));
+handleSTI:
+    CHARGE(STI);
+    DISPATCH_IF(storeIndirect(instruction));
+handleJMP:
+    CHARGE(JMP_RET);
+    jump(instruction);
+    DISPATCH();
+handleUNDECODED:
+    // the instruction behind it is charged by executePrivileged()
+    DISPATCH_IF(illegalOpCode(instruction));
+handleNON:
+    CHARGE(NON);
+    DISPATCH_IF(illegalOpCode(instruction));
+handleLEA:
+    CHARGE(LEA);
+    loadEffectiveAddress(instruction);
+    DISPATCH();
+handleTRAP:
+    CHARGE(TRAP);
+    DISPATCH_IF(trap(instruction));
+budgetExhausted:
+    m_cycleCount += cycles;
+    stop(StopReason::BUDGET_EXHAUSTED, m_pc);
+#undef DISPATCH_IF
+#undef CHARGE
+#undef DISPATCH
+#else
+    // NOTE: labels as values are a GNU extension, MSVC only gets the switch
+    emulateSwitch();
+#endif
+}
+
+bool CPU::executeBlock(const Block& block)
+{
+    // the caller charged the whole block, give back what didn't run
+    auto leaveAt = [&](uint16_t pc) {
+        m_pc = pc;
+        m_budget += block.end - pc;
+        m_cycleCount -= block.cyclesFrom[uint16_t(pc - block.start)];
+    };
+    for (const auto& microOp : block.microOps) {
+        const auto& instruction = microOp.instruction;
+        Register destinationRegisterNumber =
+            static_cast<Register>(instruction.destinationRegister);
+        switch (microOp.kind) {
+        case MicroOpKind::ADD:
             m_registers[destinationRegisterNumber] =
-                m_memory[m_registers[baseRegisterNumber] + immediateValue];
-            setConditionalCodes(destinationRegisterNumber);
+                m_registers[instruction.sourceRegister] +
+                (instruction.isImmediate
+                     ? instruction.immediateValue
+                     : m_registers[instruction.secondSourceRegister]);
             break;
-        }
-        case InstructionOpCode::LEA: {
-            Register destinationRegisterNumber =
-                getDestinationRegisterNumber(instruction);
-            uint16_t labelOffset = signExtendRetriveBits(instruction, 8, 9);
-            m_registers[destinationRegisterNumber] = m_pc + labelOffset;
-            setConditionalCodes(destinationRegisterNumber);
-            break;
-        }
-        case InstructionOpCode::NOT: {
-            Register destinationRegisterNumber =
-                getDestinationRegisterNumber(instruction);
-            Register sourceRegisterNumber =
-                getSourceBaseRegisterNumber(instruction);
+        case MicroOpKind::AND:
             m_registers[destinationRegisterNumber] =
-                ~(m_registers[sourceRegisterNumber]);
-            setConditionalCodes(destinationRegisterNumber);
+                m_registers[instruction.sourceRegister] &
+                (instruction.isImmediate
+                     ? instruction.immediateValue
+                     : m_registers[instruction.secondSourceRegister]);
             break;
-        }
-        case InstructionOpCode::ST: {
-            Register sourceRegisterNumber =
-                getDestinationRegisterNumber(instruction);
-            uint16_t labelOffset = signExtendRetriveBits(instruction, 8, 9);
-            m_memory.write(m_pc + labelOffset,
-                           m_registers[sourceRegisterNumber]);
+        case MicroOpKind::NOT:
+            m_registers[destinationRegisterNumber] =
+                ~m_registers[instruction.sourceRegister];
             break;
-        }
-        case InstructionOpCode::STI: {
-            Register sourceRegisterNumber =
-                getDestinationRegisterNumber(instruction);
-            uint16_t labelOffset = signExtendRetriveBits(instruction, 8, 9);
-            m_memory.write(m_memory[m_pc + labelOffset],
-                           m_registers[sourceRegisterNumber]);
+        case MicroOpKind::LD:
+        case MicroOpKind::LDI:
+        case MicroOpKind::LDR: {
+            uint16_t address = microOp.address;
+            if (microOp.kind == MicroOpKind::LDI) {
+                address = m_memory[microOp.address];
+            }
+            else if (microOp.kind == MicroOpKind::LDR) {
+                address = m_registers[instruction.sourceRegister] +
+                          instruction.immediateValue;
+            }
+            uint16_t value = m_memory[address];
+            if (m_memory.hasFault()) {
+                leaveAt(microOp.nextPc);
+                return memoryFault(m_pc - 1);
+            }
+            m_registers[destinationRegisterNumber] = value;
+            if (microOp.kind == MicroOpKind::LDI &&
+                isKeyboardSpin(microOp.nextPc - 1, address, value)) {
+                setConditionalCodes(destinationRegisterNumber);
+                leaveAt(microOp.nextPc);
+                return idleUntilKey(microOp.nextPc - 1);
+            }
             break;
         }
-        case InstructionOpCode::STR: {
-            Register sourceRegisterNumber =
-                getDestinationRegisterNumber(instruction);
-            Register baseRegisterNumber =
-                getSourceBaseRegisterNumber(instruction);
-            uint16_t labelOffset = signExtendRetriveBits(instruction, 5, 6);
-            m_memory.write(m_registers[baseRegisterNumber] + labelOffset,
-                           m_registers[sourceRegisterNumber]);
+        case MicroOpKind::LEA:
+            m_registers[destinationRegisterNumber] = microOp.address;
             break;
-        }
-        case InstructionOpCode::TRAP: {
-            auto trapVector = static_cast<Traps>(retrieveBits(instruction, 7, 8));
-            // NOTE: real implementaion should jump to trap vector table
-            //       that resides in our emulator memory, and that table
-            //       should point to another piece of memory that contains
-            //       trap routines implementaion.
-            switch (trapVector) {
-            case Traps::GETC: {
-                char charFromKeyboard = getchar();
-                m_registers[R0] = charFromKeyboard;
-                break;
+        case MicroOpKind::ST:
+        case MicroOpKind::STI:
+        case MicroOpKind::STR: {
+            uint16_t address = microOp.address;
+            if (microOp.kind == MicroOpKind::STI) {
+                address = m_memory[microOp.address];
             }
-            case Traps::T_OUT: {
-                putchar(m_registers[R0]);
-                break;
+            else if (microOp.kind == MicroOpKind::STR) {
+                address = m_registers[instruction.sourceRegister] +
+                          instruction.immediateValue;
             }
-            case Traps::PUTS: {
-                uint16_t stringPointer = m_registers[R0];
-                std::string out;
-                while (m_memory[stringPointer] != 0) {
-                    out += m_memory[stringPointer++];
-                }
-                std::cout << out << '\n';
-                break;
+            m_memory.write(address, m_registers[destinationRegisterNumber]);
+            if (m_memory.hasFault()) {
+                leaveAt(microOp.nextPc);
+                return memoryFault(m_pc - 1);
             }
-            case Traps::T_IN: {
-                char charFromKeyboard = getchar();
-                putchar(charFromKeyboard);
-                m_registers[R0] = charFromKeyboard;
-                break;
+            if (m_memory.hasTranslatedWrites()) {
+                // the block may have just rewritten itself
+                leaveAt(microOp.nextPc);
+                invalidateBlocks();
+                return true;
             }
-            case Traps::PUTSP: {
-                uint16_t stringPointer = m_registers[R0];
-                std::string out;
-                while (m_memory[stringPointer] != 0) {
-                    uint16_t twoChars = m_memory[stringPointer];
-                    char char1 = retrieveBits(twoChars, 7, 8);
-                    char char2 = retrieveBits(twoChars, 15, 8);
-                    out += m_memory[stringPointer++];
+            break;
+        }
+        case MicroOpKind::BR:
+            m_pc = microOp.nextPc;
+            return execute(instruction);
+        case MicroOpKind::LOAD_IMMEDIATE:
+            m_registers[destinationRegisterNumber] =
+                microOp.nextInstruction.immediateValue;
+            break;
+        case MicroOpKind::ADD_BRANCH:
+        case MicroOpKind::LDR_BRANCH:
+            if (microOp.kind == MicroOpKind::ADD_BRANCH) {
+                m_registers[destinationRegisterNumber] =
+                    m_registers[instruction.sourceRegister] +
+                    (instruction.isImmediate
+                         ? instruction.immediateValue
+                         : m_registers[instruction.secondSourceRegister]);
+            }
+            else {
+                uint16_t value =
+                    m_memory[m_registers[instruction.sourceRegister] +
+                             instruction.immediateValue];
+                if (m_memory.hasFault()) {
+                    // the LDR is the first of the two fused instructions
+                    leaveAt(microOp.nextPc - 1);
+                    return memoryFault(m_pc - 1);
                 }
-                break;
+                m_registers[destinationRegisterNumber] = value;
             }
-            case Traps::HALT: {
-                std::cout << "HALT\n";
-                break;
+            setConditionalCodes(destinationRegisterNumber);
+            m_pc = microOp.nextPc;
+            return execute(microOp.nextInstruction);
+        case MicroOpKind::EXECUTE:
+            m_pc = microOp.nextPc;
+            return execute(instruction);
+        }
+        if (microOp.setsConditionalCodes) {
+            setConditionalCodes(destinationRegisterNumber);
+        }
+    }
+    m_pc = block.end;
+    return true;
+}
+
+void CPU::invalidateBlocks()
+{
+    for (uint16_t address : m_memory.takeTranslatedWrites()) {
+        if (m_jit) {
+            m_jit->invalidate(address);
+        }
+        if (m_blocks.empty()) {
+            continue;
+        }
+        // blocks are short, only the ones starting within
+        // MAX_BLOCK_SIZE words before the address can cover it
+        for (uint32_t start = address >= Block::MAX_BLOCK_SIZE
+                                  ? address - Block::MAX_BLOCK_SIZE + 1
+                                  : 0;
+             start <= address; ++start) {
+            auto& block = m_blocks[start];
+            if (block && address < block->end) {
+                block.reset();
             }
-            default:
-                throw std::runtime_error(
-                    fmt::format("Trap: {} is not supported", static_cast<int>(trapVector)));
+        }
+    }
+}
+
+bool CPU::runBlock()
+{
+    if (m_blocks.empty()) {
+        m_blocks.resize(std::numeric_limits<uint16_t>::max() + 1);
+    }
+    // stores that didn't run in a block (the end of a slice, trap
+    // routines) may have hit translated code too
+    if (m_memory.hasTranslatedWrites()) {
+        invalidateBlocks();
+    }
+    auto& block = m_blocks[m_pc];
+    if (!block) {
+        block = std::make_unique<Block>(
+            translateBlock(m_memory, m_pc, m_cycleTable));
+    }
+    uint32_t blockLength = block->end - block->start;
+    if (m_budget < blockLength) {
+        // finish the budget one instruction at a time
+        emulateSwitch();
+        return false;
+    }
+    m_budget -= blockLength;
+    m_cycleCount += block->cyclesFrom[0];
+    return executeBlock(*block);
+}
+
+void CPU::emulateBlocks()
+{
+    while (runBlock()) {
+    }
+}
+
+bool CPU::executeNative(void* nativeBlock)
+{
+    Jit::State state{};
+    std::copy(m_registers.begin(), m_registers.end(), state.registers);
+    state.pc = m_pc;
+    state.conditionValue = m_conditionValue;
+    state.budget = m_budget;
+    state.cycles = m_cycleCount;
+    m_jit->run(m_memory, state, nativeBlock);
+
+    std::copy(std::begin(state.registers), std::end(state.registers),
+              m_registers.begin());
+    m_pc = state.pc;
+    m_conditionValue = state.conditionValue;
+    m_budget = state.budget;
+    m_cycleCount = state.cycles;
+    if (state.exitReason == Jit::ExitReason::BUDGET) {
+        emulateSwitch();
+        return false;
+    }
+    if (state.exitReason == Jit::ExitReason::INTERPRET) {
+        if (m_budget == 0) {
+            return stop(StopReason::BUDGET_EXHAUSTED, m_pc);
+        }
+        --m_budget;
+        auto instruction = m_memory.fetch(m_pc++);
+        m_cycleCount +=
+            m_cycleTable[static_cast<uint8_t>(instruction.handler)];
+        bool isRunning = execute(instruction);
+        if (m_memory.hasTranslatedWrites()) {
+            invalidateBlocks();
+        }
+        return isRunning;
+    }
+    return true;
+}
+
+void CPU::emulateJit()
+{
+    if (!m_jit) {
+        m_jit = std::make_unique<Jit>();
+    }
+    while (true) {
+        if (m_memory.hasTranslatedWrites()) {
+            invalidateBlocks();
+        }
+        void* nativeBlock = m_jit->find(m_pc);
+        if (!nativeBlock && m_jit->isHot(m_pc)) {
+            nativeBlock = m_jit->compile(m_memory, m_pc, m_cycleTable);
+        }
+        if (nativeBlock) {
+            if (!executeNative(nativeBlock)) {
+                break;
             }
-            break;
+            continue;
         }
-        case InstructionOpCode::RTI: {
-            throw std::runtime_error(
-                "RTI insturction is not supported by this emulator");
+
+        if (!runBlock()) {
             break;
         }
-        default: {
-            throw std::runtime_error(
-                fmt::format("Illegal instruction op code: {}"));
+    }
+}
+
+void CPU::endSlice()
+{
+    m_withheldBudget += m_budget;
+    m_budget = 0;
+}
+
+void CPU::handleEvents()
+{
+    using Event = EventScheduler::Event;
+    Timer& timer = m_memory.timer();
+    Keyboard& keyboard = m_memory.keyboard();
+    if (m_inputLog) {
+        m_inputLog->advance(m_instructionCount);
+        m_events.schedule(Event::INPUT,
+                          m_inputLog->nextArrival(m_instructionCount));
+    }
+    if (timer.takeRestart()) {
+        if (timer.interval() != 0) {
+            m_events.schedule(Event::TIMER,
+                              m_instructionCount + timer.interval());
         }
+        else {
+            m_events.cancel(Event::TIMER);
         }
     }
-    catch (...) {
-        throw;
+    if (!keyboard.isInterruptEnabled()) {
+        m_events.cancel(Event::KEYBOARD_POLL);
+    }
+    else if (!m_events.isScheduled(Event::KEYBOARD_POLL)) {
+        m_events.schedule(Event::KEYBOARD_POLL, m_instructionCount);
+    }
+
+    if (m_events.takeDue(Event::TIMER, m_instructionCount)) {
+        timer.expire();
+        m_events.schedule(Event::TIMER, m_instructionCount + timer.interval());
+    }
+    if (m_events.takeDue(Event::KEYBOARD_POLL, m_instructionCount)) {
+        keyboard.poll();
+        m_events.schedule(Event::KEYBOARD_POLL,
+                          m_instructionCount + KEYBOARD_POLL_INTERVAL);
     }
 }
 
-void CPU::emulate()
+bool CPU::takeInterrupts()
 {
     while (true) {
-        // User is responsible for not mixing data and insturctions
-        // as emulator can't differentiate insturction from
-        // raw data.
-        uint16_t instruction = m_memory[m_pc++];
-        emulate(instruction);
-        if (getOpCode(instruction) == InstructionOpCode::TRAP &&
-            static_cast<Traps>(retrieveBits(instruction, 7, 8)) ==
-                Traps::HALT) {
+        uint8_t priority = (m_processorStatus & PRIORITY_LEVEL) >> 8;
+        Timer& timer = m_memory.timer();
+        if (timer.isInterruptRequested() &&
+            Timer::INTERRUPT_PRIORITY > priority) {
+            timer.acknowledge();
+            if (!interrupt(Timer::INTERRUPT_VECTOR,
+                           Timer::INTERRUPT_PRIORITY)) {
+                return false;
+            }
+            continue;
+        }
+        // stays requested until the key is read
+        if (m_memory.keyboard().isInterruptRequested() &&
+            Keyboard::INTERRUPT_PRIORITY > priority) {
+            if (!interrupt(Keyboard::INTERRUPT_VECTOR,
+                           Keyboard::INTERRUPT_PRIORITY)) {
+                return false;
+            }
+            continue;
+        }
+        return true;
+    }
+}
+
+bool CPU::interrupt(uint8_t vector, uint8_t priority)
+{
+    uint16_t processorStatus = this->processorStatus();
+    if (isUserMode()) {
+        m_savedUserStack = m_registers[R6];
+        m_registers[R6] = m_savedSupervisorStack;
+    }
+    m_processorStatus = priority << 8;
+    m_memory.setPrivileged(true);
+    push(processorStatus);
+    push(m_pc);
+    uint16_t handler = m_memory[OsImage::INTERRUPT_VECTOR_TABLE + vector];
+    if (m_memory.hasFault()) {
+        return memoryFault(m_pc);
+    }
+    m_pc = handler;
+    updatePrivilege();
+    if (m_profiler) {
+        m_profiler->call(handler);
+    }
+    return true;
+}
+
+void CPU::runSlices(uint64_t maxInstructions)
+{
+    bool isUnbounded = maxInstructions == UNLIMITED;
+    uint64_t retired = 0;
+    do {
+        handleEvents();
+        if (!takeInterrupts()) {
             break;
         }
+        uint64_t slice = maxInstructions - retired;
+        uint64_t next = m_events.next();
+        if (next != EventScheduler::NEVER) {
+            slice = std::min(slice, next - m_instructionCount);
+        }
+        m_budget = slice;
+        m_withheldBudget = 0;
+        // A key is all the program can be waiting for. A replayed key
+        // comes at its instruction count, not by waiting.
+        m_canWaitForInput =
+            isUnbounded &&
+            !m_events.isScheduled(EventScheduler::Event::TIMER) &&
+            !(m_inputLog && m_inputLog->isReplaying());
+        switch (isObserved() ? Engine::SWITCH : m_engine) {
+        case Engine::THREADED:
+            emulateThreaded();
+            break;
+        case Engine::BLOCK:
+            emulateBlocks();
+            break;
+        case Engine::JIT:
+            emulateJit();
+            break;
+        default:
+            isObserved() ? emulateObserved() : emulateSwitch();
+        }
+        uint64_t sliceRetired = slice - m_budget - m_withheldBudget;
+        retired += sliceRetired;
+        m_instructionCount += sliceRetired;
+    } while (m_runResult.reason == StopReason::BUDGET_EXHAUSTED &&
+             retired < maxInstructions);
+    m_runResult.instructionsRetired = retired;
+}
+
+RunResult CPU::run(uint64_t maxInstructions) noexcept
+{
+    // attributes may have changed since blocks were translated
+    if (m_memory.hasTranslatedWrites()) {
+        invalidateBlocks();
     }
+    uint64_t cycleCount = m_cycleCount;
+    runSlices(maxInstructions);
+
+    m_output.flush();
+    m_runResult.cycles = m_cycleCount - cycleCount;
+    m_runResult.finalPc = m_pc;
+    return m_runResult;
+}
 
-    restore_input_buffering();
+void CPU::emulate()
+{
+    auto result = run();
+    if (result.reason != StopReason::HALT) {
+        throw std::runtime_error(describeStop(result));
+    }
+}
+
+std::string describeStop(const RunResult& result)
+{
+    switch (result.reason) {
+    case StopReason::HALT:
+        return fmt::format("Halted at address: {}", result.pc);
+    case StopReason::ILLEGAL_READ:
+        return fmt::format("Illegal memory access at address: {}",
+                           result.detail);
+    case StopReason::ILLEGAL_WRITE:
+        return fmt::format("Illegal memory write at address: {}",
+                           result.detail);
+    case StopReason::ILLEGAL_OPCODE:
+        return fmt::format("Illegal instruction op code: {}", result.detail);
+    case StopReason::RTI:
+        return "RTI in user mode";
+    case StopReason::UNSUPPORTED_TRAP:
+        return fmt::format("Trap: {} is not supported", result.detail);
+    case StopReason::BUDGET_EXHAUSTED:
+        return fmt::format("Instruction limit reached at address: {}",
+                           result.pc);
+    case StopReason::BREAKPOINT:
+        return fmt::format("Breakpoint at address: {}", result.pc);
+    case StopReason::END_OF_INPUT:
+        return fmt::format("Waiting for input after its end at address: {}",
+                           result.pc);
+    }
+    return "Unknown stop reason";
 }
 
 void CPU::dumpMemory(uint16_t start, uint16_t size)
 {
     for (uint16_t i = start; i < start + size; ++i) {
         std::cout << "memory[ " << i << " ]"
-                  << " = " << m_memory[i] << std::endl;
+                  << " = " << m_memory[i] << '\n';
     }
 }
\ No newline at end of file
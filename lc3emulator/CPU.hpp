@@ -1,68 +1,300 @@
 #pragma once
 
+#include "block.hpp"
+#include "console.hpp"
+#include "cycles.hpp"
+#include "events.hpp"
+#include "jit.hpp"
 #include "lc3memory.hpp"
+#include "profiler.hpp"
+#include "trace.hpp"
 
 #include <array>
+#include <bitset>
+#include <iosfwd>
+#include <limits>
+#include <memory>
 #include <string>
+#include <vector>
 
-enum class InstructionOpCode : uint8_t {
-    BR = 0b0000,
-    ADD = 0b0001,
-    LD = 0b0010,
-    ST = 0b0011,
-    JSR_JSRR = 0b0100,
-    AND = 0b0101,
-    LDR = 0b0110,
-    STR = 0b0111,
-    RTI = 0b1000,
-    NOT = 0b1001,
-    LDI = 0b1010,
-    STI = 0b1011,
-    JMP_RET = 0b1100,
-    NON = 0b1101,
-    LEA = 0b1110,
-    TRAP = 0b1111,
+// Interpreter loop used by CPU::emulate(). All of them share the
+// instruction handlers, they only differ in how the next handler is found.
+enum class Engine : uint8_t {
+    SWITCH,
+    THREADED,
+    // runs translated basic blocks, see translateBlock
+    BLOCK,
+    // BLOCK plus native code for hot blocks, same as BLOCK where the JIT
+    // isn't available
+    JIT,
 };
 
-enum class Traps : uint8_t {
-    GETC = 0x20,
-    T_OUT = 0x21, // add T_ to avoid name collision 
-    PUTS = 0x22,
-    T_IN = 0x23,
-    PUTSP = 0x24,
-    HALT = 0x25
+// "switch", "threaded", "block" or "jit", false for anything else
+bool parseEngine(const std::string& name, Engine& engine);
+
+// Why the emulator stopped. Everything but HALT is a fault of the program
+// being run.
+enum class StopReason : uint8_t {
+    HALT,
+    ILLEGAL_READ,
+    ILLEGAL_WRITE,
+    ILLEGAL_OPCODE,
+    RTI,
+    UNSUPPORTED_TRAP,
+    // fetched a word with the BREAKPOINT attribute, PC points at it
+    BREAKPOINT,
+    // ran the requested number of instructions, PC is the next one to run
+    BUDGET_EXHAUSTED,
+    // polled the keyboard after the input ended, PC points at the LDI
+    END_OF_INPUT,
 };
 
-enum Register {
-    R0 = 0, R1 = 1, R2 = 2, R3 = 3, R4 = 4, R5 = 5, R6 = 6, R7 = 7
+struct RunResult {
+    StopReason reason;
+    // address of the instruction that stopped the emulator
+    uint16_t pc;
+    // faulting address, op code or trap vector, depending on `reason`
+    uint16_t detail;
+    // including the one that stopped the emulator
+    uint64_t instructionsRetired;
+    // what they took by the CPU's CycleModel
+    uint64_t cycles;
+    // where the next run() continues from
+    uint16_t finalPc;
 };
 
+std::string describeStop(const RunResult& result);
+
 class CPU {
   public:
 
     static constexpr uint8_t NUMBER_OF_REGISTERS = 8;
+    // PSR[15], clear in supervisor mode
+    static constexpr uint16_t USER_MODE = 1 << 15;
+    // PSR[10:8], interrupts of this priority or lower wait
+    static constexpr uint16_t PRIORITY_LEVEL = 0x7 << 8;
+    // where the supervisor stack starts out, it grows down from there
+    static constexpr uint16_t SUPERVISOR_STACK = 0x3000;
     using Registers = std::array<uint16_t, NUMBER_OF_REGISTERS>;
+    struct ConditionalCode {
+        bool N;
+        bool Z;
+        bool P;
+    };
 
   public:
-    CPU();
-    void load(const std::string& fileToRun);
+    CPU(Engine engine = Engine::SWITCH);
+    // An image is an origin followed by the words that go there, in host
+    // byte order (what lc3assembler writes) or swapped (what most other
+    // LC-3 assemblers write). Images after the first are extra segments,
+    // data or an OS, the PC is set to the origin of the first. All of them
+    // are checked before anything is copied, throws std::runtime_error.
+    void load(const std::string& fileToRun, bool dumpLoadedWords = false);
+    void load(const std::vector<std::string>& images,
+              bool dumpLoadedWords = false);
+    // Where the console traps and the keyboard registers read and write,
+    // a TerminalIo unless set. The device has to outlive the runs that
+    // use it.
+    void setIo(IoDevice& io);
+    // setIo() with a StreamIo over the two streams
+    void setConsole(std::istream& input, std::ostream& output);
+    IoDevice& io() { return *m_io; }
+    // setIo() with `log`, which also learns how far the run is, so input
+    // is recorded or replayed at exact instruction counts on any engine
+    void setInputLog(InputLog& log);
+    // TRAP goes through the vector table at x0000 (see OsImage). Vectors
+    // that still point at the routine of the built-in OS run natively
+    // instead unless turned off here, so only programs that install their
+    // own handlers pay for it. Output, the registers after a trap that
+    // returns and how the run stops are the same either way.
+    void setNativeTrap(uint8_t vector, bool isNative);
+    // Output is buffered, see OutputSink. It reaches the stream when run()
+    // returns at the latest, this hands it over right away.
+    void flushOutput();
+    // CycleModel::standard() unless changed, changing it drops all
+    // translated code
+    void setCycleModel(const CycleModel& model);
+    const CycleModel& cycleModel() const { return m_cycleModel; }
+    // retired instructions and their cycles since the CPU was created
+    uint64_t instructionCount() const { return m_instructionCount; }
+    uint64_t cycleCount() const { return m_cycleCount; }
+    // Runs every instruction through `profiler` until set to nullptr. The
+    // engine is ignored meanwhile, a profiled run interprets.
+    void setProfiler(Profiler* profiler) { m_profiler = profiler; }
+    // Records every instruction to `tracer` until set to nullptr, the
+    // same way. What taking an interrupt pushes isn't recorded, the next
+    // record is the first instruction of its handler.
+    void setTracer(TraceWriter* tracer) { m_tracer = tracer; }
+    static constexpr uint64_t UNLIMITED =
+        std::numeric_limits<uint64_t>::max();
+
+    // Runs until HALT, a fault or `maxInstructions` instructions, faults
+    // are returned instead of thrown. Block engines check the budget once
+    // per block, so a long loop costs nothing extra. Interrupts are taken
+    // between slices of the run that end where the next device event is
+    // due (see EventScheduler).
+    RunResult run(uint64_t maxInstructions = UNLIMITED) noexcept;
+    // same as run(), but throws std::runtime_error on faults
     void emulate();
     void emulate(uint16_t instruction);
+    ConditionalCode conditionalCodes() const;
+    // privilege, priority level and condition codes
+    uint16_t processorStatus() const;
+    // Remembers memory, registers, PC and PSR, reset() goes
+    // back to them. Resetting only copies the memory pages written since,
+    // so running a program over and over doesn't reload it.
+    void snapshot();
+    void reset();
+    // Machine state (memory, registers, PC, PSR, the stack pointers and
+    // the state of the built-in devices) in a file, loadSnapshot() maps it
+    // instead of parsing it. Both throw std::runtime_error on failure.
+    void saveSnapshot(const std::string& path) const;
+    void loadSnapshot(const std::string& path);
 
   private:
+    // All handlers that can stop the emulator return false once it has
+    // stopped, m_runResult says why.
+    bool execute(DecodedInstruction instruction);
+    void emulateSwitch();
+    void emulateThreaded();
+    void emulateBlocks();
+    // translates the block at m_pc if needed and runs it, or interprets
+    // the rest of the budget if the block doesn't fit in it
+    bool runBlock();
+    bool executeBlock(const Block& block);
+    void invalidateBlocks();
+    void emulateJit();
+    // emulateSwitch() that tells m_profiler and m_tracer about every
+    // instruction
+    void emulateObserved();
+    bool isObserved() const { return m_profiler || m_tracer; }
+    // where ST, STR or STI at `pc` is about to store
+    uint16_t storeAddress(uint16_t pc, DecodedInstruction instruction) const;
+    void trace(uint16_t pc, DecodedInstruction instruction, bool isRunning,
+               const Registers& registers, uint16_t storeAddress);
+    bool executeNative(void* nativeBlock);
+
+    // one instantiation per Handler variant
+    template <bool isImmediate> void add(DecodedInstruction instruction);
+    template <bool isImmediate> void bitwiseAnd(DecodedInstruction instruction);
+    template <uint8_t nzp> void branch(DecodedInstruction instruction);
+    void jump(DecodedInstruction instruction);
+    template <bool isImmediate>
+    void jumpToSubroutine(DecodedInstruction instruction);
+    bool load(DecodedInstruction instruction);
+    bool loadIndirect(DecodedInstruction instruction);
+    bool loadBaseOffset(DecodedInstruction instruction);
+    void loadEffectiveAddress(DecodedInstruction instruction);
+    void bitwiseNot(DecodedInstruction instruction);
+    bool store(DecodedInstruction instruction);
+    bool storeIndirect(DecodedInstruction instruction);
+    bool storeBaseOffset(DecodedInstruction instruction);
+    bool trap(DecodedInstruction instruction);
+    // GETC and IN with an input log and no key yet: the TRAP is taken back
+    // and runs again in the next slice, which starts with the key logged.
+    // False if there is a key or none will come.
+    bool awaitLoggedInput();
+    bool returnFromInterrupt(DecodedInstruction instruction);
+    bool illegalOpCode(DecodedInstruction instruction);
+    // TRAP to a routine the program installed, or with native traps off
+    bool callTrapRoutine(uint16_t routine);
+    // Runs the system space word at `pc`, only privileged code (a trap
+    // routine) can, and drops the privilege once it returns to user space.
+    bool executePrivileged(uint16_t pc);
+    // System space is open to supervisor mode and to trap routines, which
+    // run in system space whatever the mode.
+    void updatePrivilege();
+    void setProcessorStatus(uint16_t processorStatus);
+    bool isUserMode() const { return m_processorStatus & USER_MODE; }
+    // on the supervisor stack
+    void push(uint16_t value);
+    uint16_t pop();
+    // Runs the engine for the rest of the run, in slices that end at the
+    // next event.
+    void runSlices(uint64_t maxInstructions);
+    // brings device events up to m_instructionCount
+    void handleEvents();
+    // takes the most urgent interrupt above the current priority level,
+    // false if that stopped the emulator
+    bool takeInterrupts();
+    bool interrupt(uint8_t vector, uint8_t priority);
+    // Ends the current slice after this instruction, so run() gets to
+    // events and interrupts that became due. The rest of the budget is
+    // kept for the next slice.
+    void endSlice();
+    // Whether the LDI at `pc`, which read `value` from `address`, is half
+    // of a loop that does nothing but poll KBSR until a key is pressed:
+    //     POLL LDI Rx, KBSR
+    //          BRzp POLL (or BRz POLL, while KBSR reads zero)
+    bool isKeyboardSpin(uint16_t pc, uint16_t address, uint16_t value);
+    // Called with that LDI retired. An unbounded run blocks until a key
+    // comes and stops if none ever will, a bounded one fast-forwards
+    // exactly as if it had kept spinning, a poll interval at a time.
+    // False if that stopped the emulator.
+    bool idleUntilKey(uint16_t pc);
+    // always returns false
+    bool stop(StopReason reason, uint16_t pc, uint16_t detail = 0);
+    // stops with the fault Memory has recorded
+    bool memoryFault(uint16_t pc);
     void dumpMemory(uint16_t start, uint16_t size);
-    InstructionOpCode getOpCode(uint16_t instruction) const;
     void setConditionalCodes(Register destinationRegister);
+    // n/z/p bits of a value, in the same order as in BR
+    static uint8_t conditionBits(uint16_t value);
+
+  private:
+    struct Snapshot {
+        Registers registers;
+        uint16_t pc;
+        uint16_t conditionValue;
+        uint16_t processorStatus;
+        uint16_t savedUserStack;
+        uint16_t savedSupervisorStack;
+    };
 
   private:
     Memory m_memory;
     Registers m_registers;
     uint16_t m_pc;
-    struct ConditionalCode {
-        bool N;
-        bool Z;
-        bool P;
-    } m_conditionalCodes;
+    // Result of the last flag-setting instruction, N/Z/P are only derived
+    // from it when something reads them. Starts as zero, so Z is set.
+    uint16_t m_conditionValue;
+    // PSR without the condition codes
+    uint16_t m_processorStatus;
+    // R6 of the mode that isn't running
+    uint16_t m_savedUserStack;
+    uint16_t m_savedSupervisorStack;
+    Engine m_engine;
+    RunResult m_runResult;
+    // instructions left in the current slice of run()
+    uint64_t m_budget;
+    // budget endSlice() took away from the slice
+    uint64_t m_withheldBudget;
+    // nothing but a key can end the slice, so waiting for input is fine
+    bool m_canWaitForInput;
+    // retired since the CPU was created, the clock of m_events
+    uint64_t m_instructionCount;
+    // Engines charge instructions as they run them, blocks charge all of
+    // their cycles up front and give back what they didn't run.
+    uint64_t m_cycleCount;
+    CycleModel m_cycleModel;
+    CycleTable m_cycleTable;
+    Profiler* m_profiler;
+    TraceWriter* m_tracer;
+    // see setInputLog(), the same device as m_io then
+    InputLog* m_inputLog;
+    EventScheduler m_events;
+    // see setNativeTrap()
+    std::bitset<256> m_nativeTraps;
+    // the default terminal or the streams of setConsole()
+    std::unique_ptr<IoDevice> m_ownedIo;
+    IoDevice* m_io;
+    OutputSink m_output;
+    // indexed by start PC, allocated by the first runBlock()
+    std::vector<std::unique_ptr<Block>> m_blocks;
+    // only Engine::JIT has one, built by the first emulateJit()
+    std::unique_ptr<Jit> m_jit;
+    Snapshot m_snapshot;
     
     friend class CPUTests;
+    friend class Lockstep;
 };
\ No newline at end of file
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <charconv>
+#include <cstdint>
+#include <string>
+#include <system_error>
+
+// Parsing shared by the command lines of lc3emulator, lc3batch and lc3trace.
+
+// a plain decimal count, nothing before or after it
+inline bool parseCount(const std::string& text, uint64_t& count)
+{
+    const char* end = text.data() + text.size();
+    auto [parsed, error] = std::from_chars(text.data(), end, count);
+    return !text.empty() && error == std::errc() && parsed == end;
+}
@@ -0,0 +1,435 @@
+#include <algorithm>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <fmt/core.h>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <thread>
+
+#include "CPU.hpp"
+#include "arguments.hpp"
+#include "lockstep.hpp"
+
+// Runs many LC-3 programs in one process. Every line of the manifest is a
+// job:
+//
+//     image [input|-] [expectedOutput|-] [maxInstructions|-]
+//
+// `input` is fed to GETC/IN and the keyboard, `expectedOutput` is compared
+// with everything the program printed (including the trailing HALT), both
+// without touching stdio. Relative paths are relative to the manifest,
+// empty lines and lines starting with # are skipped. Results are printed
+// as JSON lines, in completion order.
+//
+// With --lockstep, jobs that run the same image with the same instruction
+// limit are run together on one Lockstep, which is much faster when they
+// mostly take the same path through the program (parameter sweeps).
+
+namespace {
+struct Job {
+    std::filesystem::path image;
+    std::optional<std::filesystem::path> input;
+    std::optional<std::filesystem::path> expectedOutput;
+    uint64_t maxInstructions;
+};
+
+std::string readFile(const std::filesystem::path& path)
+{
+    std::ifstream ifs(path, std::ios::binary);
+    if (!ifs.is_open()) {
+        throw std::runtime_error(
+            fmt::format("Couldn't open a file: `{}`", path.string()));
+    }
+    std::stringstream content;
+    content << ifs.rdbuf();
+    return content.str();
+}
+
+std::vector<Job> readManifest(const std::filesystem::path& manifest)
+{
+    std::ifstream ifs(manifest);
+    if (!ifs.is_open()) {
+        throw std::runtime_error(
+            fmt::format("Couldn't open a file: `{}`", manifest.string()));
+    }
+
+    auto directory = manifest.parent_path();
+    auto optionalPath = [&](const std::string& field)
+        -> std::optional<std::filesystem::path> {
+        if (field.empty() || field == "-") {
+            return std::nullopt;
+        }
+        return directory / field;
+    };
+
+    std::vector<Job> jobs;
+    std::string line;
+    for (size_t lineNumber = 1; std::getline(ifs, line); ++lineNumber) {
+        std::istringstream fields(line);
+        std::string image, input, expectedOutput, maxInstructions;
+        fields >> image >> input >> expectedOutput >> maxInstructions;
+        if (image.empty() || image[0] == '#') {
+            continue;
+        }
+
+        Job job{.image = directory / image,
+                .input = optionalPath(input),
+                .expectedOutput = optionalPath(expectedOutput),
+                .maxInstructions = CPU::UNLIMITED};
+        if (!maxInstructions.empty() && maxInstructions != "-") {
+            if (!parseCount(maxInstructions, job.maxInstructions)) {
+                throw std::runtime_error(
+                    fmt::format("{}:{}: invalid instruction limit `{}`",
+                                manifest.string(), lineNumber,
+                                maxInstructions));
+            }
+        }
+        jobs.push_back(std::move(job));
+    }
+    return jobs;
+}
+
+std::string toJson(const std::string& value)
+{
+    std::string json = "\"";
+    for (unsigned char c : value) {
+        switch (c) {
+        case '"':
+            json += "\\\"";
+            break;
+        case '\\':
+            json += "\\\\";
+            break;
+        case '\n':
+            json += "\\n";
+            break;
+        case '\r':
+            json += "\\r";
+            break;
+        case '\t':
+            json += "\\t";
+            break;
+        default:
+            if (c < 0x20 || c >= 0x7F) {
+                json += fmt::format("\\u{:04x}", c);
+            }
+            else {
+                json += c;
+            }
+        }
+    }
+    return json + "\"";
+}
+
+const char* stopReasonName(StopReason reason)
+{
+    switch (reason) {
+    case StopReason::HALT:
+        return "HALT";
+    case StopReason::ILLEGAL_READ:
+        return "ILLEGAL_READ";
+    case StopReason::ILLEGAL_WRITE:
+        return "ILLEGAL_WRITE";
+    case StopReason::ILLEGAL_OPCODE:
+        return "ILLEGAL_OPCODE";
+    case StopReason::RTI:
+        return "RTI";
+    case StopReason::UNSUPPORTED_TRAP:
+        return "UNSUPPORTED_TRAP";
+    case StopReason::BREAKPOINT:
+        return "BREAKPOINT";
+    case StopReason::BUDGET_EXHAUSTED:
+        return "BUDGET_EXHAUSTED";
+    case StopReason::END_OF_INPUT:
+        return "END_OF_INPUT";
+    }
+    return "UNKNOWN";
+}
+
+std::string jobHeader(const Job& job, size_t index)
+{
+    return fmt::format("{{\"job\":{},\"image\":{}", index,
+                       toJson(job.image.string()));
+}
+
+std::string jobResult(const Job& job, const RunResult& result,
+                      const std::string& output)
+{
+    std::string json = fmt::format(
+        ",\"reason\":\"{}\",\"pc\":{},\"instructions\":{},\"cycles\":{}",
+        stopReasonName(result.reason), result.pc, result.instructionsRetired,
+        result.cycles);
+    if (result.reason != StopReason::HALT) {
+        json += fmt::format(",\"message\":{}", toJson(describeStop(result)));
+    }
+    if (job.expectedOutput) {
+        bool isPassed = result.reason == StopReason::HALT &&
+                        output == readFile(*job.expectedOutput);
+        json += fmt::format(",\"passed\":{}", isPassed);
+    }
+    return json + fmt::format(",\"output\":{}", toJson(output));
+}
+
+std::string jobError(const std::exception& e)
+{
+    return fmt::format(",\"error\":{}", toJson(e.what()));
+}
+
+// Every worker keeps the CPU of the last image it loaded and resets it to
+// the snapshot taken right after loading when the next job runs the same
+// image, which only copies back the pages the previous job wrote.
+CPU& loadImage(const std::filesystem::path& image, Engine engine)
+{
+    struct LoadedImage {
+        std::filesystem::path image;
+        std::unique_ptr<CPU> cpu;
+    };
+    thread_local LoadedImage loaded;
+    if (loaded.cpu && loaded.image == image) {
+        loaded.cpu->reset();
+        return *loaded.cpu;
+    }
+
+    loaded = {};
+    auto cpu = std::make_unique<CPU>(engine);
+    cpu->load(image.string());
+    cpu->snapshot();
+    loaded = {image, std::move(cpu)};
+    return *loaded.cpu;
+}
+
+// one JSON object, without the trailing newline
+std::string runJob(const Job& job, size_t index, Engine engine)
+{
+    std::string json = jobHeader(job, index);
+    try {
+        MemoryIo io(job.input ? readFile(*job.input) : "");
+        CPU& cpu = loadImage(job.image, engine);
+        cpu.setIo(io);
+        RunResult result;
+        try {
+            result = cpu.run(job.maxInstructions);
+        }
+        catch (const std::exception&) {
+            cpu.setConsole(std::cin, std::cout);
+            throw;
+        }
+        // the worker's CPU outlives this job's io
+        cpu.setConsole(std::cin, std::cout);
+        json += jobResult(job, result, io.output());
+    }
+    catch (const std::exception& e) {
+        json += jobError(e);
+    }
+    return json + "}";
+}
+
+// Runs jobs that share an image and an instruction limit as the lanes of
+// one Lockstep, one JSON object per job.
+std::vector<std::string> runLockstep(const std::vector<Job>& jobs,
+                                     const std::vector<size_t>& indices,
+                                     Engine engine)
+{
+    std::vector<std::string> results;
+    std::vector<size_t> laneJobs;
+    std::vector<MemoryIo> consoles;
+    for (size_t index : indices) {
+        const auto& job = jobs[index];
+        try {
+            consoles.emplace_back(job.input ? readFile(*job.input) : "");
+            laneJobs.push_back(index);
+        }
+        catch (const std::exception& e) {
+            results.push_back(jobHeader(job, index) + jobError(e) + "}");
+        }
+    }
+    if (laneJobs.empty()) {
+        return results;
+    }
+
+    const auto& first = jobs[laneJobs.front()];
+    Lockstep lockstep(laneJobs.size(), engine);
+    try {
+        for (size_t lane = 0; lane < laneJobs.size(); ++lane) {
+            lockstep.lane(lane).setIo(consoles[lane]);
+            lockstep.lane(lane).load(first.image.string());
+        }
+    }
+    catch (const std::exception& e) {
+        for (size_t index : laneJobs) {
+            results.push_back(jobHeader(jobs[index], index) + jobError(e) +
+                              "}");
+        }
+        return results;
+    }
+
+    auto runResults = lockstep.run(first.maxInstructions);
+    for (size_t lane = 0; lane < laneJobs.size(); ++lane) {
+        const auto& job = jobs[laneJobs[lane]];
+        std::string json = jobHeader(job, laneJobs[lane]);
+        try {
+            json += jobResult(job, runResults[lane], consoles[lane].output());
+        }
+        catch (const std::exception& e) {
+            json += jobError(e);
+        }
+        results.push_back(json + "}");
+    }
+    return results;
+}
+
+// Every worker owns a deque of job indices. It takes jobs from the front of
+// its own deque and, once that is empty, steals from the back of the
+// others', so a few slow programs don't leave the rest of the cores idle.
+class WorkStealingPool {
+  public:
+    WorkStealingPool(size_t workerCount) : m_queues(workerCount) {}
+
+    void run(size_t jobCount, const std::function<void(size_t)>& runJob)
+    {
+        for (size_t job = 0; job < jobCount; ++job) {
+            m_queues[job % m_queues.size()].jobs.push_back(job);
+        }
+
+        std::vector<std::thread> workers;
+        for (size_t worker = 0; worker < m_queues.size(); ++worker) {
+            workers.emplace_back([this, worker, &runJob] {
+                while (auto job = take(worker)) {
+                    runJob(*job);
+                }
+            });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+  private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<size_t> jobs;
+    };
+
+    std::optional<size_t> take(size_t worker)
+    {
+        {
+            auto& own = m_queues[worker];
+            std::lock_guard lock(own.mutex);
+            if (!own.jobs.empty()) {
+                size_t job = own.jobs.front();
+                own.jobs.pop_front();
+                return job;
+            }
+        }
+        // no new jobs are ever added, so one pass over the others is enough
+        for (size_t i = 1; i < m_queues.size(); ++i) {
+            auto& victim = m_queues[(worker + i) % m_queues.size()];
+            std::lock_guard lock(victim.mutex);
+            if (!victim.jobs.empty()) {
+                size_t job = victim.jobs.back();
+                victim.jobs.pop_back();
+                return job;
+            }
+        }
+        return std::nullopt;
+    }
+
+    std::vector<Queue> m_queues;
+};
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    std::string manifest;
+    Engine engine = Engine::SWITCH;
+    bool isLockstep = false;
+    bool isBadArgument = false;
+    size_t workerCount = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 1; i < argc; ++i) {
+        std::string argument = argv[i];
+        if (argument == "--engine" && i + 1 < argc) {
+            std::string engineName = argv[++i];
+            if (!parseEngine(engineName, engine)) {
+                std::cerr << "unknown engine: " << engineName << std::endl;
+                return -1;
+            }
+        }
+        else if (argument == "--jobs" && i + 1 < argc) {
+            std::string count = argv[++i];
+            uint64_t jobCount = 0;
+            if (!parseCount(count, jobCount)) {
+                std::cerr << "invalid job count: " << count << std::endl;
+                return -1;
+            }
+            workerCount = std::max<size_t>(1, jobCount);
+        }
+        else if (argument == "--lockstep") {
+            isLockstep = true;
+        }
+        else if (argument.rfind("--", 0) == 0) {
+            // an unknown option or one missing its value
+            isBadArgument = true;
+        }
+        else {
+            manifest = argument;
+        }
+    }
+
+    if (isBadArgument || manifest.empty()) {
+        std::cerr << "usage: lc3batch [--engine switch|threaded|block|jit] "
+                     "[--jobs count] [--lockstep] manifest"
+                  << std::endl;
+        return -1;
+    }
+
+    std::vector<Job> jobs;
+    try {
+        jobs = readManifest(manifest);
+    }
+    catch (const std::exception& e) {
+        std::cerr << "LC3 BATCH ERROR: " << e.what() << std::endl;
+        return -1;
+    }
+
+    // without --lockstep every job is a group of its own
+    std::vector<std::vector<size_t>> groups;
+    std::map<std::pair<std::filesystem::path, uint64_t>, size_t> groupOf;
+    for (size_t index = 0; index < jobs.size(); ++index) {
+        if (!isLockstep) {
+            groups.push_back({index});
+            continue;
+        }
+        auto [it, isNew] = groupOf.try_emplace(
+            {jobs[index].image, jobs[index].maxInstructions}, groups.size());
+        if (isNew) {
+            groups.emplace_back();
+        }
+        groups[it->second].push_back(index);
+    }
+
+    std::mutex outputMutex;
+    WorkStealingPool pool(
+        std::min(workerCount, std::max<size_t>(groups.size(), 1)));
+    pool.run(groups.size(), [&](size_t group) {
+        std::vector<std::string> results;
+        if (isLockstep) {
+            results = runLockstep(jobs, groups[group], engine);
+        }
+        else {
+            size_t index = groups[group].front();
+            results.push_back(runJob(jobs[index], index, engine));
+        }
+        std::lock_guard lock(outputMutex);
+        for (const auto& result : results) {
+            std::cout << result << '\n';
+        }
+    });
+    std::cout.flush();
+}
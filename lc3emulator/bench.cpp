@@ -0,0 +1,269 @@
+#include <algorithm>
+#include <atomic>
+#include <benchmark/benchmark.h>
+#include <cstdlib>
+#include <filesystem>
+#include <fmt/core.h>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "CPU.hpp"
+
+// Throughput of every engine on the programs in programs/ and on a few
+// synthetic kernels. Every benchmark reports
+//
+//     instr/s     retired LC-3 instructions per second (M/s is MIPS)
+//     time/instr  host time per retired instruction
+//     allocs      heap allocations per run, the emulator shouldn't make
+//                 any once it's warm
+//
+// The programs are assembled into the build directory by CMake, --programs
+// points somewhere else. Everything else goes to google-benchmark, like
+// --benchmark_filter=jit.
+
+#ifndef LC3_BENCH_PROGRAMS
+#define LC3_BENCH_PROGRAMS "programs"
+#endif
+
+namespace {
+std::atomic<uint64_t> allocationCount{0};
+} // namespace
+
+void* operator new(size_t size)
+{
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    if (void* memory = std::malloc(size == 0 ? 1 : size)) {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept { std::free(memory); }
+
+void operator delete(void* memory, size_t) noexcept { std::free(memory); }
+
+namespace {
+// Input comes from a fixed string, output goes nowhere.
+class NullIo : public IoDevice {
+  public:
+    explicit NullIo(std::string input) : m_input(std::move(input)) {}
+
+    void rewind() { m_position = 0; }
+
+    int read() override
+    {
+        if (m_position == m_input.size()) {
+            return END_OF_INPUT;
+        }
+        return static_cast<unsigned char>(m_input[m_position++]);
+    }
+    bool hasInput() override { return m_position < m_input.size(); }
+    void write(const char*, size_t) override {}
+
+  private:
+    std::string m_input;
+    size_t m_position = 0;
+};
+
+struct Kernel {
+    const char* name;
+    std::vector<uint16_t> words;
+};
+
+// all of them start at x3000
+const std::vector<Kernel>& kernels()
+{
+    static const std::vector<Kernel> kernels = {
+        // 100 times 10000 turns of ADD, ADD, BRp
+        {"addLoop",
+         {0x2A07,    //       LD R5, OUTER
+          0x2207,    // OLOOP LD R1, INNER
+          0x14A1,    // ILOOP ADD R2, R2, #1
+          0x127F,    //       ADD R1, R1, #-1
+          0x03FD,    //       BRp ILOOP
+          0x1B7F,    //       ADD R5, R5, #-1
+          0x03FA,    //       BRp OLOOP
+          0xF025,    //       HALT
+          100,       // OUTER .FILL #100
+          10000}},   // INNER .FILL #10000
+        // copies 1000 words from x4000 to x5000, 300 times
+        {"memoryCopy",
+         {0x2A0C,    //       LD R5, OUTER
+          0x220C,    // OLOOP LD R1, COUNT
+          0x240C,    //       LD R2, SOURCE
+          0x260C,    //       LD R3, DEST
+          0x6880,    // COPY  LDR R4, R2, #0
+          0x78C0,    //       STR R4, R3, #0
+          0x14A1,    //       ADD R2, R2, #1
+          0x16E1,    //       ADD R3, R3, #1
+          0x127F,    //       ADD R1, R1, #-1
+          0x03FA,    //       BRp COPY
+          0x1B7F,    //       ADD R5, R5, #-1
+          0x03F5,    //       BRp OLOOP
+          0xF025,    //       HALT
+          300,       // OUTER  .FILL #300
+          1000,      // COUNT  .FILL #1000
+          0x4000,    // SOURCE .FILL x4000
+          0x5000}},  // DEST   .FILL x5000
+        // 1000 times a JSR chain 200 deep, R7 saved on the stack
+        {"recursiveJsr",
+         {0x2C0E,    //       LD R6, STACK
+          0x2A0E,    //       LD R5, OUTER
+          0x200E,    // OLOOP LD R0, DEPTH
+          0x4803,    //       JSR DOWN
+          0x1B7F,    //       ADD R5, R5, #-1
+          0x03FC,    //       BRp OLOOP
+          0xF025,    //       HALT
+          0x1DBF,    // DOWN  ADD R6, R6, #-1
+          0x7F80,    //       STR R7, R6, #0
+          0x103F,    //       ADD R0, R0, #-1
+          0x0401,    //       BRz DONE
+          0x4FFB,    //       JSR DOWN
+          0x6F80,    // DONE  LDR R7, R6, #0
+          0x1DA1,    //       ADD R6, R6, #1
+          0xC1C0,    //       RET
+          0x6000,    // STACK .FILL x6000
+          1000,      // OUTER .FILL #1000
+          200}},     // DEPTH .FILL #200
+        // PUTS of a 43 character line, 10000 times
+        {"stringOutput", [] {
+             std::vector<uint16_t> words = {
+                 0x2A05,    //       LD R5, OUTER
+                 0xE005,    // OLOOP LEA R0, TEXT
+                 0xF022,    //       PUTS
+                 0x1B7F,    //       ADD R5, R5, #-1
+                 0x03FC,    //       BRp OLOOP
+                 0xF025,    //       HALT
+                 10000};    // OUTER .FILL #10000
+             for (char c : std::string(
+                      "The quick brown fox jumps over the lazy dog")) {
+                 words.push_back(c);
+             }
+             words.push_back(0);
+             return words;
+         }()},
+    };
+    return kernels;
+}
+
+// the way lc3assembler writes it, for CPU::load()
+std::string writeImage(const Kernel& kernel)
+{
+    auto path = std::filesystem::temp_directory_path() /
+                fmt::format("lc3bench-{}.obj", kernel.name);
+    std::ofstream ofs(path, std::ios::binary);
+    uint16_t origin = 0x3000;
+    ofs.write(reinterpret_cast<const char*>(&origin), sizeof origin);
+    ofs.write(reinterpret_cast<const char*>(kernel.words.data()),
+              kernel.words.size() * sizeof(uint16_t));
+    if (!ofs) {
+        throw std::runtime_error(
+            fmt::format("Couldn't write a file: `{}`", path.string()));
+    }
+    return path.string();
+}
+
+// Programs that wait for keys get these and then end of input, the ones
+// that never stop are cut off at the instruction limit.
+constexpr const char* PROGRAM_INPUT = "7a\n";
+constexpr uint64_t PROGRAM_INSTRUCTION_LIMIT = 100000;
+
+void runImage(benchmark::State& state, const std::string& image,
+              Engine engine, uint64_t maxInstructions)
+{
+    NullIo io(PROGRAM_INPUT);
+    CPU cpu(engine);
+    cpu.setIo(io);
+    cpu.load(image);
+    cpu.snapshot();
+    // translates and compiles outside of the measurement
+    cpu.run(maxInstructions);
+
+    uint64_t instructions = 0;
+    uint64_t allocations = 0;
+    for (auto _ : state) {
+        cpu.reset();
+        io.rewind();
+        uint64_t allocationsBefore = allocationCount;
+        auto result = cpu.run(maxInstructions);
+        allocations += allocationCount - allocationsBefore;
+        instructions += result.instructionsRetired;
+        if (result.reason != StopReason::HALT &&
+            result.reason != StopReason::BUDGET_EXHAUSTED) {
+            state.SkipWithError(describeStop(result).c_str());
+            break;
+        }
+    }
+    using benchmark::Counter;
+    state.counters["instr/s"] = Counter(instructions, Counter::kIsRate);
+    state.counters["time/instr"] =
+        Counter(instructions, Counter::kIsRate | Counter::kInvert);
+    state.counters["allocs"] = Counter(allocations, Counter::kAvgIterations);
+}
+
+void registerImage(const std::string& name, const std::string& image,
+                   uint64_t maxInstructions)
+{
+    for (auto [engine, engineName] :
+         {std::pair{Engine::SWITCH, "switch"},
+          std::pair{Engine::THREADED, "threaded"},
+          std::pair{Engine::BLOCK, "block"}, std::pair{Engine::JIT, "jit"}}) {
+        benchmark::RegisterBenchmark(
+            fmt::format("{}/{}", name, engineName).c_str(),
+            [=](benchmark::State& state) {
+                runImage(state, image, engine, maxInstructions);
+            })
+            ->Unit(benchmark::kMicrosecond);
+    }
+}
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    std::filesystem::path programs = LC3_BENCH_PROGRAMS;
+    std::vector<char*> arguments;
+    for (int i = 0; i < argc; ++i) {
+        if (std::string(argv[i]) == "--programs" && i + 1 < argc) {
+            programs = argv[++i];
+        }
+        else {
+            arguments.push_back(argv[i]);
+        }
+    }
+    int argumentCount = arguments.size();
+    benchmark::Initialize(&argumentCount, arguments.data());
+
+    try {
+        for (const auto& kernel : kernels()) {
+            registerImage(kernel.name, writeImage(kernel), CPU::UNLIMITED);
+        }
+        std::vector<std::filesystem::path> images;
+        if (std::filesystem::is_directory(programs)) {
+            for (const auto& entry :
+                 std::filesystem::directory_iterator(programs)) {
+                if (entry.path().extension() == ".obj") {
+                    images.push_back(entry.path());
+                }
+            }
+        }
+        else {
+            std::cerr << fmt::format("no programs in `{}`\n",
+                                     programs.string());
+        }
+        std::sort(images.begin(), images.end());
+        for (const auto& image : images) {
+            registerImage(image.stem().string(), image.string(),
+                          PROGRAM_INSTRUCTION_LIMIT);
+        }
+    }
+    catch (const std::exception& e) {
+        std::cerr << "LC3 BENCH ERROR: " << e.what() << std::endl;
+        return -1;
+    }
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+}
@@ -0,0 +1,190 @@
+#include "block.hpp"
+
+namespace {
+bool isControlFlow(InstructionOpCode opCode)
+{
+    switch (opCode) {
+    case InstructionOpCode::BR:
+    case InstructionOpCode::JMP_RET:
+    case InstructionOpCode::JSR_JSRR:
+    case InstructionOpCode::TRAP:
+    case InstructionOpCode::RTI:
+    case InstructionOpCode::NON:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool setsConditionalCodes(MicroOpKind kind)
+{
+    switch (kind) {
+    case MicroOpKind::ADD:
+    case MicroOpKind::AND:
+    case MicroOpKind::NOT:
+    case MicroOpKind::LD:
+    case MicroOpKind::LDI:
+    case MicroOpKind::LDR:
+    case MicroOpKind::LEA:
+    case MicroOpKind::LOAD_IMMEDIATE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// memory accesses can fault or end the block before it's done
+bool canLeaveEarly(MicroOpKind kind)
+{
+    switch (kind) {
+    case MicroOpKind::LD:
+    case MicroOpKind::LDI:
+    case MicroOpKind::LDR:
+    case MicroOpKind::ST:
+    case MicroOpKind::STI:
+    case MicroOpKind::STR:
+    case MicroOpKind::LDR_BRANCH:
+        return true;
+    default:
+        return false;
+    }
+}
+
+MicroOpKind toMicroOpKind(InstructionOpCode opCode)
+{
+    switch (opCode) {
+    case InstructionOpCode::ADD:
+        return MicroOpKind::ADD;
+    case InstructionOpCode::AND:
+        return MicroOpKind::AND;
+    case InstructionOpCode::NOT:
+        return MicroOpKind::NOT;
+    case InstructionOpCode::LD:
+        return MicroOpKind::LD;
+    case InstructionOpCode::LDI:
+        return MicroOpKind::LDI;
+    case InstructionOpCode::LDR:
+        return MicroOpKind::LDR;
+    case InstructionOpCode::LEA:
+        return MicroOpKind::LEA;
+    case InstructionOpCode::ST:
+        return MicroOpKind::ST;
+    case InstructionOpCode::STI:
+        return MicroOpKind::STI;
+    case InstructionOpCode::STR:
+        return MicroOpKind::STR;
+    case InstructionOpCode::BR:
+        return MicroOpKind::BR;
+    default:
+        return MicroOpKind::EXECUTE;
+    }
+}
+
+bool isClearRegister(const DecodedInstruction& instruction)
+{
+    return instruction.opCode == InstructionOpCode::AND &&
+           instruction.isImmediate && instruction.immediateValue == 0;
+}
+
+bool isAddImmediateTo(const DecodedInstruction& instruction,
+                      uint8_t registerNumber)
+{
+    return instruction.opCode == InstructionOpCode::ADD &&
+           instruction.isImmediate &&
+           instruction.destinationRegister == registerNumber &&
+           instruction.sourceRegister == registerNumber;
+}
+} // namespace
+
+Block translateBlock(Memory& memory, uint16_t start,
+                     const CycleTable& cycles)
+{
+    Block block{
+        .start = start, .end = start, .microOps = {}, .cyclesFrom = {}};
+
+    // decode the straight-line run first, so fusion can look ahead
+    std::vector<DecodedInstruction> instructions;
+    while (instructions.size() < Block::MAX_BLOCK_SIZE &&
+           block.end <= std::numeric_limits<uint16_t>::max() &&
+           (instructions.empty() || memory.canFetch(block.end))) {
+        auto instruction = memory.fetch(block.end++);
+        instructions.push_back(instruction);
+        if (isControlFlow(instruction.opCode)) {
+            break;
+        }
+    }
+
+    block.cyclesFrom.assign(instructions.size() + 1, 0);
+    for (size_t i = instructions.size(); i-- > 0;) {
+        block.cyclesFrom[i] =
+            block.cyclesFrom[i + 1] +
+            cycles[static_cast<uint8_t>(instructions[i].handler)];
+    }
+
+    uint16_t pc = start;
+    for (size_t i = 0; i < instructions.size(); ++i) {
+        auto instruction = instructions[i];
+        pc++;
+
+        MicroOp microOp{.kind = toMicroOpKind(instruction.opCode),
+                        .setsConditionalCodes = false,
+                        .instruction = instruction,
+                        .nextInstruction = {},
+                        .address = static_cast<uint16_t>(
+                            pc + instruction.immediateValue),
+                        .nextPc = pc};
+
+        bool hasNext = i + 1 < instructions.size();
+        auto next = hasNext ? instructions[i + 1] : DecodedInstruction{};
+        if (hasNext && isClearRegister(instruction) &&
+            isAddImmediateTo(next, instruction.destinationRegister)) {
+            microOp.kind = MicroOpKind::LOAD_IMMEDIATE;
+        }
+        else if (hasNext && next.opCode == InstructionOpCode::BR &&
+                 (instruction.opCode == InstructionOpCode::ADD ||
+                  instruction.opCode == InstructionOpCode::LDR)) {
+            microOp.kind = instruction.opCode == InstructionOpCode::ADD
+                               ? MicroOpKind::ADD_BRANCH
+                               : MicroOpKind::LDR_BRANCH;
+        }
+
+        if (microOp.kind == MicroOpKind::LOAD_IMMEDIATE ||
+            microOp.kind == MicroOpKind::ADD_BRANCH ||
+            microOp.kind == MicroOpKind::LDR_BRANCH) {
+            pc++;
+            i++;
+            microOp.nextInstruction = next;
+            microOp.nextPc = pc;
+            if (next.opCode == InstructionOpCode::BR) {
+                microOp.address = pc + next.immediateValue;
+            }
+        }
+        block.microOps.push_back(microOp);
+    }
+
+    // Flags are only observed by BR, anything set before the next flag
+    // update in the same block is dead. The next block might branch on
+    // them, so they are live at the end, and wherever the block can be
+    // left early.
+    bool areFlagsLive = true;
+    for (auto it = block.microOps.rbegin(); it != block.microOps.rend();
+         ++it) {
+        if (setsConditionalCodes(it->kind)) {
+            it->setsConditionalCodes = areFlagsLive;
+            areFlagsLive = false;
+        }
+        if (it->kind == MicroOpKind::ADD_BRANCH ||
+            it->kind == MicroOpKind::LDR_BRANCH) {
+            // the fused branch consumes the flags and leaves them behind
+            it->setsConditionalCodes = true;
+            areFlagsLive = false;
+        }
+        if (it->kind == MicroOpKind::BR || it->kind == MicroOpKind::EXECUTE ||
+            canLeaveEarly(it->kind)) {
+            areFlagsLive = true;
+        }
+    }
+
+    memory.markTranslated(block.start, block.end);
+    return block;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "cycles.hpp"
+#include "lc3memory.hpp"
+
+#include <vector>
+
+enum class MicroOpKind : uint8_t {
+    ADD,
+    AND,
+    NOT,
+    LD,
+    LDI,
+    LDR,
+    LEA,
+    ST,
+    STI,
+    STR,
+    BR,
+    // AND Rx, Ry, #0 followed by ADD Rx, Rx, #imm5
+    LOAD_IMMEDIATE,
+    // ADD or LDR followed by BR, the branch reads the flags of the first one
+    ADD_BRANCH,
+    LDR_BRANCH,
+    // JMP/RET, JSR/JSRR, TRAP, RTI and illegal opcodes go through
+    // CPU::execute()
+    EXECUTE,
+};
+
+// One or two LC-3 instructions with everything that can be known at
+// translation time already resolved.
+struct MicroOp {
+    MicroOpKind kind;
+    // false when a later op of the same block overwrites the flags before
+    // anything reads them or the block can be left
+    bool setsConditionalCodes;
+    DecodedInstruction instruction;
+    // second half of a fused pair
+    DecodedInstruction nextInstruction;
+    // PC-relative address (LD/LDI/LEA/ST/STI) or branch target
+    uint16_t address;
+    // PC after this op when it doesn't branch
+    uint16_t nextPc;
+};
+
+// Straight-line code from `start` up to and including the first control
+// flow instruction.
+struct Block {
+    static constexpr uint16_t MAX_BLOCK_SIZE = 32;
+
+    uint16_t start;
+    // one past the last translated word
+    uint32_t end;
+    std::vector<MicroOp> microOps;
+    // cycles of the words from start + i up to the end, [0] is the whole
+    // block and the rest is given back when it's left early
+    std::vector<uint32_t> cyclesFrom;
+};
+
+Block translateBlock(Memory& memory, uint16_t start,
+                     const CycleTable& cycles);
@@ -0,0 +1,325 @@
+#include "console.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fmt/core.h>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+#if LC3_FD_IO_AVAILABLE
+#include <cerrno>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#endif
+
+#ifdef WIN32
+#include <conio.h>
+#include <Windows.h>
+#undef max
+#endif
+
+bool IoDevice::waitForInput(int timeoutMilliseconds)
+{
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(timeoutMilliseconds);
+    while (!hasInput()) {
+        if (std::chrono::steady_clock::now() >= deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+#if LC3_FD_IO_AVAILABLE
+namespace {
+termios originalTerminal;
+bool isRaw = false;
+} // namespace
+
+void disable_input_buffering()
+{
+    if (isRaw || !isatty(STDIN_FILENO) ||
+        tcgetattr(STDIN_FILENO, &originalTerminal) != 0) {
+        return;
+    }
+    termios raw = originalTerminal;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    // read() returns as soon as there is one byte
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    if (tcsetattr(STDIN_FILENO, TCSANOW, &raw) == 0) {
+        isRaw = true;
+        static bool isRegistered = false;
+        if (!std::exchange(isRegistered, true)) {
+            atexit(restore_input_buffering);
+        }
+    }
+}
+
+void restore_input_buffering()
+{
+    if (isRaw) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &originalTerminal);
+        isRaw = false;
+    }
+}
+
+uint16_t check_key()
+{
+    pollfd input{.fd = STDIN_FILENO, .events = POLLIN, .revents = 0};
+    return poll(&input, 1, 0) > 0 && (input.revents & POLLIN);
+}
+
+// only async-signal-safe calls, the run it cuts short may be anywhere
+void handle_interrupt(int)
+{
+    restore_input_buffering();
+    [[maybe_unused]] ssize_t written = ::write(STDOUT_FILENO, "\n", 1);
+    _exit(-2);
+}
+
+TerminalIo::TerminalIo()
+    : m_input(std::make_unique<FileDescriptorIo>(STDIN_FILENO, STDOUT_FILENO))
+{
+}
+
+TerminalIo::~TerminalIo() = default;
+
+int TerminalIo::read() { return m_input->read(); }
+
+bool TerminalIo::hasInput() { return m_input->hasInput(); }
+
+bool TerminalIo::waitForInput(int timeoutMilliseconds)
+{
+    return m_input->waitForInput(timeoutMilliseconds);
+}
+#else
+namespace {
+// SOURCE:
+// https://github.com/justinmeiners/lc3-vm/blob/master/docs/src/lc3-win.c
+#ifdef WIN32
+HANDLE hStdin = INVALID_HANDLE_VALUE;
+DWORD fdwMode, fdwOldMode;
+#endif
+} // namespace
+
+void disable_input_buffering()
+{
+    #ifdef WIN32
+    hStdin = GetStdHandle(STD_INPUT_HANDLE);
+    GetConsoleMode(hStdin, &fdwOldMode);     /* save old mode */
+    fdwMode = fdwOldMode ^ ENABLE_ECHO_INPUT /* no input echo */
+              ^ ENABLE_LINE_INPUT;           /* return when one or
+                                                more characters are available */
+    SetConsoleMode(hStdin, fdwMode);         /* set new mode */
+    FlushConsoleInputBuffer(hStdin);         /* clear buffer */
+    #endif
+}
+
+void restore_input_buffering() 
+{ 
+    #ifdef WIN32
+    SetConsoleMode(hStdin, fdwOldMode);
+    #endif 
+}
+
+uint16_t check_key()
+{
+    #ifdef WIN32
+    return WaitForSingleObject(hStdin, 1000) == WAIT_OBJECT_0 && _kbhit();
+    #else 
+    return 0;
+    #endif
+}
+
+void handle_interrupt(int)
+{
+    #ifdef WIN32
+    restore_input_buffering();
+    printf("\n");
+    _exit(-2);
+    #endif
+}
+
+TerminalIo::TerminalIo() = default;
+
+TerminalIo::~TerminalIo() = default;
+
+int TerminalIo::read() { return getchar(); }
+
+bool TerminalIo::hasInput() { return check_key(); }
+
+// check_key() already waits a while
+bool TerminalIo::waitForInput(int) { return check_key(); }
+#endif
+
+void TerminalIo::write(const char* data, size_t size)
+{
+    fwrite(data, 1, size, stdout);
+}
+
+void TerminalIo::flush() { fflush(stdout); }
+
+#if LC3_FD_IO_AVAILABLE
+FileDescriptorIo::FileDescriptorIo(int inputFd, int outputFd)
+    : m_inputFd(inputFd), m_outputFd(outputFd), m_inputBuffer(4096),
+      m_inputPosition(0), m_inputSize(0)
+{
+}
+
+int FileDescriptorIo::read()
+{
+    if (m_inputPosition == m_inputSize) {
+        ssize_t size;
+        do {
+            size = ::read(m_inputFd, m_inputBuffer.data(),
+                          m_inputBuffer.size());
+        } while (size < 0 && errno == EINTR);
+        if (size <= 0) {
+            return END_OF_INPUT;
+        }
+        m_inputPosition = 0;
+        m_inputSize = size;
+    }
+    return static_cast<unsigned char>(m_inputBuffer[m_inputPosition++]);
+}
+
+bool FileDescriptorIo::hasInput() { return waitForInput(0); }
+
+bool FileDescriptorIo::waitForInput(int timeoutMilliseconds)
+{
+    if (m_inputPosition < m_inputSize) {
+        return true;
+    }
+    // a closed pipe only reports POLLHUP, read() then gives END_OF_INPUT
+    pollfd input{.fd = m_inputFd, .events = POLLIN, .revents = 0};
+    return poll(&input, 1, timeoutMilliseconds) > 0 &&
+           (input.revents & (POLLIN | POLLHUP));
+}
+
+void FileDescriptorIo::write(const char* data, size_t size)
+{
+    while (size != 0) {
+        ssize_t written = ::write(m_outputFd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // nowhere left to report it, the output is lost like on a
+            // closed terminal
+            return;
+        }
+        data += written;
+        size -= written;
+    }
+}
+#endif
+
+InputLog::InputLog(Mode mode, IoDevice& device, const std::string& path)
+    : m_mode(mode), m_device(device),
+      m_file(path, mode == Mode::RECORD ? std::ios::out : std::ios::in),
+      m_hasEnded(false)
+{
+    if (!m_file.is_open()) {
+        throw std::runtime_error(
+            fmt::format("Couldn't open a file: `{}`", path));
+    }
+    if (mode == Mode::RECORD) {
+        return;
+    }
+    uint64_t lastTime = 0;
+    for (std::string line; std::getline(m_file, line);) {
+        std::istringstream fields(line);
+        uint64_t time = 0;
+        unsigned byte = 0;
+        std::string rest;
+        if (!(fields >> time >> byte) || fields >> rest || byte > 0xFF ||
+            time < lastTime) {
+            throw std::runtime_error(
+                fmt::format("Not an input log: `{}`", path));
+        }
+        m_pending.push_back({time, static_cast<uint8_t>(byte)});
+        lastTime = time;
+    }
+}
+
+void InputLog::advance(uint64_t now)
+{
+    if (m_mode == Mode::REPLAY) {
+        while (!m_pending.empty() && m_pending.front().time <= now) {
+            m_arrived.push_back(m_pending.front().byte);
+            m_pending.pop_front();
+        }
+        return;
+    }
+    for (const auto& entry : m_pending) {
+        arrive(now, entry.byte);
+    }
+    m_pending.clear();
+    while (!m_hasEnded && m_device.hasInput()) {
+        int byte = m_device.read();
+        if (byte == END_OF_INPUT) {
+            m_hasEnded = true;
+            break;
+        }
+        arrive(now, byte);
+    }
+}
+
+uint64_t InputLog::nextArrival(uint64_t now) const
+{
+    if (m_mode == Mode::REPLAY) {
+        return m_pending.empty() ? NEVER : m_pending.front().time;
+    }
+    return m_hasEnded ? NEVER : now + POLL_INTERVAL;
+}
+
+bool InputLog::hold()
+{
+    if (m_mode == Mode::REPLAY || m_hasEnded) {
+        return false;
+    }
+    int byte = m_device.read();
+    if (byte == END_OF_INPUT) {
+        m_hasEnded = true;
+        return false;
+    }
+    m_pending.push_back({0, static_cast<uint8_t>(byte)});
+    return true;
+}
+
+int InputLog::read()
+{
+    if (m_arrived.empty()) {
+        return END_OF_INPUT;
+    }
+    uint8_t byte = m_arrived.front();
+    m_arrived.pop_front();
+    return byte;
+}
+
+bool InputLog::waitForInput(int timeoutMilliseconds)
+{
+    if (hasInput() || m_mode == Mode::REPLAY || m_hasEnded) {
+        return IoDevice::waitForInput(timeoutMilliseconds);
+    }
+    return m_device.waitForInput(timeoutMilliseconds);
+}
+
+bool InputLog::hasInputEnded()
+{
+    return m_arrived.empty() && m_pending.empty() &&
+           (m_mode == Mode::REPLAY || m_hasEnded || m_device.hasInputEnded());
+}
+
+void InputLog::arrive(uint64_t now, uint8_t byte)
+{
+    m_arrived.push_back(byte);
+    // flushed right away, an interrupted run keeps its log
+    m_file << now << ' ' << unsigned(byte) << std::endl;
+}
@@ -0,0 +1,296 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <istream>
+#include <limits>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define LC3_FD_IO_AVAILABLE 1
+#else
+#define LC3_FD_IO_AVAILABLE 0
+#endif
+
+// The terminal, for interactive runs. disable_input_buffering() puts it in
+// raw mode (no line buffering, no echo) so every key reaches the program
+// as soon as it's pressed, restore_input_buffering() undoes that and also
+// runs at exit. Both do nothing when stdin isn't a terminal.
+void disable_input_buffering();
+void restore_input_buffering();
+// whether a key is waiting, doesn't block
+uint16_t check_key();
+// SIGINT handler, restores the terminal and exits right away, output
+// still buffered is lost
+void handle_interrupt(int signal);
+
+// Where the console of a CPU reads from and writes to: the GETC/IN/OUT/
+// PUTS/HALT traps and the keyboard registers.
+class IoDevice {
+  public:
+    static constexpr int END_OF_INPUT = -1;
+
+  public:
+    virtual ~IoDevice() = default;
+    // next input byte, waits for it if there's none yet
+    virtual int read() = 0;
+    // whether read() would return right away
+    virtual bool hasInput() = 0;
+    // Blocks until there is input or the timeout passes, for programs that
+    // do nothing but wait for a key. Devices that can't wait for their input
+    // sleep and look again until the timeout passes.
+    virtual bool waitForInput(int timeoutMilliseconds);
+    // whether the input is used up and no more will ever come
+    virtual bool hasInputEnded() { return false; }
+    virtual void write(const char* data, size_t size) = 0;
+    virtual void flush() {}
+};
+
+class FileDescriptorIo;
+
+// stdin/stdout, what a CPU uses unless told otherwise
+class TerminalIo : public IoDevice {
+  public:
+    TerminalIo();
+    ~TerminalIo();
+
+    int read() override;
+    bool hasInput() override;
+    bool waitForInput(int timeoutMilliseconds) override;
+    void write(const char* data, size_t size) override;
+    void flush() override;
+
+  private:
+#if LC3_FD_IO_AVAILABLE
+    // Input skips stdio, so whatever was typed is either still in the
+    // descriptor, where poll() sees it, or already in this buffer.
+    std::unique_ptr<FileDescriptorIo> m_input;
+#endif
+};
+
+class StreamIo : public IoDevice {
+  public:
+    StreamIo(std::istream& input, std::ostream& output)
+        : m_input(input), m_output(output)
+    {
+    }
+
+    int read() override { return m_input.get(); }
+    bool hasInput() override { return m_input.rdbuf()->in_avail() > 0; }
+    void write(const char* data, size_t size) override
+    {
+        m_output.write(data, size);
+    }
+    void flush() override { m_output.flush(); }
+
+  private:
+    std::istream& m_input;
+    std::ostream& m_output;
+};
+
+// Input and output are plain byte buffers, for runs nobody watches.
+class MemoryIo : public IoDevice {
+  public:
+    explicit MemoryIo(std::string input = {})
+        : m_input(std::move(input)), m_position(0)
+    {
+    }
+
+    int read() override
+    {
+        if (m_position == m_input.size()) {
+            return END_OF_INPUT;
+        }
+        return static_cast<unsigned char>(m_input[m_position++]);
+    }
+    bool hasInput() override { return m_position < m_input.size(); }
+    bool hasInputEnded() override { return m_position == m_input.size(); }
+    void write(const char* data, size_t size) override
+    {
+        m_output.append(data, size);
+    }
+
+    const std::string& output() const { return m_output; }
+
+  private:
+    std::string m_input;
+    size_t m_position;
+    std::string m_output;
+};
+
+#if LC3_FD_IO_AVAILABLE
+// Reads and writes file descriptors directly, the descriptors stay open.
+class FileDescriptorIo : public IoDevice {
+  public:
+    FileDescriptorIo(int inputFd, int outputFd);
+
+    int read() override;
+    bool hasInput() override;
+    bool waitForInput(int timeoutMilliseconds) override;
+    void write(const char* data, size_t size) override;
+
+  private:
+    int m_inputFd;
+    int m_outputFd;
+    // read() takes whatever the descriptor has ready, not one byte a time
+    std::vector<char> m_inputBuffer;
+    size_t m_inputPosition;
+    size_t m_inputSize;
+};
+#endif
+
+// Makes the input of a run reproducible (see CPU::setInputLog). Input only
+// reaches the program between slices of a run, at instruction counts that
+// don't depend on the engine or on how fast the host is, and every byte is
+// logged with the count at which it did. Replaying the log hands out the
+// same bytes at the same counts instead of reading the device. Output goes
+// to the device either way.
+//
+// The log is text, one "count byte" line per byte.
+class InputLog : public IoDevice {
+  public:
+    enum class Mode : uint8_t { RECORD, REPLAY };
+    static constexpr uint64_t NEVER = std::numeric_limits<uint64_t>::max();
+    // how often a recording looks at the device
+    static constexpr uint64_t POLL_INTERVAL = 10000;
+
+  public:
+    // throws std::runtime_error if the log can't be opened or a replayed
+    // one is malformed
+    InputLog(Mode mode, IoDevice& device, const std::string& path);
+
+    bool isReplaying() const { return m_mode == Mode::REPLAY; }
+    // hands out the input due after `now` retired instructions, logging it
+    // when recording
+    void advance(uint64_t now);
+    // the instruction count at which advance() has something to do
+    uint64_t nextArrival(uint64_t now) const;
+    // For GETC and IN when no input is there yet: blocks until the device
+    // has a byte, which the next advance() hands out. False when replaying
+    // or at the end of the input, the program gets END_OF_INPUT then.
+    bool hold();
+
+    // what advance() handed out so far, END_OF_INPUT once that's all read
+    int read() override;
+    bool hasInput() override { return !m_arrived.empty(); }
+    // waits for the device when recording
+    bool waitForInput(int timeoutMilliseconds) override;
+    bool hasInputEnded() override;
+    void write(const char* data, size_t size) override
+    {
+        m_device.write(data, size);
+    }
+    void flush() override { m_device.flush(); }
+
+  private:
+    struct Entry {
+        uint64_t time;
+        uint8_t byte;
+    };
+
+    void arrive(uint64_t now, uint8_t byte);
+
+  private:
+    Mode m_mode;
+    IoDevice& m_device;
+    std::fstream m_file;
+    std::deque<uint8_t> m_arrived;
+    // REPLAY: what's still to come, RECORD: what hold() read
+    std::deque<Entry> m_pending;
+    bool m_hasEnded;
+};
+
+// Console output of one CPU. Characters are collected in a large buffer
+// and handed to the device in one write when the buffer is full, before
+// the program reads input, when run() returns and on flush(), so programs
+// that print a lot don't pay for a device call per character.
+class OutputSink {
+  public:
+    static constexpr size_t BUFFER_SIZE = 16 * 1024;
+
+  public:
+    explicit OutputSink(IoDevice* device)
+        : m_device(device), m_buffer(new char[BUFFER_SIZE]), m_size(0)
+    {
+    }
+    ~OutputSink()
+    {
+        if (m_size != 0) {
+            flush();
+        }
+    }
+    OutputSink(const OutputSink&) = delete;
+    OutputSink& operator=(const OutputSink&) = delete;
+
+    // What's buffered goes to the old device first. The buffer is empty
+    // once run() returns, so a device only has to outlive the runs that
+    // write to it.
+    void setDevice(IoDevice* device)
+    {
+        if (m_size != 0) {
+            flush();
+        }
+        m_device = device;
+    }
+
+    bool isEmpty() const { return m_size == 0; }
+
+    void put(char c)
+    {
+        if (m_size == BUFFER_SIZE) {
+            writeBuffer();
+        }
+        m_buffer[m_size++] = c;
+    }
+
+    void write(const char* text, size_t size)
+    {
+        for (size_t i = 0; i < size; ++i) {
+            put(text[i]);
+        }
+    }
+
+    // LC-3 strings keep one character per word, in the low byte
+    void putWords(const uint16_t* words, size_t count)
+    {
+        while (count != 0) {
+            if (m_size == BUFFER_SIZE) {
+                writeBuffer();
+            }
+            size_t chunk = std::min(count, BUFFER_SIZE - m_size);
+            char* destination = m_buffer.get() + m_size;
+            for (size_t i = 0; i < chunk; ++i) {
+                destination[i] = static_cast<char>(words[i]);
+            }
+            m_size += chunk;
+            words += chunk;
+            count -= chunk;
+        }
+    }
+
+    void flush()
+    {
+        writeBuffer();
+        m_device->flush();
+    }
+
+  private:
+    void writeBuffer()
+    {
+        if (m_size != 0) {
+            m_device->write(m_buffer.get(), m_size);
+            m_size = 0;
+        }
+    }
+
+  private:
+    IoDevice* m_device;
+    std::unique_ptr<char[]> m_buffer;
+    size_t m_size;
+};
@@ -0,0 +1,132 @@
+#pragma once
+
+#include "decoder.hpp"
+
+#include <array>
+#include <cstdint>
+#include <exception>
+#include <sstream>
+#include <string>
+
+// How many cycles each instruction takes on a simple multi-cycle LC-3. The
+// count is the same on every engine and every host, so it measures the
+// LC-3 program rather than the emulator. Only the TRAP instruction itself
+// is counted for traps that run natively.
+struct CycleModel {
+    // per opcode, memory accesses not included
+    std::array<uint16_t, 16> opCodeCycles;
+    // added for every memory access, the instruction fetch included
+    uint16_t memoryLatency;
+
+    // the states of the LC-3 state machine (Patt & Patel, appendix C)
+    // outside of memory accesses, which take five cycles
+    static CycleModel standard()
+    {
+        CycleModel model{};
+        auto set = [&](InstructionOpCode opCode, uint16_t cycles) {
+            model.opCodeCycles[static_cast<uint8_t>(opCode)] = cycles;
+        };
+        for (auto opCode :
+             {InstructionOpCode::BR, InstructionOpCode::ADD,
+              InstructionOpCode::AND, InstructionOpCode::NOT,
+              InstructionOpCode::LEA, InstructionOpCode::JMP_RET,
+              InstructionOpCode::NON}) {
+            set(opCode, 4);
+        }
+        for (auto opCode :
+             {InstructionOpCode::JSR_JSRR, InstructionOpCode::LD,
+              InstructionOpCode::LDR, InstructionOpCode::ST,
+              InstructionOpCode::STR, InstructionOpCode::TRAP}) {
+            set(opCode, 5);
+        }
+        set(InstructionOpCode::LDI, 6);
+        set(InstructionOpCode::STI, 6);
+        set(InstructionOpCode::RTI, 9);
+        model.memoryLatency = 5;
+        return model;
+    }
+
+    static uint8_t memoryAccesses(InstructionOpCode opCode)
+    {
+        switch (opCode) {
+        case InstructionOpCode::LD:
+        case InstructionOpCode::LDR:
+        case InstructionOpCode::ST:
+        case InstructionOpCode::STR:
+        case InstructionOpCode::TRAP:
+            return 2;
+        case InstructionOpCode::LDI:
+        case InstructionOpCode::STI:
+        case InstructionOpCode::RTI:
+            return 3;
+        default:
+            return 1;
+        }
+    }
+
+    uint32_t cycles(InstructionOpCode opCode) const
+    {
+        return opCodeCycles[static_cast<uint8_t>(opCode)] +
+               memoryAccesses(opCode) * memoryLatency;
+    }
+
+    bool operator==(const CycleModel&) const = default;
+};
+
+// CycleModel::cycles() by Handler, which is what the engines have at hand.
+// UNDECODED costs nothing, the instruction behind it is charged when it
+// runs.
+using CycleTable =
+    std::array<uint32_t, static_cast<size_t>(Handler::TRAP) + 1>;
+
+inline CycleTable cycleTable(const CycleModel& model)
+{
+    CycleTable table{};
+    for (uint16_t variant = 0; variant < HANDLERS.size(); ++variant) {
+        table[static_cast<uint8_t>(HANDLERS[variant])] =
+            model.cycles(static_cast<InstructionOpCode>(variant >> 4));
+    }
+    return table;
+}
+
+// Changes `model` by a list like "LDR=6,STR=6,memory=10": opcode names set
+// the cycles of the opcode, memory sets the memory latency. False on
+// anything else.
+inline bool parseCycleModel(const std::string& list, CycleModel& model)
+{
+    std::istringstream entries(list);
+    std::string entry;
+    while (std::getline(entries, entry, ',')) {
+        auto equals = entry.find('=');
+        if (equals == std::string::npos) {
+            return false;
+        }
+        std::string name = entry.substr(0, equals);
+        std::string value = entry.substr(equals + 1);
+        size_t parsed = 0;
+        unsigned long cycles = 0;
+        try {
+            cycles = std::stoul(value, &parsed);
+        }
+        catch (const std::exception&) {
+            return false;
+        }
+        if (value.empty() || parsed != value.size() || cycles > 0xFFFF) {
+            return false;
+        }
+        if (name == "memory") {
+            model.memoryLatency = cycles;
+            continue;
+        }
+        uint8_t opCode = 0;
+        while (opCode < model.opCodeCycles.size() &&
+               name != opCodeName(static_cast<InstructionOpCode>(opCode))) {
+            opCode++;
+        }
+        if (opCode == model.opCodeCycles.size()) {
+            return false;
+        }
+        model.opCodeCycles[opCode] = cycles;
+    }
+    return true;
+}
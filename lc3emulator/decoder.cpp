@@ -0,0 +1,134 @@
+#include "decoder.hpp"
+
+#include <assert.h>
+#include <fmt/core.h>
+
+uint16_t retrieveBits(uint16_t insturction, uint8_t start, uint8_t size)
+{
+    assert(start <= 15 && start >= 0);
+    uint16_t mask = (1 << size) - 1;
+    uint16_t res = (insturction >> (start - size + 1)) & mask;
+    return res;
+}
+
+uint16_t signExtend(uint16_t offset, uint8_t bitCount)
+{
+    if ((offset >> (bitCount - 1)) & 0x1) {
+        offset |= (0xFFFF << bitCount);
+    }
+    return offset;
+}
+
+uint16_t signExtendRetriveBits(uint16_t insturction, uint8_t start,
+                               uint8_t size)
+{
+    return signExtend(retrieveBits(insturction, start, size), size);
+}
+
+DecodedInstruction decode(uint16_t instruction)
+{
+    DecodedInstruction decoded{
+        .opCode = static_cast<InstructionOpCode>(retrieveBits(instruction, 15, 4)),
+        .handler = HANDLERS[variantIndex(instruction)],
+        .destinationRegister = static_cast<uint8_t>(retrieveBits(instruction, 11, 3)),
+        .sourceRegister = static_cast<uint8_t>(retrieveBits(instruction, 8, 3)),
+        .secondSourceRegister = static_cast<uint8_t>(retrieveBits(instruction, 2, 3)),
+        .isImmediate = false,
+        .immediateValue = 0};
+
+    switch (decoded.opCode) {
+    case InstructionOpCode::ADD:
+    case InstructionOpCode::AND:
+        decoded.isImmediate = (instruction >> 5) & 0x1;
+        decoded.immediateValue = signExtendRetriveBits(instruction, 4, 5);
+        break;
+    case InstructionOpCode::BR:
+    case InstructionOpCode::LD:
+    case InstructionOpCode::LDI:
+    case InstructionOpCode::LEA:
+    case InstructionOpCode::ST:
+    case InstructionOpCode::STI:
+        decoded.immediateValue = signExtendRetriveBits(instruction, 8, 9);
+        break;
+    case InstructionOpCode::LDR:
+    case InstructionOpCode::STR:
+        decoded.immediateValue = signExtendRetriveBits(instruction, 5, 6);
+        break;
+    case InstructionOpCode::JSR_JSRR:
+        decoded.isImmediate = (instruction >> 11) & 0x1;
+        decoded.immediateValue = signExtendRetriveBits(instruction, 10, 11);
+        break;
+    case InstructionOpCode::TRAP:
+        decoded.immediateValue = retrieveBits(instruction, 7, 8);
+        break;
+    default:
+        break;
+    }
+    return decoded;
+}
+
+const char* opCodeName(InstructionOpCode opCode)
+{
+    static constexpr const char* NAMES[] = {
+        "BR",  "ADD", "LD",  "ST",  "JSR", "AND", "LDR", "STR",
+        "RTI", "NOT", "LDI", "STI", "JMP", "NON", "LEA", "TRAP"};
+    return NAMES[static_cast<uint8_t>(opCode) & 0xF];
+}
+
+std::string disassemble(uint16_t instruction, uint16_t pc)
+{
+    auto decoded = decode(instruction);
+    uint8_t dr = decoded.destinationRegister;
+    uint8_t sr = decoded.sourceRegister;
+    int16_t immediate = static_cast<int16_t>(decoded.immediateValue);
+    uint16_t target = pc + 1 + decoded.immediateValue;
+    const char* name = opCodeName(decoded.opCode);
+    switch (decoded.opCode) {
+    case InstructionOpCode::BR: {
+        // without n, z or p it's still taken, see CPU::branch, so it's
+        // shown as a plain BR
+        return fmt::format("BR{}{}{} x{:04X}", dr & 0b100 ? "n" : "",
+                           dr & 0b010 ? "z" : "", dr & 0b001 ? "p" : "",
+                           target);
+    }
+    case InstructionOpCode::ADD:
+    case InstructionOpCode::AND:
+        if (decoded.isImmediate) {
+            return fmt::format("{} R{}, R{}, #{}", name, dr, sr, immediate);
+        }
+        return fmt::format("{} R{}, R{}, R{}", name, dr, sr,
+                           decoded.secondSourceRegister);
+    case InstructionOpCode::LD:
+    case InstructionOpCode::LDI:
+    case InstructionOpCode::LEA:
+    case InstructionOpCode::ST:
+    case InstructionOpCode::STI:
+        return fmt::format("{} R{}, x{:04X}", name, dr, target);
+    case InstructionOpCode::LDR:
+    case InstructionOpCode::STR:
+        return fmt::format("{} R{}, R{}, #{}", name, dr, sr, immediate);
+    case InstructionOpCode::JSR_JSRR:
+        if (decoded.isImmediate) {
+            return fmt::format("JSR x{:04X}", target);
+        }
+        return fmt::format("JSRR R{}", sr);
+    case InstructionOpCode::JMP_RET:
+        return sr == R7 ? "RET" : fmt::format("JMP R{}", sr);
+    case InstructionOpCode::NOT:
+        return fmt::format("NOT R{}, R{}", dr, sr);
+    case InstructionOpCode::RTI:
+        return "RTI";
+    case InstructionOpCode::TRAP: {
+        static constexpr const char* TRAPS[] = {"GETC", "OUT",   "PUTS",
+                                                "IN",   "PUTSP", "HALT"};
+        uint8_t vector = decoded.immediateValue;
+        if (vector >= static_cast<uint8_t>(Traps::GETC) &&
+            vector <= static_cast<uint8_t>(Traps::HALT)) {
+            return TRAPS[vector - static_cast<uint8_t>(Traps::GETC)];
+        }
+        return fmt::format("TRAP x{:02X}", vector);
+    }
+    default:
+        return fmt::format(".FILL x{:04X}", instruction);
+    }
+}
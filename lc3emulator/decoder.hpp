@@ -0,0 +1,162 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+
+enum class InstructionOpCode : uint8_t {
+    BR = 0b0000,
+    ADD = 0b0001,
+    LD = 0b0010,
+    ST = 0b0011,
+    JSR_JSRR = 0b0100,
+    AND = 0b0101,
+    LDR = 0b0110,
+    STR = 0b0111,
+    RTI = 0b1000,
+    NOT = 0b1001,
+    LDI = 0b1010,
+    STI = 0b1011,
+    JMP_RET = 0b1100,
+    NON = 0b1101,
+    LEA = 0b1110,
+    TRAP = 0b1111,
+};
+
+enum class Traps : uint8_t {
+    GETC = 0x20,
+    T_OUT = 0x21, // add T_ to avoid name collision
+    PUTS = 0x22,
+    T_IN = 0x23,
+    PUTSP = 0x24,
+    HALT = 0x25
+};
+
+enum Register : uint8_t {
+    R0 = 0, R1 = 1, R2 = 2, R3 = 3, R4 = 4, R5 = 5, R6 = 6, R7 = 7
+};
+
+// Every instruction variant has its own handler, so executing one never
+// tests mode bits at runtime. UNDECODED marks a word that still has to go
+// through decode().
+enum class Handler : uint8_t {
+    UNDECODED,
+    // BR with no n/z/p bits, followed by one handler per n/z/p mask value
+    BR,
+    BR_P,
+    BR_Z,
+    BR_ZP,
+    BR_N,
+    BR_NP,
+    BR_NZ,
+    BR_NZP,
+    ADD_REGISTER,
+    ADD_IMMEDIATE,
+    AND_REGISTER,
+    AND_IMMEDIATE,
+    JSR,
+    JSRR,
+    LD,
+    ST,
+    LDR,
+    STR,
+    RTI,
+    NOT,
+    LDI,
+    STI,
+    JMP_RET,
+    NON,
+    LEA,
+    TRAP,
+};
+
+// opcode, bits [11:9] and bit 5: all the bits that select a variant
+constexpr uint8_t variantIndex(uint16_t instruction)
+{
+    return ((instruction >> 12) << 4) | (((instruction >> 9) & 0x7) << 1) |
+           ((instruction >> 5) & 0x1);
+}
+
+constexpr Handler handlerForVariant(uint8_t variant)
+{
+    auto opCode = static_cast<InstructionOpCode>(variant >> 4);
+    uint8_t bits11To9 = (variant >> 1) & 0x7;
+    bool bit5 = variant & 0x1;
+    switch (opCode) {
+    case InstructionOpCode::BR:
+        return static_cast<Handler>(static_cast<uint8_t>(Handler::BR) +
+                                    bits11To9);
+    case InstructionOpCode::ADD:
+        return bit5 ? Handler::ADD_IMMEDIATE : Handler::ADD_REGISTER;
+    case InstructionOpCode::AND:
+        return bit5 ? Handler::AND_IMMEDIATE : Handler::AND_REGISTER;
+    case InstructionOpCode::JSR_JSRR:
+        return (bits11To9 & 0b100) ? Handler::JSR : Handler::JSRR;
+    case InstructionOpCode::LD:
+        return Handler::LD;
+    case InstructionOpCode::ST:
+        return Handler::ST;
+    case InstructionOpCode::LDR:
+        return Handler::LDR;
+    case InstructionOpCode::STR:
+        return Handler::STR;
+    case InstructionOpCode::RTI:
+        return Handler::RTI;
+    case InstructionOpCode::NOT:
+        return Handler::NOT;
+    case InstructionOpCode::LDI:
+        return Handler::LDI;
+    case InstructionOpCode::STI:
+        return Handler::STI;
+    case InstructionOpCode::JMP_RET:
+        return Handler::JMP_RET;
+    case InstructionOpCode::LEA:
+        return Handler::LEA;
+    case InstructionOpCode::TRAP:
+        return Handler::TRAP;
+    default:
+        return Handler::NON;
+    }
+}
+
+// built at compile time, indexed by variantIndex()
+inline constexpr auto HANDLERS = [] {
+    std::array<Handler, 256> handlers{};
+    for (uint16_t variant = 0; variant < handlers.size(); ++variant) {
+        handlers[variant] = handlerForVariant(variant);
+    }
+    return handlers;
+}();
+
+// Instruction with all of its fields already extracted, so executing it
+// doesn't need any bit manipulation. One of these is kept for every memory
+// word (see Memory::fetch).
+struct DecodedInstruction {
+    InstructionOpCode opCode;
+    Handler handler;
+    // bits [11:9]: DR, SR of ST/STI/STR or the n/z/p mask of BR
+    uint8_t destinationRegister;
+    // bits [8:6]: SR1 or BaseR
+    uint8_t sourceRegister;
+    // bits [2:0]: SR2 of ADD/AND
+    uint8_t secondSourceRegister;
+    // ADD/AND with imm5 or JSR (as opposed to JSRR)
+    bool isImmediate;
+    // sign-extended imm5/offset6/PCoffset9/PCoffset11, or trapvect8
+    uint16_t immediateValue;
+
+    bool isDecoded() const { return handler != Handler::UNDECODED; }
+    bool operator==(const DecodedInstruction&) const = default;
+};
+
+uint16_t retrieveBits(uint16_t insturction, uint8_t start, uint8_t size);
+uint16_t signExtend(uint16_t offset, uint8_t bitCount);
+uint16_t signExtendRetriveBits(uint16_t insturction, uint8_t start,
+                               uint8_t size);
+
+DecodedInstruction decode(uint16_t instruction);
+// assembler mnemonic, JSR/JMP stand for JSRR/RET too
+const char* opCodeName(InstructionOpCode opCode);
+// `instruction` as assembly, PC-relative operands are resolved against
+// `pc`, the address it was fetched from
+std::string disassemble(uint16_t instruction, uint16_t pc);
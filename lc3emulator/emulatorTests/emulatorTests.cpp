@@ -1,6 +1,16 @@
 #include "../CPU.hpp"
+#include "../lockstep.hpp"
+#include <algorithm>
 #include <bitset>
+#include <filesystem>
+#include <fstream>
 #include <gtest/gtest.h>
+#include <sstream>
+#include <thread>
+
+#if LC3_FD_IO_AVAILABLE
+#include <unistd.h>
+#endif
 
 namespace {
 uint16_t RESET_PC = 0x3000;
@@ -48,6 +58,43 @@ class InstructionBuilder {
     std::bitset<16> m_instruction;
 };
 
+// MemoryIo whose every byte only shows up after it was polled
+// `hiddenPolls` times, like keys typed while the program runs
+class LateInputIo : public MemoryIo {
+  public:
+    LateInputIo(std::string input, int hiddenPolls)
+        : MemoryIo(std::move(input)), m_hiddenPolls(hiddenPolls),
+          m_polls(0)
+    {
+    }
+
+    int read() override
+    {
+        m_polls = 0;
+        return MemoryIo::read();
+    }
+    bool hasInput() override
+    {
+        return ++m_polls > m_hiddenPolls && MemoryIo::hasInput();
+    }
+
+  private:
+    int m_hiddenPolls;
+    int m_polls;
+};
+
+// answers 42 and remembers the last write
+class TestDevice : public MemoryMappedDevice {
+  public:
+    uint16_t read(uint16_t) override { return 42; }
+    void write(uint16_t address, uint16_t value) override
+    {
+        lastWrite = {address, value};
+    }
+
+    std::pair<uint16_t, uint16_t> lastWrite{};
+};
+
 template <uint16_t bitcount = 9>
 static std::string toBinaryString(uint16_t number)
 {
@@ -72,7 +119,7 @@ class CPUTests : public ::testing::Test {
         cpu.emulate(addInstruction);
         ASSERT_EQ(cpu.m_registers[R0],
                   cpu.m_registers[R1] + cpu.m_registers[R2]);
-        ASSERT_EQ(cpu.m_conditionalCodes.P, true);
+        ASSERT_EQ(cpu.conditionalCodes().P, true);
     }
 
     void testAndInstruction()
@@ -89,7 +136,7 @@ class CPUTests : public ::testing::Test {
         cpu.m_registers[R1] = 8;
         cpu.emulate(andInstruction);
         ASSERT_EQ(cpu.m_registers[R0], cpu.m_registers[R1] & immediateValue);
-        ASSERT_EQ(cpu.m_conditionalCodes.Z, true);
+        ASSERT_EQ(cpu.conditionalCodes().Z, true);
     }
 
     void testBrInsturction()
@@ -115,7 +162,7 @@ class CPUTests : public ::testing::Test {
         ASSERT_EQ(cpu.m_pc, INIT_PC);
 
         // // both N = 1 and n = 1, so jump
-        cpu.m_conditionalCodes.N = true;
+        cpu.m_conditionValue = 0x8000;
         cpu.m_pc = INIT_PC;
         uint16_t instructionBRnN = InstructionBuilder()
                                        .set(InstructionOpCode::BR)
@@ -154,7 +201,7 @@ class CPUTests : public ::testing::Test {
                                    .build();
         cpu.emulate(instruction);
         ASSERT_EQ(cpu.m_registers[R1], value);
-        ASSERT_EQ(cpu.m_conditionalCodes.P, true);
+        ASSERT_EQ(cpu.conditionalCodes().P, true);
     }
 
     void testJMP_RETInsturctions()
@@ -223,7 +270,7 @@ class CPUTests : public ::testing::Test {
                                       .build();
         cpu.emulate(ldiInstruction);
         ASSERT_EQ(cpu.m_registers[destinationRegisterIndex], 0);
-        ASSERT_EQ(cpu.m_conditionalCodes.Z, true);
+        ASSERT_EQ(cpu.conditionalCodes().Z, true);
     }
 
     void testLdrInstruction()
@@ -244,7 +291,7 @@ class CPUTests : public ::testing::Test {
 
         cpu.emulate(ldrInstruction);
         ASSERT_EQ(cpu.m_registers[destinationRegisterIndex], value);
-        ASSERT_EQ(cpu.m_conditionalCodes.P, true);
+        ASSERT_EQ(cpu.conditionalCodes().P, true);
     }
 
     void testLeaInstruction()
@@ -274,7 +321,7 @@ class CPUTests : public ::testing::Test {
         cpu.emulate(notInstruction);
         ASSERT_EQ(cpu.m_registers[destinationRegisterNumber],
                   (uint16_t)~cpu.m_registers[sourceRegisterNumber]);
-        ASSERT_EQ(cpu.m_conditionalCodes.P, true);
+        ASSERT_EQ(cpu.conditionalCodes().P, true);
     }
 
     void testStInstruction()
@@ -329,6 +376,1190 @@ class CPUTests : public ::testing::Test {
                   cpu.m_registers[sourceRegisterNumber]);
     }
 
+    void testBranchVariants()
+    {
+        uint16_t offset = 5;
+        for (uint8_t nzp = 0; nzp < 8; ++nzp) {
+            uint16_t branchInstruction = InstructionBuilder()
+                                             .set(InstructionOpCode::BR)
+                                             .set(toBinaryString<3>(nzp))
+                                             .set(toBinaryString(offset))
+                                             .build();
+            ASSERT_EQ(decode(branchInstruction).handler,
+                      static_cast<Handler>(
+                          static_cast<uint8_t>(Handler::BR) + nzp));
+            for (auto [value, bits] : {std::pair<uint16_t, uint8_t>{0xFFFF, 0b100},
+                                       {0, 0b010},
+                                       {1, 0b001}}) {
+                cpu.m_pc = INIT_PC;
+                cpu.m_conditionValue = value;
+                cpu.emulate(branchInstruction);
+                bool isTaken = nzp == 0 || (nzp & bits);
+                ASSERT_EQ(cpu.m_pc, isTaken ? INIT_PC + offset : INIT_PC);
+            }
+        }
+    }
+
+    void testHandlerVariants()
+    {
+        static_assert(HANDLERS[variantIndex(0x1021)] == Handler::ADD_IMMEDIATE);
+        static_assert(HANDLERS[variantIndex(0x1001)] == Handler::ADD_REGISTER);
+        static_assert(HANDLERS[variantIndex(0x5020)] == Handler::AND_IMMEDIATE);
+        static_assert(HANDLERS[variantIndex(0x5002)] == Handler::AND_REGISTER);
+        static_assert(HANDLERS[variantIndex(0x4810)] == Handler::JSR);
+        static_assert(HANDLERS[variantIndex(0x4080)] == Handler::JSRR);
+        static_assert(HANDLERS[variantIndex(0xF025)] == Handler::TRAP);
+        static_assert(HANDLERS[variantIndex(0xD000)] == Handler::NON);
+        ASSERT_EQ(decode(0x1021).handler, Handler::ADD_IMMEDIATE);
+    }
+
+    void testLazyConditionalCodes()
+    {
+        ASSERT_TRUE(cpu.conditionalCodes().Z);
+
+        // NOT R0, R1 ; R1 = 0, so R0 = xFFFF
+        uint16_t notInstruction = InstructionBuilder()
+                                      .set(InstructionOpCode::NOT)
+                                      .set(R0)
+                                      .set(R1)
+                                      .set("111111")
+                                      .build();
+        cpu.emulate(notInstruction);
+        ASSERT_EQ(cpu.m_conditionValue, 0xFFFF);
+        auto conditionalCodes = cpu.conditionalCodes();
+        ASSERT_TRUE(conditionalCodes.N);
+        ASSERT_FALSE(conditionalCodes.Z);
+        ASSERT_FALSE(conditionalCodes.P);
+    }
+
+    void testDecodedInstructionIsInvalidatedOnWrite()
+    {
+        // ADD R0, R1, #5
+        uint16_t addInstruction = InstructionBuilder()
+                                      .set(InstructionOpCode::ADD)
+                                      .set(R0)
+                                      .set(R1)
+                                      .set("1")
+                                      .set(toBinaryString<5>(5))
+                                      .build();
+        // NOT R3, R4
+        uint16_t notInstruction = InstructionBuilder()
+                                      .set(InstructionOpCode::NOT)
+                                      .set(R3)
+                                      .set(R4)
+                                      .set("111111")
+                                      .build();
+        cpu.m_memory.write(RESET_PC, addInstruction);
+        auto decoded = cpu.m_memory.fetch(RESET_PC);
+        ASSERT_EQ(decoded.opCode, InstructionOpCode::ADD);
+        ASSERT_EQ(decoded.destinationRegister, R0);
+        ASSERT_EQ(decoded.sourceRegister, R1);
+        ASSERT_TRUE(decoded.isImmediate);
+        ASSERT_EQ(decoded.immediateValue, 5);
+
+        cpu.m_memory.write(RESET_PC, notInstruction);
+        decoded = cpu.m_memory.fetch(RESET_PC);
+        ASSERT_EQ(decoded.opCode, InstructionOpCode::NOT);
+        ASSERT_EQ(decoded.destinationRegister, R3);
+        ASSERT_EQ(decoded.sourceRegister, R4);
+    }
+
+    void runProgram(CPU& cpu, const std::vector<uint16_t>& program)
+    {
+        for (uint16_t i = 0; i < program.size(); ++i) {
+            cpu.m_memory.write(RESET_PC + i, program[i]);
+        }
+        cpu.m_pc = RESET_PC;
+        cpu.emulate();
+    }
+
+    void testEngine(Engine engine)
+    {
+        // AND R0, R0, #0
+        // ADD R1, R0, #5
+        // LOOP ADD R0, R0, #3
+        // ADD R1, R1, #-1
+        // BRp LOOP
+        // HALT
+        std::vector<uint16_t> program = {
+            InstructionBuilder().set(InstructionOpCode::AND).set(R0).set(R0)
+                .set("1").set(toBinaryString<5>(0)).build(),
+            InstructionBuilder().set(InstructionOpCode::ADD).set(R1).set(R0)
+                .set("1").set(toBinaryString<5>(5)).build(),
+            InstructionBuilder().set(InstructionOpCode::ADD).set(R0).set(R0)
+                .set("1").set(toBinaryString<5>(3)).build(),
+            InstructionBuilder().set(InstructionOpCode::ADD).set(R1).set(R1)
+                .set("1").set(toBinaryString<5>(-1)).build(),
+            InstructionBuilder().set(InstructionOpCode::BR).set("001")
+                .set(toBinaryString(-3)).build(),
+            0xF025};
+        CPU engineCpu(engine);
+        runProgram(engineCpu, program);
+        ASSERT_EQ(engineCpu.m_registers[R0], 15);
+        ASSERT_EQ(engineCpu.m_registers[R1], 0);
+        ASSERT_EQ(engineCpu.m_pc, RESET_PC + program.size());
+        // only the engines that use them pay for block tables and JIT code
+        ASSERT_EQ(engineCpu.m_blocks.empty(),
+                  engine == Engine::SWITCH || engine == Engine::THREADED);
+        ASSERT_EQ(engineCpu.m_jit != nullptr, engine == Engine::JIT);
+    }
+
+    void testSelfModifyingCodeInvalidatesBlock()
+    {
+        auto addR1 = [](uint16_t value) {
+            return InstructionBuilder()
+                .set(InstructionOpCode::ADD)
+                .set(R1)
+                .set(R1)
+                .set("1")
+                .set(toBinaryString<5>(value))
+                .build();
+        };
+        // AND R1, R1, #0
+        // LD R0, NEW_INSTRUCTION
+        // ST R0, PATCH
+        // ADD R1, R1, #1
+        // PATCH ADD R1, R1, #1
+        // HALT
+        // NEW_INSTRUCTION .FILL ADD R1, R1, #7
+        std::vector<uint16_t> program = {
+            InstructionBuilder().set(InstructionOpCode::AND).set(R1).set(R1)
+                .set("1").set(toBinaryString<5>(0)).build(),
+            InstructionBuilder().set(InstructionOpCode::LD).set(R0)
+                .set(toBinaryString(4)).build(),
+            InstructionBuilder().set(InstructionOpCode::ST).set(R0)
+                .set(toBinaryString(1)).build(),
+            addR1(1),
+            addR1(1),
+            0xF025,
+            addR1(7)};
+        CPU blockCpu(Engine::BLOCK);
+        runProgram(blockCpu, program);
+        ASSERT_EQ(blockCpu.m_registers[R1], 8);
+    }
+
+    void testSelfModifyingCodeAcrossSlices(Engine engine)
+    {
+        //       LD R0, INTERVAL
+        //       STI R0, TMIR
+        //       LD R2, NEW
+        //       AND R1, R1, #0
+        //       AND R5, R5, #0
+        //       ADD R5, R5, #2
+        //       BRnzp PATCH
+        // PATCH ADD R1, R1, #1
+        //       ST R2, PATCH
+        //       ADD R6, R6, #0 (eight times)
+        //       ADD R5, R5, #-1
+        //       BRp PATCH
+        //       HALT
+        // INTERVAL .FILL #15
+        // NEW .FILL ADD R1, R1, #7
+        // TMIR .FILL xFE0A
+        // The first timer slice ends ten instructions into the block at
+        // PATCH, so the ST runs one at a time after the block was
+        // translated. The second pass has to see the new instruction.
+        std::vector<uint16_t> program = {0x2013, 0xB014, 0x2412, 0x5260,
+                                         0x5B60, 0x1B62, 0x0E00, 0x1261,
+                                         0x35FE};
+        program.insert(program.end(), 8, 0x1DA0);
+        program.insert(program.end(),
+                       {0x1B7F, 0x03F4, 0xF025, 15, 0x1267, 0xFE0A});
+        MemoryIo io;
+        CPU patchedCpu(engine);
+        patchedCpu.setIo(io);
+        patchedCpu.m_memory.assign(RESET_PC, program.data(), program.size());
+        patchedCpu.m_pc = RESET_PC;
+        ASSERT_EQ(patchedCpu.run(1000).reason, StopReason::HALT);
+        ASSERT_EQ(patchedCpu.m_registers[R1], 8);
+    }
+
+    void testBlockFusion()
+    {
+        // AND R2, R2, #0
+        // ADD R2, R2, #9
+        // LOOP ADD R3, R3, #-1
+        // BRp LOOP
+        std::vector<uint16_t> program = {
+            InstructionBuilder().set(InstructionOpCode::AND).set(R2).set(R2)
+                .set("1").set(toBinaryString<5>(0)).build(),
+            InstructionBuilder().set(InstructionOpCode::ADD).set(R2).set(R2)
+                .set("1").set(toBinaryString<5>(9)).build(),
+            InstructionBuilder().set(InstructionOpCode::ADD).set(R3).set(R3)
+                .set("1").set(toBinaryString<5>(-1)).build(),
+            InstructionBuilder().set(InstructionOpCode::BR).set("001")
+                .set(toBinaryString(-2)).build()};
+        for (uint16_t i = 0; i < program.size(); ++i) {
+            cpu.m_memory.write(RESET_PC + i, program[i]);
+        }
+        auto block = translateBlock(cpu.m_memory, RESET_PC, cpu.m_cycleTable);
+        ASSERT_EQ(block.end, RESET_PC + program.size());
+        ASSERT_EQ(block.microOps.size(), 2);
+        ASSERT_EQ(block.microOps[0].kind, MicroOpKind::LOAD_IMMEDIATE);
+        ASSERT_FALSE(block.microOps[0].setsConditionalCodes);
+        ASSERT_EQ(block.microOps[1].kind, MicroOpKind::ADD_BRANCH);
+        ASSERT_EQ(block.microOps[1].address, RESET_PC + 2);
+    }
+
+    // see testEnginesAgreeOnHotLoop
+    static std::vector<uint16_t> hotLoopProgram()
+    {
+        return {0x2C16, 0xE218, 0xE41F, 0x2614, 0x6840, 0x1906, 0x7880,
+                0x1261, 0x14A1, 0x16FF, 0x03F9, 0x4803, 0x1DBF, 0x03F3,
+                0xF025, 0xE212, 0x2607, 0x6840, 0x1B44, 0x1261, 0x16FF,
+                0x0BFB, 0xC1C0, 0x00C8, 0x0008, 0x0041, 0x0001, 0xFFFE,
+                0x0003, 0xFFFC, 0x0005, 0x012C, 0xFFF9, 0x0008, 0x0000,
+                0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000};
+    }
+
+    void testInstructionBudget(Engine engine)
+    {
+        auto program = hotLoopProgram();
+        CPU reference(Engine::SWITCH);
+        for (uint16_t i = 0; i < program.size(); ++i) {
+            reference.m_memory.write(RESET_PC + i, program[i]);
+        }
+        reference.m_pc = RESET_PC;
+        auto expected = reference.run();
+
+        CPU engineCpu(engine);
+        for (uint16_t i = 0; i < program.size(); ++i) {
+            engineCpu.m_memory.write(RESET_PC + i, program[i]);
+        }
+        engineCpu.m_pc = RESET_PC;
+        uint64_t retired = 0;
+        RunResult result;
+        do {
+            // odd slice size, so slices end in the middle of blocks
+            result = engineCpu.run(37);
+            retired += result.instructionsRetired;
+            ASSERT_EQ(result.finalPc, engineCpu.m_pc);
+            if (result.reason == StopReason::BUDGET_EXHAUSTED) {
+                ASSERT_EQ(result.instructionsRetired, 37);
+                ASSERT_EQ(result.pc, engineCpu.m_pc);
+            }
+        } while (result.reason == StopReason::BUDGET_EXHAUSTED);
+
+        ASSERT_EQ(result.reason, StopReason::HALT);
+        ASSERT_EQ(engineCpu.m_registers, reference.m_registers);
+        ASSERT_EQ(engineCpu.m_pc, reference.m_pc);
+        ASSERT_EQ(retired, expected.instructionsRetired);
+    }
+
+    void testSnapshotReset(Engine engine)
+    {
+        auto program = hotLoopProgram();
+        CPU engineCpu(engine);
+        for (uint16_t i = 0; i < program.size(); ++i) {
+            engineCpu.m_memory.write(RESET_PC + i, program[i]);
+        }
+        engineCpu.m_pc = RESET_PC;
+        engineCpu.snapshot();
+        auto expected = engineCpu.run();
+        auto expectedRegisters = engineCpu.m_registers;
+
+        // stop halfway through once, then run to the end
+        for (uint64_t maxInstructions : {uint64_t(1000), CPU::UNLIMITED}) {
+            engineCpu.reset();
+            ASSERT_EQ(engineCpu.m_pc, RESET_PC);
+            ASSERT_EQ(engineCpu.m_registers, CPU::Registers{});
+            for (uint16_t i = 0; i < program.size(); ++i) {
+                ASSERT_EQ(engineCpu.m_memory[RESET_PC + i], program[i]);
+            }
+            auto result = engineCpu.run(maxInstructions);
+            if (maxInstructions == CPU::UNLIMITED) {
+                ASSERT_EQ(result.reason, StopReason::HALT);
+                ASSERT_EQ(result.instructionsRetired,
+                          expected.instructionsRetired);
+                ASSERT_EQ(engineCpu.m_registers, expectedRegisters);
+            }
+        }
+    }
+
+    void testSnapshotFile()
+    {
+        auto path =
+            (std::filesystem::temp_directory_path() / "lc3SnapshotTest.lc3s")
+                .string();
+        auto program = hotLoopProgram();
+        CPU reference;
+        for (uint16_t i = 0; i < program.size(); ++i) {
+            reference.m_memory.write(RESET_PC + i, program[i]);
+        }
+        reference.m_pc = RESET_PC;
+        reference.run(1000);
+        reference.saveSnapshot(path);
+
+        CPU resumed(Engine::JIT);
+        resumed.loadSnapshot(path);
+        ASSERT_EQ(resumed.m_pc, reference.m_pc);
+        ASSERT_EQ(resumed.m_registers, reference.m_registers);
+        ASSERT_EQ(resumed.m_conditionValue, reference.m_conditionValue);
+        ASSERT_TRUE(std::ranges::equal(resumed.m_memory.words(),
+                                       reference.m_memory.words()));
+        auto expected = reference.run();
+        auto result = resumed.run();
+        ASSERT_EQ(result.reason, StopReason::HALT);
+        ASSERT_EQ(result.instructionsRetired, expected.instructionsRetired);
+        ASSERT_EQ(resumed.m_registers, reference.m_registers);
+
+        // cut short
+        std::filesystem::resize_file(path,
+                                     std::filesystem::file_size(path) - 2);
+        ASSERT_THROW(resumed.loadSnapshot(path), std::runtime_error);
+        std::filesystem::remove(path);
+    }
+
+    void testLoadImages()
+    {
+        auto directory = std::filesystem::temp_directory_path();
+        auto writeImage = [&](const std::string& name,
+                              std::vector<uint16_t> words, bool isSwapped) {
+            auto path = (directory / name).string();
+            std::ofstream ofs(path, std::ios::binary);
+            for (uint16_t word : words) {
+                if (isSwapped) {
+                    word = (word << 8) | (word >> 8);
+                }
+                ofs.write(reinterpret_cast<const char*>(&word), sizeof word);
+            }
+            return path;
+        };
+        // long enough for the vectorized byte swap and its tail
+        std::vector<uint16_t> program = {0x3000};
+        for (uint16_t i = 0; i < 21; ++i) {
+            program.push_back(0x1000 + i * 0x0111);
+        }
+        auto swapped = writeImage("lc3Swapped.obj", program, true);
+        auto data = writeImage("lc3Data.obj", {0x4000, 1, 2, 3}, false);
+        auto overlapping = writeImage("lc3Overlap.obj", {0x4002, 4}, false);
+        auto system = writeImage("lc3System.obj", {0x0200, 1}, false);
+
+        CPU loaded;
+        loaded.load({swapped, data});
+        ASSERT_EQ(loaded.m_pc, 0x3000);
+        for (uint16_t i = 1; i < program.size(); ++i) {
+            ASSERT_EQ(loaded.m_memory[0x3000 + i - 1], program[i]);
+        }
+        ASSERT_EQ(loaded.m_memory[0x4002], 3);
+
+        CPU rejected;
+        ASSERT_THROW(rejected.load({data, overlapping}), std::runtime_error);
+        ASSERT_THROW(rejected.load(system), std::runtime_error);
+        // nothing is copied unless every segment is valid
+        ASSERT_EQ(rejected.m_memory[0x4000], 0);
+
+        for (const auto& path : {swapped, data, overlapping, system}) {
+            std::filesystem::remove(path);
+        }
+    }
+
+    void testEnginesAgreeOnHotLoop(Engine engine)
+    {
+        // Copies SRC to DST adding a counter, then sums DST in a
+        // subroutine, 200 times. Hot enough for the JIT to compile it.
+        //
+        //       LD R6, COUNT
+        // OUTER LEA R1, SRC
+        //       LEA R2, DST
+        //       LD R3, LEN
+        // COPY  LDR R4, R1, #0
+        //       ADD R4, R4, R6
+        //       STR R4, R2, #0
+        //       ADD R1, R1, #1
+        //       ADD R2, R2, #1
+        //       ADD R3, R3, #-1
+        //       BRp COPY
+        //       JSR SUM
+        //       ADD R6, R6, #-1
+        //       BRp OUTER
+        //       HALT
+        // SUM   LEA R1, DST
+        //       LD R3, LEN
+        // SLOOP LDR R4, R1, #0
+        //       ADD R5, R5, R4
+        //       ADD R1, R1, #1
+        //       ADD R3, R3, #-1
+        //       BRnp SLOOP
+        //       RET
+        // COUNT .FILL #200
+        // LEN   .FILL #8
+        //       .FILL x41
+        // SRC   .FILL #1, #-2, #3, #-4, #5, #300, #-7, #8
+        // DST   .BLKW #8
+        auto program = hotLoopProgram();
+        CPU reference(Engine::SWITCH);
+        runProgram(reference, program);
+        CPU engineCpu(engine);
+        runProgram(engineCpu, program);
+
+        ASSERT_EQ(engineCpu.m_registers, reference.m_registers);
+        ASSERT_EQ(engineCpu.m_pc, reference.m_pc);
+        ASSERT_EQ(engineCpu.m_conditionValue, reference.m_conditionValue);
+        for (uint16_t i = 0; i < program.size(); ++i) {
+            ASSERT_EQ(engineCpu.m_memory[RESET_PC + i],
+                      reference.m_memory[RESET_PC + i]);
+        }
+    }
+
+    void testFaultsAreReturned(Engine engine)
+    {
+        CPU::ConditionalCode flags{};
+        auto runUntilStop = [&](const std::vector<uint16_t>& program) {
+            CPU faultingCpu(engine);
+            for (uint16_t i = 0; i < program.size(); ++i) {
+                faultingCpu.m_memory.write(RESET_PC + i, program[i]);
+            }
+            faultingCpu.m_pc = RESET_PC;
+            auto result = faultingCpu.run();
+            flags = faultingCpu.conditionalCodes();
+            return result;
+        };
+
+        // AND R2, R2, #0
+        // ADD R1, R1, #1
+        // LDR R0, R2, #0
+        auto result = runUntilStop({0x54A0, 0x1261, 0x6080, 0xF025});
+        ASSERT_EQ(result.reason, StopReason::ILLEGAL_READ);
+        ASSERT_EQ(result.pc, RESET_PC + 2);
+        ASSERT_EQ(result.detail, 0);
+        // the LDR would have overwritten them, but it never ran
+        ASSERT_TRUE(flags.P);
+
+        // AND R2, R2, #0
+        // STR R1, R2, #1
+        result = runUntilStop({0x54A0, 0x7281, 0xF025});
+        ASSERT_EQ(result.reason, StopReason::ILLEGAL_WRITE);
+        ASSERT_EQ(result.pc, RESET_PC + 1);
+        ASSERT_EQ(result.detail, 1);
+
+        // AND R2, R2, #0
+        // JMP R2
+        result = runUntilStop({0x54A0, 0xC080});
+        ASSERT_EQ(result.reason, StopReason::ILLEGAL_READ);
+        ASSERT_EQ(result.pc, 0);
+
+        result = runUntilStop({0x1261, 0xD000});
+        ASSERT_EQ(result.reason, StopReason::ILLEGAL_OPCODE);
+        ASSERT_EQ(result.pc, RESET_PC + 1);
+        ASSERT_EQ(result.detail, 0b1101);
+
+        result = runUntilStop({0x8000});
+        ASSERT_EQ(result.reason, StopReason::RTI);
+        ASSERT_EQ(result.pc, RESET_PC);
+
+        result = runUntilStop({0xF0FF});
+        ASSERT_EQ(result.reason, StopReason::UNSUPPORTED_TRAP);
+        ASSERT_EQ(result.detail, 0xFF);
+
+        result = runUntilStop({0xF025});
+        ASSERT_EQ(result.reason, StopReason::HALT);
+        ASSERT_EQ(result.pc, RESET_PC);
+    }
+
+    void testMemoryAttributes(Engine engine)
+    {
+        // AND R0, R0, #0
+        // LDI R0, DEVICE
+        // ADD R1, R0, #1
+        // STI R1, DEVICE
+        // HALT
+        // .FILL #0
+        // DEVICE .FILL xFE10
+        std::vector<uint16_t> program = {0x5020, 0xA004, 0x1221, 0xB202,
+                                         0xF025, 0x0000, 0xFE10};
+        TestDevice device;
+        CPU attributesCpu(engine);
+        for (uint16_t i = 0; i < program.size(); ++i) {
+            attributesCpu.m_memory.write(RESET_PC + i, program[i]);
+        }
+        attributesCpu.m_memory.mapDevice(0xFE10, 0xFE1F, &device);
+        attributesCpu.m_memory.addAttributes(RESET_PC + 2, RESET_PC + 2,
+                                             BREAKPOINT);
+        attributesCpu.m_pc = RESET_PC;
+
+        auto result = attributesCpu.run();
+        ASSERT_EQ(result.reason, StopReason::BREAKPOINT);
+        ASSERT_EQ(result.pc, RESET_PC + 2);
+        ASSERT_EQ(attributesCpu.m_pc, RESET_PC + 2);
+        ASSERT_EQ(attributesCpu.m_registers[R0], 42);
+        ASSERT_EQ(attributesCpu.m_registers[R1], 0);
+
+        attributesCpu.m_memory.removeAttributes(RESET_PC + 2, RESET_PC + 2,
+                                                BREAKPOINT);
+        result = attributesCpu.run();
+        ASSERT_EQ(result.reason, StopReason::HALT);
+        ASSERT_EQ(attributesCpu.m_registers[R1], 43);
+        ASSERT_EQ(device.lastWrite.first, 0xFE10);
+        ASSERT_EQ(device.lastWrite.second, 43);
+
+        // ST R0, #1
+        // HALT
+        attributesCpu.m_memory.write(RESET_PC, 0x3001);
+        attributesCpu.m_memory.write(RESET_PC + 1, 0xF025);
+        attributesCpu.m_memory.addAttributes(RESET_PC + 2, RESET_PC + 2,
+                                             READ_ONLY);
+        attributesCpu.m_pc = RESET_PC;
+        result = attributesCpu.run();
+        ASSERT_EQ(result.reason, StopReason::ILLEGAL_WRITE);
+        ASSERT_EQ(result.detail, RESET_PC + 2);
+    }
+
+    void testConsole()
+    {
+        // GETC
+        // OUT
+        // HALT
+        std::istringstream input("x");
+        std::ostringstream output;
+        cpu.setConsole(input, output);
+        runProgram(cpu, {0xF020, 0xF021, 0xF025});
+        ASSERT_EQ(output.str(), "xHALT\n");
+
+        // LEA R0, STRING
+        // PUTS
+        // BRnzp #-1
+        // STRING longer than the output buffer
+        std::vector<uint16_t> program = {0xE002, 0xF022, 0x0FFF};
+        std::string text;
+        for (size_t i = 0; i < OutputSink::BUFFER_SIZE + 100; ++i) {
+            text += char('a' + i % 26);
+        }
+        program.insert(program.end(), text.begin(), text.end());
+        program.push_back(0);
+
+        std::ostringstream putsOutput;
+        CPU putsCpu;
+        putsCpu.setConsole(input, putsOutput);
+        for (uint16_t i = 0; i < program.size(); ++i) {
+            putsCpu.m_memory.write(RESET_PC + i, program[i]);
+        }
+        putsCpu.m_pc = RESET_PC;
+        // stopping for any reason hands the output over
+        ASSERT_EQ(putsCpu.run(10).reason, StopReason::BUDGET_EXHAUSTED);
+        ASSERT_EQ(putsOutput.str(), text + "\n");
+    }
+
+    void testIoDevices()
+    {
+        // POLL LDI R0, KBSR
+        //      BRzp POLL
+        //      LDI R0, KBDR
+        //      OUT
+        //      HALT
+        std::vector<uint16_t> program = {0xA004, 0x07FE, 0xA003, 0xF021,
+                                         0xF025, 0xFE00, 0xFE02};
+        auto runWith = [&](IoDevice& io) {
+            CPU ioCpu;
+            ioCpu.setIo(io);
+            for (uint16_t i = 0; i < program.size(); ++i) {
+                ioCpu.m_memory.write(RESET_PC + i, program[i]);
+            }
+            ioCpu.m_pc = RESET_PC;
+            return ioCpu.run(1000).reason;
+        };
+
+        MemoryIo withKey("q");
+        ASSERT_EQ(runWith(withKey), StopReason::HALT);
+        ASSERT_EQ(withKey.output(), "qHALT\n");
+        MemoryIo withoutKey;
+        ASSERT_EQ(runWith(withoutKey), StopReason::BUDGET_EXHAUSTED);
+        ASSERT_EQ(withoutKey.output(), "");
+
+#if LC3_FD_IO_AVAILABLE
+        int input[2], output[2];
+        ASSERT_EQ(pipe(input), 0);
+        ASSERT_EQ(pipe(output), 0);
+        ASSERT_EQ(::write(input[1], "z", 1), 1);
+        FileDescriptorIo fdIo(input[0], output[1]);
+        ASSERT_EQ(runWith(fdIo), StopReason::HALT);
+        char printed[16] = {};
+        ASSERT_EQ(::read(output[0], printed, sizeof printed), 6);
+        ASSERT_STREQ(printed, "zHALT\n");
+        for (int fd : {input[0], input[1], output[0], output[1]}) {
+            close(fd);
+        }
+#endif
+    }
+
+    void testIdleSpin(Engine engine)
+    {
+        // POLL LDI R0, KBSR
+        //      BRzp POLL
+        //      LDI R0, KBDR
+        //      OUT
+        //      HALT
+        std::vector<uint16_t> program = {0xA004, 0x07FE, 0xA003, 0xF021,
+                                         0xF025, 0xFE00, 0xFE02};
+        // the loop is skipped, but it has to stop where spinning would
+        for (uint64_t budget : {1000, 1001, 12345}) {
+            MemoryIo io;
+            CPU idleCpu(engine);
+            idleCpu.setIo(io);
+            for (uint16_t i = 0; i < program.size(); ++i) {
+                idleCpu.m_memory.write(RESET_PC + i, program[i]);
+            }
+            idleCpu.m_pc = RESET_PC;
+            auto result = idleCpu.run(budget);
+            ASSERT_EQ(result.reason, StopReason::BUDGET_EXHAUSTED);
+            ASSERT_EQ(result.instructionsRetired, budget);
+            ASSERT_EQ(result.finalPc, RESET_PC + budget % 2);
+            ASSERT_EQ(idleCpu.m_registers[R0], 0);
+        }
+
+        // a key that comes while a bounded run skips the loop is seen by
+        // the next poll
+        {
+            LateInputIo io("k", 1);
+            CPU idleCpu(engine);
+            idleCpu.setIo(io);
+            idleCpu.m_memory.assign(RESET_PC, program.data(), program.size());
+            idleCpu.m_pc = RESET_PC;
+            auto result = idleCpu.run(1000000);
+            ASSERT_EQ(result.reason, StopReason::HALT);
+            ASSERT_LT(result.instructionsRetired, 100000);
+            ASSERT_EQ(idleCpu.m_registers[R0], 'k');
+        }
+
+        //      LD R0, ENABLE
+        //      STI R0, KBSR
+        // POLL LDI R0, KBSR
+        //      BRz POLL
+        //      HALT
+        // ENABLE .FILL x4000
+        // KBSR .FILL xFE00
+        // KBSR isn't zero with the interrupt enabled, so that isn't a spin
+        std::vector<uint16_t> enabled = {0x2004, 0xB004, 0xA003, 0x05FE,
+                                         0xF025, 0x4000, 0xFE00};
+        {
+            MemoryIo io;
+            CPU enabledCpu(engine);
+            enabledCpu.setIo(io);
+            enabledCpu.m_memory.assign(RESET_PC, enabled.data(),
+                                       enabled.size());
+            enabledCpu.m_pc = RESET_PC;
+            ASSERT_EQ(enabledCpu.run(1000).reason, StopReason::HALT);
+            ASSERT_EQ(enabledCpu.m_registers[R0], 0x4000);
+        }
+
+        // an unbounded run with all of its input read can't wait for a key
+        {
+            MemoryIo io;
+            CPU endedCpu(engine);
+            endedCpu.setIo(io);
+            endedCpu.m_memory.assign(RESET_PC, program.data(), program.size());
+            endedCpu.m_pc = RESET_PC;
+            auto start = std::chrono::steady_clock::now();
+            auto result = endedCpu.run();
+            ASSERT_LT(std::chrono::steady_clock::now() - start,
+                      std::chrono::seconds(1));
+            ASSERT_EQ(result.reason, StopReason::END_OF_INPUT);
+            ASSERT_EQ(result.pc, RESET_PC);
+            ASSERT_LT(result.instructionsRetired, 100);
+        }
+
+#if LC3_FD_IO_AVAILABLE
+        // an unbounded run waits for the key instead
+        int input[2], output[2];
+        ASSERT_EQ(pipe(input), 0);
+        ASSERT_EQ(pipe(output), 0);
+        FileDescriptorIo fdIo(input[0], output[1]);
+        CPU waitingCpu(engine);
+        waitingCpu.setIo(fdIo);
+        for (uint16_t i = 0; i < program.size(); ++i) {
+            waitingCpu.m_memory.write(RESET_PC + i, program[i]);
+        }
+        waitingCpu.m_pc = RESET_PC;
+        std::thread typist([&] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            ASSERT_EQ(::write(input[1], "w", 1), 1);
+        });
+        auto result = waitingCpu.run();
+        typist.join();
+        ASSERT_EQ(result.reason, StopReason::HALT);
+        // LDI, BRzp and a few turns at most before and after the wait
+        ASSERT_LT(result.instructionsRetired, 100);
+        for (int fd : {input[0], input[1], output[0], output[1]}) {
+            close(fd);
+        }
+#endif
+    }
+
+    void testOsTraps(Engine engine)
+    {
+        // LEA R0, STRING
+        // PUTS
+        // GETC
+        // OUT
+        // IN
+        // LEA R0, PACKED
+        // PUTSP
+        // HALT
+        // STRING "hi"
+        // PACKED "abc", two characters a word
+        std::vector<uint16_t> program = {0xE007, 0xF022, 0xF020, 0xF021,
+                                         0xF023, 0xE005, 0xF024, 0xF025,
+                                         'h',    'i',    0,      0x6261,
+                                         'c',    0};
+        // indexed by whether the traps ran natively
+        RunResult results[2];
+        CPU::Registers registers[2];
+        auto runWith = [&](const std::vector<uint16_t>& words,
+                           bool isNative) {
+            MemoryIo io("xy");
+            CPU osCpu(engine);
+            osCpu.setIo(io);
+            for (int vector = 0; vector < 256; ++vector) {
+                osCpu.setNativeTrap(vector, isNative);
+            }
+            for (uint16_t i = 0; i < words.size(); ++i) {
+                osCpu.m_memory.write(RESET_PC + i, words[i]);
+            }
+            osCpu.m_pc = RESET_PC;
+            results[isNative] = osCpu.run(100000);
+            registers[isNative] = osCpu.m_registers;
+            return io.output();
+        };
+        ASSERT_EQ(runWith(program, true), "hi\nxyabcHALT\n");
+        ASSERT_EQ(runWith(program, false), "hi\nxyabcHALT\n");
+        // through the OS, the run stops at the TRAP all the same
+        for (const auto& result : results) {
+            ASSERT_EQ(result.reason, StopReason::HALT);
+            ASSERT_EQ(result.pc, RESET_PC + 7);
+        }
+        // TRAP leaves the return address in R7 either way, the routines of
+        // the OS that stop the machine use R0 and R1 as well
+        ASSERT_EQ(registers[true][R7], RESET_PC + 8);
+        ASSERT_EQ(registers[false][R7], RESET_PC + 8);
+        // the traps that return leave every register the same, HALT is
+        // replaced by an illegal op code to see them
+        auto untilIllegal = program;
+        untilIllegal[7] = 0xD000;
+        ASSERT_EQ(runWith(untilIllegal, true), "hi\nxyabc");
+        ASSERT_EQ(runWith(untilIllegal, false), "hi\nxyabc");
+        ASSERT_EQ(results[true].reason, StopReason::ILLEGAL_OPCODE);
+        ASSERT_EQ(results[false].reason, StopReason::ILLEGAL_OPCODE);
+        ASSERT_EQ(registers[true], registers[false]);
+        ASSERT_EQ(registers[true][R7], RESET_PC + 7);
+        // AND R0, R0, #0
+        // TRAP x40
+        std::vector<uint16_t> unsupported = {0x5020, 0xF040};
+        ASSERT_EQ(runWith(unsupported, true), "");
+        ASSERT_EQ(runWith(unsupported, false), "");
+        for (const auto& result : results) {
+            ASSERT_EQ(result.reason, StopReason::UNSUPPORTED_TRAP);
+            ASSERT_EQ(result.pc, RESET_PC + 1);
+            ASSERT_EQ(result.detail, 0x40);
+        }
+        ASSERT_EQ(registers[true][R7], RESET_PC + 2);
+        ASSERT_EQ(registers[false][R7], RESET_PC + 2);
+
+        // A handler the program installs runs even with native traps on,
+        // from user space or, privileged, from system space.
+        // AND R0, R0, #0
+        // TRAP x26
+        // TRAP x27
+        // HALT
+        // ADD R0, R0, #1
+        // RET
+        MemoryIo io;
+        CPU handlerCpu(engine);
+        handlerCpu.setIo(io);
+        std::vector<uint16_t> handler = {0x1021, 0xC1C0};
+        std::vector<uint16_t> user = {0x5020, 0xF026, 0xF027, 0xF025};
+        user.insert(user.end(), handler.begin(), handler.end());
+        for (uint16_t i = 0; i < user.size(); ++i) {
+            handlerCpu.m_memory.write(RESET_PC + i, user[i]);
+        }
+        uint16_t vectors[] = {uint16_t(RESET_PC + 4), 0x1000};
+        handlerCpu.m_memory.assign(0x26, vectors, 2);
+        handlerCpu.m_memory.assign(0x1000, handler.data(), handler.size());
+        handlerCpu.m_pc = RESET_PC;
+        ASSERT_EQ(handlerCpu.run(1000).reason, StopReason::HALT);
+        ASSERT_EQ(handlerCpu.m_registers[R0], 2);
+        ASSERT_EQ(io.output(), "HALT\n");
+
+        // user code still can't jump into the OS
+        // JMP R0 (x0200)
+        CPU jumpCpu(engine);
+        jumpCpu.m_registers[R0] = 0x0200;
+        jumpCpu.m_memory.write(RESET_PC, 0xC000);
+        jumpCpu.m_pc = RESET_PC;
+        auto result = jumpCpu.run(10);
+        ASSERT_EQ(result.reason, StopReason::ILLEGAL_READ);
+        ASSERT_EQ(result.detail, 0x0200);
+    }
+
+    void testInterrupts(Engine engine)
+    {
+        //      LD R0, INTERVAL
+        //      STI R0, TMIR
+        //      LD R0, ENABLE
+        //      STI R0, TMSR
+        // WAIT ADD R3, R2, #-3
+        //      BRn WAIT
+        //      HALT
+        // INTERVAL .FILL #50
+        // ENABLE .FILL x4000
+        // TMIR .FILL xFE0A
+        // TMSR .FILL xFE08
+        std::vector<uint16_t> program = {0x2006, 0xB007, 0x2005, 0xB006,
+                                         0x16BD, 0x09FE, 0xF025, 50,
+                                         0x4000, 0xFE0A, 0xFE08};
+        // ADD R2, R2, #1
+        // RTI
+        std::vector<uint16_t> tick = {0x14A1, 0x8000};
+        CPU::Registers registers;
+        uint16_t processorStatus = 0;
+        auto runTimer = [&](bool hasHandler) {
+            MemoryIo io;
+            CPU timerCpu(engine);
+            timerCpu.setIo(io);
+            timerCpu.m_memory.assign(RESET_PC, program.data(), program.size());
+            if (hasHandler) {
+                uint16_t handler = 0x3010;
+                timerCpu.m_memory.assign(handler, tick.data(), tick.size());
+                timerCpu.m_memory.assign(0x0181, &handler, 1);
+            }
+            timerCpu.m_registers[R6] = 0x4000;
+            timerCpu.m_pc = RESET_PC;
+            EXPECT_EQ(timerCpu.run(100000).reason, StopReason::HALT);
+            registers = timerCpu.m_registers;
+            processorStatus = timerCpu.processorStatus();
+            return io.output();
+        };
+        // the ticks come back to user mode with its stack and flags
+        ASSERT_EQ(runTimer(true), "HALT\n");
+        ASSERT_EQ(registers[R2], 3);
+        ASSERT_EQ(registers[R6], 0x4000);
+        ASSERT_EQ(processorStatus & ~0x7, CPU::USER_MODE);
+        ASSERT_EQ(runTimer(false), "Unexpected interrupt\nHALT\n");
+
+        //      LD R0, ENABLE
+        //      STI R0, KBSR
+        // WAIT ADD R4, R4, #0
+        //      BRz WAIT
+        //      HALT
+        // ENABLE .FILL x4000
+        // KBSR .FILL xFE00
+        std::vector<uint16_t> waiting = {0x2004, 0xB004, 0x1920, 0x05FE,
+                                         0xF025, 0x4000, 0xFE00};
+        // LDI R4, KBDR
+        // RTI
+        // KBDR .FILL xFE02
+        std::vector<uint16_t> key = {0xA801, 0x8000, 0xFE02};
+        MemoryIo io("k");
+        CPU keyCpu(engine);
+        keyCpu.setIo(io);
+        keyCpu.m_memory.assign(RESET_PC, waiting.data(), waiting.size());
+        uint16_t handler = 0x3010;
+        keyCpu.m_memory.assign(handler, key.data(), key.size());
+        keyCpu.m_memory.assign(0x0180, &handler, 1);
+        keyCpu.m_pc = RESET_PC;
+        ASSERT_EQ(keyCpu.run(100000).reason, StopReason::HALT);
+        ASSERT_EQ(keyCpu.m_registers[R4], 'k');
+    }
+
+    void testCycleCounter(Engine engine)
+    {
+        //      LD R1, COUNT
+        // LOOP LDR R2, R6, #0
+        //      STR R2, R6, #1
+        //      ADD R1, R1, #-1
+        //      BRp LOOP
+        //      HALT
+        // COUNT .FILL #100
+        std::vector<uint16_t> program = {0x2205, 0x6580, 0x7581, 0x127F,
+                                         0x03FC, 0xF025, 100};
+        auto load = [&](CPU& cpu) {
+            cpu.m_memory.assign(RESET_PC, program.data(), program.size());
+            cpu.m_registers[R6] = 0x4000;
+            cpu.m_pc = RESET_PC;
+        };
+        // LD, LDR, STR and TRAP take 5 + 2 * 5, ADD and BR 4 + 5
+        MemoryIo io;
+        CPU cpu(engine);
+        cpu.setIo(io);
+        load(cpu);
+        auto first = cpu.run(50);
+        ASSERT_EQ(first.reason, StopReason::BUDGET_EXHAUSTED);
+        ASSERT_EQ(first.cycles, 15 + 12 * 48 + 15);
+        // a block left in the middle gives back what it didn't run
+        auto second = cpu.run();
+        ASSERT_EQ(second.reason, StopReason::HALT);
+        ASSERT_EQ(first.cycles + second.cycles, 15 + 100 * 48 + 15);
+        ASSERT_EQ(cpu.instructionCount(), 1 + 100 * 4 + 1);
+        ASSERT_EQ(cpu.cycleCount(), 15 + 100 * 48 + 15);
+
+        auto model = CycleModel::standard();
+        ASSERT_TRUE(parseCycleModel("ADD=1,memory=10", model));
+        ASSERT_FALSE(parseCycleModel("ADD=", model));
+        ASSERT_FALSE(parseCycleModel("XOR=1", model));
+        CPU slowMemoryCpu(engine);
+        slowMemoryCpu.setIo(io);
+        slowMemoryCpu.setCycleModel(model);
+        load(slowMemoryCpu);
+        // LD, LDR, STR and TRAP take 5 + 2 * 10, ADD 1 + 10, BR 4 + 10
+        ASSERT_EQ(slowMemoryCpu.run().cycles, 25 + 100 * 75 + 25);
+    }
+
+    void testProfiler(Engine engine)
+    {
+        // MAIN JSR SUB
+        //      JSR SUB
+        //      HALT
+        // SUB  ADD R0, R0, #1
+        //      RET
+        std::vector<uint16_t> program = {0x4802, 0x4801, 0xF025, 0x1021,
+                                         0xC1C0};
+        MemoryIo io;
+        Profiler profiler;
+        CPU cpu(engine);
+        cpu.setIo(io);
+        cpu.setProfiler(&profiler);
+        cpu.m_memory.assign(RESET_PC, program.data(), program.size());
+        cpu.m_pc = RESET_PC;
+        ASSERT_EQ(cpu.run().reason, StopReason::HALT);
+        ASSERT_EQ(profiler.executions(0x3003), 2);
+        ASSERT_EQ(profiler.executions(InstructionOpCode::JSR_JSRR), 2);
+        ASSERT_EQ(profiler.cycles(0x3002), 15);
+
+        auto path =
+            std::filesystem::temp_directory_path() / "lc3ProfilerTest.sym";
+        {
+            std::ofstream ofs(path);
+            ofs << "// Symbol table\n"
+                << "// Scope level 0:\n"
+                << "//\tSymbol Name       Page Address\n"
+                << "//\t----------------  ------------\n"
+                << "//\tMAIN              3000\n"
+                << "//\tSUB               3003\n";
+        }
+        Symbols symbols(path.string());
+        std::filesystem::remove(path);
+        ASSERT_EQ(symbols.describe(0x3004), "SUB+1");
+        ASSERT_EQ(symbols.describe(0x2FFF), "x2FFF");
+        // JSR 5 + 5, TRAP 5 + 2 * 5, ADD and RET 4 + 5
+        std::ostringstream folded;
+        profiler.writeFoldedStacks(folded, symbols);
+        ASSERT_EQ(folded.str(), "MAIN 35\nMAIN;SUB 36\n");
+    }
+
+    void testTrace(Engine engine)
+    {
+        // LD R1, VALUE
+        // ST R1, RESULT
+        // HALT
+        // VALUE .FILL #5
+        // RESULT .FILL #0
+        std::vector<uint16_t> program = {0x2202, 0x3202, 0xF025, 5, 0};
+        auto path =
+            std::filesystem::temp_directory_path() / "lc3TraceTest.lc3t";
+        {
+            // small enough to wrap around a few times
+            TraceWriter tracer(path.string(), 64);
+            MemoryIo io;
+            CPU cpu(engine);
+            cpu.setIo(io);
+            cpu.setTracer(&tracer);
+            cpu.m_memory.assign(RESET_PC, program.data(), program.size());
+            cpu.m_pc = RESET_PC;
+            ASSERT_EQ(cpu.run().reason, StopReason::HALT);
+            tracer.close();
+        }
+        TraceReader reader(path.string());
+        std::vector<TraceRecord> records;
+        for (TraceRecord record; reader.next(record);) {
+            records.push_back(record);
+        }
+        std::filesystem::remove(path);
+        ASSERT_EQ(records.size(), 3);
+        ASSERT_EQ(records[0].pc, 0x3000);
+        ASSERT_EQ(records[0].instruction, 0x2202);
+        ASSERT_EQ(records[0].registerMask, 1 << R1);
+        ASSERT_EQ(records[0].registers[R1], 5);
+        ASSERT_FALSE(records[0].hasMemoryWrite);
+        ASSERT_EQ(records[1].registerMask, 0);
+        ASSERT_TRUE(records[1].hasMemoryWrite);
+        ASSERT_EQ(records[1].address, 0x3004);
+        ASSERT_EQ(records[1].value, 5);
+        ASSERT_EQ(records[2].pc, 0x3002);
+
+        ASSERT_EQ(disassemble(0x03F9, 0x300A), "BRp x3004");
+        ASSERT_EQ(disassemble(0x0000, 0x3000), "BR x3001");
+        ASSERT_EQ(disassemble(0x127F, 0x3000), "ADD R1, R1, #-1");
+        ASSERT_EQ(disassemble(0x7581, 0x3000), "STR R2, R6, #1");
+        ASSERT_EQ(disassemble(0xC1C0, 0x3000), "RET");
+        ASSERT_EQ(disassemble(0xF025, 0x3000), "HALT");
+    }
+
+    void testInputLog()
+    {
+        // POLL LDI R1, KBSR
+        //      BRzp POLL
+        //      LDI R0, KBDR
+        //      OUT
+        //      GETC
+        //      OUT
+        //      HALT
+        // KBSR .FILL xFE00
+        // KBDR .FILL xFE02
+        std::vector<uint16_t> program = {0xA206, 0x07FE, 0xA005, 0xF021,
+                                         0xF020, 0xF021, 0xF025, 0xFE00,
+                                         0xFE02};
+        auto path =
+            std::filesystem::temp_directory_path() / "lc3InputLogTest.txt";
+        auto run = [&](Engine engine, IoDevice& device, InputLog::Mode mode) {
+            InputLog log(mode, device, path.string());
+            CPU cpu(engine);
+            cpu.setInputLog(log);
+            cpu.m_memory.assign(RESET_PC, program.data(), program.size());
+            cpu.m_pc = RESET_PC;
+            auto result = cpu.run();
+            EXPECT_EQ(result.reason, StopReason::HALT);
+            return result;
+        };
+        auto readLog = [&] {
+            std::ifstream ifs(path);
+            std::stringstream content;
+            content << ifs.rdbuf();
+            return content.str();
+        };
+
+        std::string recorded;
+        RunResult recordedResult{};
+        for (auto engine : {Engine::SWITCH, Engine::THREADED, Engine::BLOCK,
+                            Engine::JIT}) {
+            // the first key comes while the program spins on KBSR, the
+            // second one only once GETC waits for it
+            LateInputIo device("ab", 3);
+            auto result = run(engine, device, InputLog::Mode::RECORD);
+            ASSERT_EQ(device.output(), "abHALT\n");
+            // input arrives at the same counts on every engine
+            if (recorded.empty()) {
+                recorded = readLog();
+                recordedResult = result;
+            }
+            ASSERT_EQ(readLog(), recorded);
+            ASSERT_EQ(result.instructionsRetired,
+                      recordedResult.instructionsRetired);
+            ASSERT_EQ(result.cycles, recordedResult.cycles);
+        }
+        // the spin sees the first key at the first poll of the device,
+        // GETC gets the second one after LDI, BRzp, LDI and OUT
+        ASSERT_EQ(recorded,
+                  fmt::format("{} 97\n{} 98\n", InputLog::POLL_INTERVAL,
+                              InputLog::POLL_INTERVAL + 4));
+
+        for (auto engine : {Engine::SWITCH, Engine::THREADED, Engine::BLOCK,
+                            Engine::JIT}) {
+            // the device's own input is never read
+            MemoryIo device("xyz");
+            auto result = run(engine, device, InputLog::Mode::REPLAY);
+            ASSERT_EQ(device.output(), "abHALT\n");
+            ASSERT_EQ(result.instructionsRetired,
+                      recordedResult.instructionsRetired);
+            ASSERT_EQ(result.cycles, recordedResult.cycles);
+        }
+
+        // lockstep lanes replay on their own CPUs
+        Lockstep lockstep(Lockstep::MIN_GROUP_SIZE);
+        std::vector<std::unique_ptr<MemoryIo>> devices;
+        std::vector<std::unique_ptr<InputLog>> logs;
+        for (size_t i = 0; i < lockstep.laneCount(); ++i) {
+            devices.push_back(std::make_unique<MemoryIo>());
+            logs.push_back(std::make_unique<InputLog>(
+                InputLog::Mode::REPLAY, *devices.back(), path.string()));
+            CPU& lane = lockstep.lane(i);
+            lane.setInputLog(*logs.back());
+            lane.m_memory.assign(RESET_PC, program.data(), program.size());
+            lane.m_pc = RESET_PC;
+        }
+        auto results = lockstep.run();
+        for (size_t i = 0; i < results.size(); ++i) {
+            ASSERT_EQ(results[i].reason, StopReason::HALT);
+            ASSERT_EQ(devices[i]->output(), "abHALT\n");
+            ASSERT_EQ(results[i].instructionsRetired,
+                      recordedResult.instructionsRetired);
+        }
+        std::filesystem::remove(path);
+    }
+
+    void testLockstep(Engine engine)
+    {
+        // GETC
+        // AND R1, R1, #0
+        // LOOP ADD R1, R1, #1
+        // ADD R0, R0, #-1
+        // BRp LOOP
+        // OUT
+        // HALT
+        std::vector<uint16_t> program = {0xF020, 0x5260, 0x1261, 0x103F,
+                                         0x03FD, 0xF021, 0xF025};
+        // lanes loop a different number of times, so they split one by one
+        constexpr size_t laneCount = 24;
+        std::vector<std::istringstream> inputs;
+        std::vector<std::ostringstream> outputs(laneCount);
+        auto inputFor = [](size_t lane) {
+            return std::string(1, char(lane % 3 == 0 ? 5 : 9 + lane));
+        };
+        for (size_t i = 0; i < laneCount; ++i) {
+            inputs.emplace_back(inputFor(i));
+        }
+
+        Lockstep lockstep(laneCount, engine);
+        for (size_t i = 0; i < laneCount; ++i) {
+            auto& lane = lockstep.lane(i);
+            lane.setConsole(inputs[i], outputs[i]);
+            for (uint16_t j = 0; j < program.size(); ++j) {
+                lane.m_memory.write(RESET_PC + j, program[j]);
+            }
+            lane.m_pc = RESET_PC;
+        }
+        auto results = lockstep.run();
+
+        for (size_t i = 0; i < laneCount; ++i) {
+            std::istringstream input(inputFor(i));
+            std::ostringstream output;
+            CPU reference(Engine::SWITCH);
+            reference.setConsole(input, output);
+            for (uint16_t j = 0; j < program.size(); ++j) {
+                reference.m_memory.write(RESET_PC + j, program[j]);
+            }
+            reference.m_pc = RESET_PC;
+            auto expected = reference.run();
+
+            ASSERT_EQ(results[i].reason, StopReason::HALT);
+            ASSERT_EQ(results[i].instructionsRetired,
+                      expected.instructionsRetired);
+            ASSERT_EQ(lockstep.lane(i).m_registers, reference.m_registers);
+            ASSERT_EQ(outputs[i].str(), output.str());
+        }
+
+        // no divergence at all, with a budget that ends inside the loop
+        auto hotLoop = hotLoopProgram();
+        Lockstep sameInput(8, engine);
+        for (size_t i = 0; i < sameInput.laneCount(); ++i) {
+            auto& lane = sameInput.lane(i);
+            for (uint16_t j = 0; j < hotLoop.size(); ++j) {
+                lane.m_memory.write(RESET_PC + j, hotLoop[j]);
+            }
+            lane.m_pc = RESET_PC;
+        }
+        CPU reference(Engine::SWITCH);
+        for (uint16_t j = 0; j < hotLoop.size(); ++j) {
+            reference.m_memory.write(RESET_PC + j, hotLoop[j]);
+        }
+        reference.m_pc = RESET_PC;
+        auto expected = reference.run(1000);
+        for (const auto& result : sameInput.run(1000)) {
+            ASSERT_EQ(result.reason, StopReason::BUDGET_EXHAUSTED);
+            ASSERT_EQ(result.instructionsRetired, 1000);
+            ASSERT_EQ(result.finalPc, expected.finalPc);
+        }
+        ASSERT_EQ(sameInput.lane(7).m_registers, reference.m_registers);
+    }
+
   protected:
     CPU cpu;
 };
@@ -359,6 +1590,140 @@ TEST_F(CPUTests, STI) { testStiInstruction(); }
 
 TEST_F(CPUTests, STR) { testStrInstruction(); }
 
+TEST_F(CPUTests, BranchVariants) { testBranchVariants(); }
+
+TEST_F(CPUTests, HandlerVariants) { testHandlerVariants(); }
+
+TEST_F(CPUTests, LazyConditionalCodes) { testLazyConditionalCodes(); }
+
+TEST_F(CPUTests, SwitchEngine) { testEngine(Engine::SWITCH); }
+
+TEST_F(CPUTests, ThreadedEngine) { testEngine(Engine::THREADED); }
+
+TEST_F(CPUTests, BlockEngine) { testEngine(Engine::BLOCK); }
+
+TEST_F(CPUTests, SelfModifyingCodeInvalidatesBlock)
+{
+    testSelfModifyingCodeInvalidatesBlock();
+}
+
+TEST_F(CPUTests, BlockFusion) { testBlockFusion(); }
+
+TEST_F(CPUTests, SelfModifyingCodeAcrossSlices)
+{
+    testSelfModifyingCodeAcrossSlices(Engine::BLOCK);
+    testSelfModifyingCodeAcrossSlices(Engine::JIT);
+}
+
+TEST_F(CPUTests, JitEngine) { testEngine(Engine::JIT); }
+
+TEST_F(CPUTests, EnginesAgreeOnHotLoop)
+{
+    for (auto engine : {Engine::THREADED, Engine::BLOCK, Engine::JIT}) {
+        testEnginesAgreeOnHotLoop(engine);
+    }
+}
+
+TEST_F(CPUTests, DecodedInstructionIsInvalidatedOnWrite)
+{
+    testDecodedInstructionIsInvalidatedOnWrite();
+}
+
+TEST_F(CPUTests, FaultsAreReturned)
+{
+    for (auto engine :
+         {Engine::SWITCH, Engine::THREADED, Engine::BLOCK, Engine::JIT}) {
+        testFaultsAreReturned(engine);
+    }
+}
+
+TEST_F(CPUTests, MemoryAttributes)
+{
+    for (auto engine :
+         {Engine::SWITCH, Engine::THREADED, Engine::BLOCK, Engine::JIT}) {
+        testMemoryAttributes(engine);
+    }
+}
+
+TEST_F(CPUTests, InstructionBudget)
+{
+    for (auto engine :
+         {Engine::SWITCH, Engine::THREADED, Engine::BLOCK, Engine::JIT}) {
+        testInstructionBudget(engine);
+    }
+}
+
+TEST_F(CPUTests, SnapshotReset)
+{
+    for (auto engine :
+         {Engine::SWITCH, Engine::THREADED, Engine::BLOCK, Engine::JIT}) {
+        testSnapshotReset(engine);
+    }
+}
+
+TEST_F(CPUTests, IoDevices) { testIoDevices(); }
+
+TEST_F(CPUTests, SnapshotFile) { testSnapshotFile(); }
+
+TEST_F(CPUTests, LoadImages) { testLoadImages(); }
+
+TEST_F(CPUTests, Console) { testConsole(); }
+
+TEST_F(CPUTests, IdleSpin)
+{
+    for (auto engine :
+         {Engine::SWITCH, Engine::THREADED, Engine::BLOCK, Engine::JIT}) {
+        testIdleSpin(engine);
+    }
+}
+
+TEST_F(CPUTests, OsTraps)
+{
+    for (auto engine :
+         {Engine::SWITCH, Engine::THREADED, Engine::BLOCK, Engine::JIT}) {
+        testOsTraps(engine);
+    }
+}
+
+TEST_F(CPUTests, Interrupts)
+{
+    for (auto engine :
+         {Engine::SWITCH, Engine::THREADED, Engine::BLOCK, Engine::JIT}) {
+        testInterrupts(engine);
+    }
+}
+
+TEST_F(CPUTests, CycleCounter)
+{
+    for (auto engine :
+         {Engine::SWITCH, Engine::THREADED, Engine::BLOCK, Engine::JIT}) {
+        testCycleCounter(engine);
+    }
+}
+
+TEST_F(CPUTests, Lockstep)
+{
+    for (auto engine : {Engine::SWITCH, Engine::JIT}) {
+        testLockstep(engine);
+    }
+}
+
+TEST_F(CPUTests, Profiler)
+{
+    for (auto engine : {Engine::SWITCH, Engine::JIT}) {
+        testProfiler(engine);
+    }
+}
+
+TEST_F(CPUTests, Trace)
+{
+    for (auto engine : {Engine::SWITCH, Engine::JIT}) {
+        testTrace(engine);
+    }
+}
+
+TEST_F(CPUTests, InputLog) { testInputLog(); }
+
 int main(int argc, char* argv[])
 {
     ::testing::InitGoogleTest(&argc, argv);
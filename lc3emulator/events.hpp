@@ -0,0 +1,58 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <limits>
+
+// Deadlines of the few things that happen at a point in time, counted in
+// retired instructions. CPU::run() cuts its budget into slices that end at
+// the next deadline, so the engines' budget check is the only check there
+// is and nothing is polled per instruction.
+class EventScheduler {
+  public:
+    enum class Event : uint8_t {
+        // the timer's interval elapses
+        TIMER,
+        // look for a key while the keyboard interrupt is enabled
+        KEYBOARD_POLL,
+        // input is due to arrive, see InputLog
+        INPUT,
+        COUNT,
+    };
+    static constexpr uint64_t NEVER = std::numeric_limits<uint64_t>::max();
+
+  public:
+    EventScheduler() { clear(); }
+
+    void schedule(Event event, uint64_t time) { deadline(event) = time; }
+    void cancel(Event event) { deadline(event) = NEVER; }
+    void clear() { m_deadlines.fill(NEVER); }
+    bool isScheduled(Event event) const
+    {
+        return m_deadlines[static_cast<size_t>(event)] != NEVER;
+    }
+    uint64_t next() const
+    {
+        return *std::min_element(m_deadlines.begin(), m_deadlines.end());
+    }
+
+    // true once `event` is due at `now`, it is unscheduled then
+    bool takeDue(Event event, uint64_t now)
+    {
+        if (deadline(event) > now) {
+            return false;
+        }
+        cancel(event);
+        return true;
+    }
+
+  private:
+    uint64_t& deadline(Event event)
+    {
+        return m_deadlines[static_cast<size_t>(event)];
+    }
+
+  private:
+    std::array<uint64_t, static_cast<size_t>(Event::COUNT)> m_deadlines;
+};
@@ -0,0 +1,718 @@
+#include "jit.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+#if LC3_JIT_AVAILABLE
+#include <sys/mman.h>
+#endif
+
+namespace {
+enum HostRegister : uint8_t {
+    RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+    R8 = 8, R9 = 9, R10 = 10, R11 = 11, R12 = 12, R13 = 13, R14 = 14, R15 = 15
+};
+
+// rdi: Jit::State*, rsi: memory words, rdx: decoded instructions,
+// rbp: memory attributes, r8w-r15w: R0-R7, bx: condition value,
+// rax/rcx: scratch
+HostRegister hostRegister(uint8_t lc3Register)
+{
+    return static_cast<HostRegister>(R8 + lc3Register);
+}
+
+enum Condition : uint8_t {
+    BELOW = 0x2,
+    EQUAL = 0x4,
+    NOT_EQUAL = 0x5,
+    SIGN = 0x8,
+    NOT_SIGN = 0x9,
+    LESS_OR_EQUAL = 0xE,
+    GREATER = 0xF,
+};
+
+constexpr uint8_t STATE_REGISTERS = offsetof(Jit::State, registers);
+constexpr uint8_t STATE_PC = offsetof(Jit::State, pc);
+constexpr uint8_t STATE_CONDITION_VALUE = offsetof(Jit::State, conditionValue);
+constexpr uint8_t STATE_EXIT_REASON = offsetof(Jit::State, exitReason);
+constexpr uint8_t STATE_MEMORY = offsetof(Jit::State, memory);
+constexpr uint8_t STATE_DECODED = offsetof(Jit::State, decodedInstructions);
+constexpr uint8_t STATE_ATTRIBUTES = offsetof(Jit::State, attributes);
+constexpr uint8_t STATE_BUDGET = offsetof(Jit::State, budget);
+constexpr uint8_t STATE_CYCLES = offsetof(Jit::State, cycles);
+constexpr uint8_t DECODED_HANDLER = offsetof(DecodedInstruction, handler);
+static_assert(static_cast<uint8_t>(Handler::UNDECODED) == 0);
+static_assert(sizeof(DecodedInstruction) == 8,
+              "generated code indexes decoded instructions with scale 8");
+
+// Just the handful of x86-64 encodings the translator needs.
+class Emitter {
+  public:
+    Emitter(uint8_t* at) : m_at(at) {}
+
+    uint8_t* here() const { return m_at; }
+
+    void byte(uint8_t value) { *m_at++ = value; }
+
+    void word(uint16_t value)
+    {
+        std::memcpy(m_at, &value, sizeof value);
+        m_at += sizeof value;
+    }
+
+    void dword(uint32_t value)
+    {
+        std::memcpy(m_at, &value, sizeof value);
+        m_at += sizeof value;
+    }
+
+    static void patchRel32(uint8_t* field, const uint8_t* target)
+    {
+        int32_t rel = static_cast<int32_t>(target - (field + 4));
+        std::memcpy(field, &rel, sizeof rel);
+    }
+
+    void push(HostRegister reg)
+    {
+        rex(false, 0, reg);
+        byte(0x50 + (reg & 7));
+    }
+
+    void pop(HostRegister reg)
+    {
+        rex(false, 0, reg);
+        byte(0x58 + (reg & 7));
+    }
+
+    void ret() { byte(0xC3); }
+
+    // mov dst, src (64-bit)
+    void mov64(HostRegister dst, HostRegister src)
+    {
+        byte(0x48 | ((src >> 3) << 2) | (dst >> 3));
+        byte(0x89);
+        modrm(3, src, dst);
+    }
+
+    void jmpRegister(HostRegister reg)
+    {
+        rex(false, 0, reg);
+        byte(0xFF);
+        modrm(3, 4, reg);
+    }
+
+    // mov dst, qword [rdi + disp]
+    void loadStatePointer(HostRegister dst, uint8_t disp)
+    {
+        byte(0x48 | ((dst >> 3) << 2));
+        byte(0x8B);
+        modrm(1, dst, RDI);
+        byte(disp);
+    }
+
+    // movzx dst32, word [rdi + disp]
+    void loadStateWord(HostRegister dst, uint8_t disp)
+    {
+        rex(false, dst, RDI);
+        byte(0x0F);
+        byte(0xB7);
+        modrm(1, dst, RDI);
+        byte(disp);
+    }
+
+    // mov word [rdi + disp], src16
+    void storeStateWord(uint8_t disp, HostRegister src)
+    {
+        byte(0x66);
+        rex(false, src, RDI);
+        byte(0x89);
+        modrm(1, src, RDI);
+        byte(disp);
+    }
+
+    // mov word [rdi + disp], imm16
+    void storeStateImmediateWord(uint8_t disp, uint16_t value)
+    {
+        byte(0x66);
+        byte(0xC7);
+        modrm(1, 0, RDI);
+        byte(disp);
+        word(value);
+    }
+
+    // sub qword [rdi + disp], imm32, returns the imm32 field to patch
+    uint8_t* subStateImmediate64(uint8_t disp, uint32_t value)
+    {
+        byte(0x48);
+        byte(0x81);
+        modrm(1, 5, RDI);
+        byte(disp);
+        uint8_t* field = m_at;
+        dword(value);
+        return field;
+    }
+
+    // add qword [rdi + disp], imm32, returns the imm32 field to patch
+    uint8_t* addStateImmediate64(uint8_t disp, uint32_t value)
+    {
+        byte(0x48);
+        byte(0x81);
+        modrm(1, 0, RDI);
+        byte(disp);
+        uint8_t* field = m_at;
+        dword(value);
+        return field;
+    }
+
+    // mov byte [rdi + disp], imm8
+    void storeStateImmediateByte(uint8_t disp, uint8_t value)
+    {
+        byte(0xC6);
+        modrm(1, 0, RDI);
+        byte(disp);
+        byte(value);
+    }
+
+    // movzx dst32, src16
+    void movzx(HostRegister dst, HostRegister src)
+    {
+        rex(false, dst, src);
+        byte(0x0F);
+        byte(0xB7);
+        modrm(3, dst, src);
+    }
+
+    // <op> dst16, src16 for mov (0x89), add (0x01), and (0x21), test (0x85)
+    void op16(uint8_t opCode, HostRegister dst, HostRegister src)
+    {
+        byte(0x66);
+        rex(false, src, dst);
+        byte(opCode);
+        modrm(3, src, dst);
+    }
+
+    void mov16(HostRegister dst, HostRegister src)
+    {
+        if (dst != src) {
+            op16(0x89, dst, src);
+        }
+    }
+
+    // <op> dst16, imm16 for add (/0) and and (/4)
+    void op16Immediate(uint8_t extension, HostRegister dst, uint16_t value)
+    {
+        byte(0x66);
+        rex(false, 0, dst);
+        byte(0x81);
+        modrm(3, extension, dst);
+        word(value);
+    }
+
+    void not16(HostRegister dst)
+    {
+        byte(0x66);
+        rex(false, 0, dst);
+        byte(0xF7);
+        modrm(3, 2, dst);
+    }
+
+    void movImmediate16(HostRegister dst, uint16_t value)
+    {
+        byte(0x66);
+        rex(false, 0, dst);
+        byte(0xB8 + (dst & 7));
+        word(value);
+    }
+
+    // mov eax, imm32
+    void movEaxImmediate(uint32_t value)
+    {
+        byte(0xB8);
+        dword(value);
+    }
+
+    void addAxImmediate(uint16_t value)
+    {
+        byte(0x66);
+        byte(0x05);
+        word(value);
+    }
+
+    // movzx dst32, word [rsi + rax * 2]
+    void loadMemoryWord(HostRegister dst)
+    {
+        rex(false, dst, 0);
+        byte(0x0F);
+        byte(0xB7);
+        modrm(0, dst, 4);
+        byte(0x46);
+    }
+
+    // mov word [rsi + rax * 2], src16
+    void storeMemoryWord(HostRegister src)
+    {
+        byte(0x66);
+        rex(false, src, 0);
+        byte(0x89);
+        modrm(0, src, 4);
+        byte(0x46);
+    }
+
+    // cmp byte [rdx + rax * 8 + handler], UNDECODED
+    void cmpDecodedHandler()
+    {
+        byte(0x80);
+        modrm(1, 7, 4);
+        byte(0xC2);
+        byte(DECODED_HANDLER);
+        byte(0);
+    }
+
+    // test byte [rbp + rax], mask
+    void testAttributes(uint8_t mask)
+    {
+        byte(0xF6);
+        modrm(1, 0, 4);
+        byte(0x05);
+        byte(0);
+        byte(mask);
+    }
+
+    // returns the rel32 field to patch
+    uint8_t* jcc(Condition condition)
+    {
+        byte(0x0F);
+        byte(0x80 | condition);
+        uint8_t* field = m_at;
+        dword(0);
+        return field;
+    }
+
+    uint8_t* jmp()
+    {
+        byte(0xE9);
+        uint8_t* field = m_at;
+        dword(0);
+        return field;
+    }
+
+    void jmp(const uint8_t* target) { patchRel32(jmp(), target); }
+
+  private:
+    void rex(bool wide, uint8_t reg, uint8_t rm)
+    {
+        uint8_t prefix = 0x40 | (wide << 3) | ((reg >> 3) << 2) | (rm >> 3);
+        if (prefix != 0x40) {
+            byte(prefix);
+        }
+    }
+
+    void modrm(uint8_t mod, uint8_t reg, uint8_t rm)
+    {
+        byte((mod << 6) | ((reg & 7) << 3) | (rm & 7));
+    }
+
+  private:
+    uint8_t* m_at;
+};
+
+bool isFlagSetting(InstructionOpCode opCode)
+{
+    switch (opCode) {
+    case InstructionOpCode::ADD:
+    case InstructionOpCode::AND:
+    case InstructionOpCode::NOT:
+    case InstructionOpCode::LD:
+    case InstructionOpCode::LDI:
+    case InstructionOpCode::LDR:
+    case InstructionOpCode::LEA:
+        return true;
+    default:
+        return false;
+    }
+}
+} // namespace
+
+#if LC3_JIT_AVAILABLE
+
+Jit::Jit()
+    : m_code(nullptr), m_codeSize(0), m_blocksStart(0), m_entry(nullptr),
+      m_exit(nullptr),
+      m_blocks(std::numeric_limits<uint16_t>::max() + 1),
+      m_hotness(std::numeric_limits<uint16_t>::max() + 1),
+      m_covered(std::numeric_limits<uint16_t>::max() + 1)
+{
+    void* code = mmap(nullptr, CODE_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        // no executable memory, CPU keeps interpreting
+        return;
+    }
+    m_code = static_cast<uint8_t*>(code);
+
+    // void entry(State* state, void* block)
+    Emitter emitter(m_code);
+    m_entry = emitter.here();
+    for (auto reg : {RBX, RBP, R12, R13, R14, R15}) {
+        emitter.push(reg);
+    }
+    emitter.mov64(RAX, RSI);
+    emitter.loadStatePointer(RSI, STATE_MEMORY);
+    emitter.loadStatePointer(RDX, STATE_DECODED);
+    emitter.loadStatePointer(RBP, STATE_ATTRIBUTES);
+    for (uint8_t i = 0; i < 8; ++i) {
+        emitter.loadStateWord(hostRegister(i), STATE_REGISTERS + 2 * i);
+    }
+    emitter.loadStateWord(RBX, STATE_CONDITION_VALUE);
+    emitter.jmpRegister(RAX);
+
+    // every exit stub jumps here
+    m_exit = emitter.here();
+    for (uint8_t i = 0; i < 8; ++i) {
+        emitter.storeStateWord(STATE_REGISTERS + 2 * i, hostRegister(i));
+    }
+    emitter.storeStateWord(STATE_CONDITION_VALUE, RBX);
+    for (auto reg : {R15, R14, R13, R12, RBP, RBX}) {
+        emitter.pop(reg);
+    }
+    emitter.ret();
+    m_blocksStart = emitter.here() - m_code;
+    m_codeSize = m_blocksStart;
+    if (!setWritable(false)) {
+        munmap(m_code, CODE_BUFFER_SIZE);
+        m_code = nullptr;
+    }
+}
+
+Jit::~Jit()
+{
+    if (m_code) {
+        munmap(m_code, CODE_BUFFER_SIZE);
+    }
+}
+
+bool Jit::setWritable(bool isWritable)
+{
+    int protection = PROT_READ | (isWritable ? PROT_WRITE : PROT_EXEC);
+    return mprotect(m_code, CODE_BUFFER_SIZE, protection) == 0;
+}
+
+#else
+
+Jit::Jit()
+    : m_code(nullptr), m_codeSize(0), m_blocksStart(0), m_entry(nullptr),
+      m_exit(nullptr),
+      m_blocks(std::numeric_limits<uint16_t>::max() + 1)
+{
+}
+
+Jit::~Jit() {}
+
+bool Jit::setWritable(bool) { return false; }
+
+#endif
+
+bool Jit::isHot(uint16_t pc)
+{
+    if (m_hotness.empty() || m_hotness[pc] > HOT_BLOCK_THRESHOLD) {
+        return false;
+    }
+    return ++m_hotness[pc] > HOT_BLOCK_THRESHOLD;
+}
+
+void Jit::flush()
+{
+    std::fill(m_blocks.begin(), m_blocks.end(), nullptr);
+    std::fill(m_hotness.begin(), m_hotness.end(), 0);
+    std::fill(m_covered.begin(), m_covered.end(), false);
+    m_pendingLinks.clear();
+    m_codeSize = m_blocksStart;
+}
+
+void Jit::invalidate(uint16_t address)
+{
+    if (!m_covered.empty() && m_covered[address]) {
+        flush();
+    }
+}
+
+void Jit::run(Memory& memory, State& state, void* block)
+{
+    state.memory = memory.m_memory.data();
+    state.decodedInstructions = memory.m_decodedInstructions.data();
+    state.attributes = memory.m_attributes.data();
+    reinterpret_cast<void (*)(State*, void*)>(m_entry)(&state, block);
+}
+
+void* Jit::compile(Memory& memory, uint16_t start, const CycleTable& cycles)
+{
+    // system space code is only ever interpreted, see Memory::fetchPrivileged
+    if (!isAvailable() || !memory.canFetch(start)) {
+        return nullptr;
+    }
+    if (CODE_BUFFER_SIZE - m_codeSize < MAX_BLOCK_CODE_SIZE) {
+        flush();
+    }
+    if (!setWritable(true)) {
+        return nullptr;
+    }
+    void* blockCode = translate(memory, start, cycles);
+    if (!setWritable(false)) {
+        // can't run any of it, CPU keeps interpreting
+        flush();
+        munmap(m_code, CODE_BUFFER_SIZE);
+        m_code = nullptr;
+        return nullptr;
+    }
+    return blockCode;
+}
+
+void* Jit::translate(Memory& memory, uint16_t start, const CycleTable& cycles)
+{
+    uint8_t* epilogue = m_exit;
+    Emitter emitter(m_code + m_codeSize);
+    uint8_t* blockCode = emitter.here();
+
+    // the block's length isn't known yet, it's patched in at the end
+    uint8_t* blockLengthField = emitter.subStateImmediate64(STATE_BUDGET, 0);
+    uint8_t* budgetExit = emitter.jcc(BELOW);
+    // and its cycles, also patched in at the end
+    uint8_t* blockCyclesField = emitter.addStateImmediate64(STATE_CYCLES, 0);
+
+    struct SlowPath {
+        uint8_t* jump;
+        uint16_t pc;
+    };
+    std::vector<SlowPath> slowPaths;
+    std::vector<std::pair<uint8_t*, uint16_t>> exits;
+
+    auto exitTo = [&](uint16_t target) {
+        if (m_blocks[target]) {
+            emitter.jmp(static_cast<uint8_t*>(m_blocks[target]));
+            return;
+        }
+        exits.push_back({emitter.here(), target});
+        emitter.storeStateImmediateWord(STATE_PC, target);
+        emitter.storeStateImmediateByte(
+            STATE_EXIT_REASON, static_cast<uint8_t>(ExitReason::CONTINUE));
+        emitter.jmp(epilogue);
+    };
+    auto exitToRegister = [&](HostRegister reg) {
+        emitter.storeStateWord(STATE_PC, reg);
+        emitter.storeStateImmediateByte(
+            STATE_EXIT_REASON, static_cast<uint8_t>(ExitReason::CONTINUE));
+        emitter.jmp(epilogue);
+    };
+    // address in eax, leaves the word in eax
+    auto checkedLoad = [&](uint16_t pc) {
+        emitter.testAttributes(Memory::READ_CHECKED);
+        slowPaths.push_back({emitter.jcc(NOT_EQUAL), pc});
+        emitter.loadMemoryWord(RAX);
+    };
+    // address in eax
+    auto checkedStore = [&](uint16_t pc, HostRegister src) {
+        emitter.testAttributes(Memory::WRITE_CHECKED);
+        slowPaths.push_back({emitter.jcc(NOT_EQUAL), pc});
+        // decoded words may be cached code, Memory::write takes care of them
+        emitter.cmpDecodedHandler();
+        slowPaths.push_back({emitter.jcc(NOT_EQUAL), pc});
+        emitter.storeMemoryWord(src);
+    };
+
+    uint16_t pc = start;
+    uint16_t compiled = 0;
+    // of every compiled instruction, in order
+    std::vector<uint32_t> instructionCycles;
+    bool isBlockClosed = false;
+    bool endsInInterpreter = false;
+    while (!isBlockClosed && compiled < MAX_BLOCK_INSTRUCTIONS &&
+           memory.canFetch(pc)) {
+        auto instruction = memory.fetch(pc);
+        uint16_t nextPc = pc + 1;
+        instructionCycles.push_back(
+            cycles[static_cast<uint8_t>(instruction.handler)]);
+        auto destination = hostRegister(instruction.destinationRegister);
+        auto source = hostRegister(instruction.sourceRegister);
+        auto secondSource = hostRegister(instruction.secondSourceRegister);
+
+        switch (instruction.opCode) {
+        case InstructionOpCode::ADD:
+        case InstructionOpCode::AND: {
+            uint8_t opCode =
+                instruction.opCode == InstructionOpCode::ADD ? 0x01 : 0x21;
+            uint8_t extension =
+                instruction.opCode == InstructionOpCode::ADD ? 0 : 4;
+            if (instruction.isImmediate) {
+                emitter.mov16(destination, source);
+                emitter.op16Immediate(extension, destination,
+                                      instruction.immediateValue);
+            }
+            else if (destination == secondSource) {
+                emitter.op16(opCode, destination, source);
+            }
+            else {
+                emitter.mov16(destination, source);
+                emitter.op16(opCode, destination, secondSource);
+            }
+            break;
+        }
+        case InstructionOpCode::NOT:
+            emitter.mov16(destination, source);
+            emitter.not16(destination);
+            break;
+        case InstructionOpCode::LEA:
+            emitter.movImmediate16(destination,
+                                   nextPc + instruction.immediateValue);
+            break;
+        case InstructionOpCode::LD:
+            emitter.movEaxImmediate(
+                static_cast<uint16_t>(nextPc + instruction.immediateValue));
+            checkedLoad(pc);
+            emitter.mov16(destination, RAX);
+            break;
+        case InstructionOpCode::LDI:
+            emitter.movEaxImmediate(
+                static_cast<uint16_t>(nextPc + instruction.immediateValue));
+            checkedLoad(pc);
+            checkedLoad(pc);
+            emitter.mov16(destination, RAX);
+            break;
+        case InstructionOpCode::LDR:
+            emitter.movzx(RAX, source);
+            emitter.addAxImmediate(instruction.immediateValue);
+            checkedLoad(pc);
+            emitter.mov16(destination, RAX);
+            break;
+        case InstructionOpCode::ST:
+            emitter.movEaxImmediate(
+                static_cast<uint16_t>(nextPc + instruction.immediateValue));
+            checkedStore(pc, destination);
+            break;
+        case InstructionOpCode::STI:
+            emitter.movEaxImmediate(
+                static_cast<uint16_t>(nextPc + instruction.immediateValue));
+            checkedLoad(pc);
+            checkedStore(pc, destination);
+            break;
+        case InstructionOpCode::STR:
+            emitter.movzx(RAX, source);
+            emitter.addAxImmediate(instruction.immediateValue);
+            checkedStore(pc, destination);
+            break;
+        case InstructionOpCode::BR: {
+            uint16_t target = nextPc + instruction.immediateValue;
+            static constexpr Condition conditions[] = {
+                // -, p, z, zp, n, np, nz
+                EQUAL, GREATER, EQUAL, NOT_SIGN, SIGN, NOT_EQUAL,
+                LESS_OR_EQUAL};
+            uint8_t mask = instruction.destinationRegister;
+            if (mask == 0 || mask == 0b111) {
+                exitTo(target);
+            }
+            else {
+                emitter.op16(0x85, RBX, RBX);
+                uint8_t* taken = emitter.jcc(conditions[mask]);
+                exitTo(nextPc);
+                Emitter::patchRel32(taken, emitter.here());
+                exitTo(target);
+            }
+            isBlockClosed = true;
+            break;
+        }
+        case InstructionOpCode::JMP_RET:
+            exitToRegister(source);
+            isBlockClosed = true;
+            break;
+        case InstructionOpCode::JSR_JSRR:
+            emitter.movImmediate16(hostRegister(R7), nextPc);
+            if (instruction.isImmediate) {
+                exitTo(nextPc + instruction.immediateValue);
+            }
+            else {
+                exitToRegister(source);
+            }
+            isBlockClosed = true;
+            break;
+        default:
+            // TRAP, RTI and illegal opcodes
+            if (compiled == 0) {
+                return nullptr;
+            }
+            emitter.storeStateImmediateWord(STATE_PC, pc);
+            emitter.storeStateImmediateByte(
+                STATE_EXIT_REASON,
+                static_cast<uint8_t>(ExitReason::INTERPRET));
+            emitter.jmp(epilogue);
+            isBlockClosed = true;
+            endsInInterpreter = true;
+            break;
+        }
+
+        if (isFlagSetting(instruction.opCode)) {
+            emitter.movzx(RBX, destination);
+        }
+        if (!isBlockClosed) {
+            pc = nextPc;
+        }
+        compiled++;
+    }
+    if (!isBlockClosed) {
+        exitTo(pc);
+    }
+
+    uint32_t blockLength = compiled - endsInInterpreter;
+    std::memcpy(blockLengthField, &blockLength, sizeof blockLength);
+    // cycles from the i-th instruction to the end of what the block charges
+    std::vector<uint32_t> cyclesFrom(blockLength + 1, 0);
+    for (size_t i = blockLength; i-- > 0;) {
+        cyclesFrom[i] = cyclesFrom[i + 1] + instructionCycles[i];
+    }
+    std::memcpy(blockCyclesField, &cyclesFrom[0], sizeof cyclesFrom[0]);
+    Emitter::patchRel32(budgetExit, emitter.here());
+    emitter.addStateImmediate64(STATE_BUDGET, blockLength);
+    emitter.storeStateImmediateWord(STATE_PC, start);
+    emitter.storeStateImmediateByte(STATE_EXIT_REASON,
+                                    static_cast<uint8_t>(ExitReason::BUDGET));
+    emitter.jmp(epilogue);
+
+    for (auto [jump, slowPathPc] : slowPaths) {
+        Emitter::patchRel32(jump, emitter.here());
+        // the interpreter runs this instruction and charges it itself
+        emitter.addStateImmediate64(
+            STATE_BUDGET, blockLength - uint16_t(slowPathPc - start));
+        emitter.subStateImmediate64(STATE_CYCLES,
+                                    cyclesFrom[uint16_t(slowPathPc - start)]);
+        emitter.storeStateImmediateWord(STATE_PC, slowPathPc);
+        emitter.storeStateImmediateByte(
+            STATE_EXIT_REASON, static_cast<uint8_t>(ExitReason::INTERPRET));
+        emitter.jmp(epilogue);
+    }
+
+    m_codeSize = emitter.here() - m_code;
+    m_blocks[start] = blockCode;
+    for (uint32_t address = start; address <= pc; ++address) {
+        m_covered[address] = true;
+    }
+    memory.markTranslated(start, uint32_t(pc) + 1);
+
+    // link the new block into everything that was waiting for it
+    for (auto it = m_pendingLinks.begin(); it != m_pendingLinks.end();) {
+        if (it->target == start) {
+            Emitter(it->stub).jmp(blockCode);
+            it = m_pendingLinks.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+    for (auto [stub, target] : exits) {
+        if (m_blocks[target]) {
+            Emitter(stub).jmp(static_cast<uint8_t*>(m_blocks[target]));
+        }
+        else {
+            m_pendingLinks.push_back({target, stub});
+        }
+    }
+    return blockCode;
+}
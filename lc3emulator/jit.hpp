@@ -0,0 +1,100 @@
+#pragma once
+
+#include "cycles.hpp"
+#include "lc3memory.hpp"
+
+#include <cstddef>
+#include <vector>
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define LC3_JIT_AVAILABLE 1
+#else
+#define LC3_JIT_AVAILABLE 0
+#endif
+
+// Translates hot LC-3 basic blocks into x86-64 code. R0-R7 live in
+// r8w-r15w while native code runs and the value the condition codes were
+// computed from lives in bx. Blocks jump straight into each other when the
+// target is known, anything the native code can't handle (TRAP, RTI,
+// accesses to words with memory attributes, writes to code) makes it return
+// with ExitReason::INTERPRET so the interpreter runs that one instruction.
+// The code buffer is never writable and executable at once, it's only
+// made writable while compile() emits into it.
+class Jit {
+  public:
+    enum class ExitReason : uint8_t {
+        // state.pc is the next instruction to run
+        CONTINUE,
+        // the instruction at state.pc has to be interpreted
+        INTERPRET,
+        // the block at state.pc is longer than what is left of the budget
+        BUDGET,
+    };
+
+    // Layout is shared with the generated code, see the offsets in jit.cpp.
+    struct State {
+        uint16_t registers[8];
+        uint16_t pc;
+        // see CPU::m_conditionValue
+        uint16_t conditionValue;
+        ExitReason exitReason;
+        uint16_t* memory;
+        DecodedInstruction* decodedInstructions;
+        uint8_t* attributes;
+        // instructions left to run, every block charges its length on
+        // entry and refunds what it didn't run when it exits early
+        uint64_t budget;
+        // CPU::cycleCount(), charged and refunded the same way
+        uint64_t cycles;
+    };
+
+    static constexpr uint8_t HOT_BLOCK_THRESHOLD = 16;
+    static constexpr uint16_t MAX_BLOCK_INSTRUCTIONS = 32;
+
+  public:
+    Jit();
+    ~Jit();
+    Jit(const Jit&) = delete;
+    Jit& operator=(const Jit&) = delete;
+
+    bool isAvailable() const { return m_code != nullptr; }
+    // native code of the block starting at `pc`, nullptr if not compiled
+    void* find(uint16_t pc) const { return m_blocks[pc]; }
+    // true exactly once, when the block at `pc` becomes hot
+    bool isHot(uint16_t pc);
+    // nullptr if the block doesn't start with anything compilable, the
+    // block's cycle count comes from `cycles`
+    void* compile(Memory& memory, uint16_t pc, const CycleTable& cycles);
+    void run(Memory& memory, State& state, void* block);
+    // drops all native code if `address` is part of a compiled block
+    void invalidate(uint16_t address);
+    void flush();
+
+  private:
+    static constexpr size_t CODE_BUFFER_SIZE = 4 * 1024 * 1024;
+    // more than the largest block we can generate
+    static constexpr size_t MAX_BLOCK_CODE_SIZE = 8192;
+
+    struct PendingLink {
+        uint16_t target;
+        uint8_t* stub;
+    };
+
+    // compile() with the buffer writable
+    void* translate(Memory& memory, uint16_t pc, const CycleTable& cycles);
+    // read and write, or read and execute, false if that failed
+    bool setWritable(bool isWritable);
+
+    uint8_t* m_code;
+    size_t m_codeSize;
+    // first byte after the entry/exit trampolines
+    size_t m_blocksStart;
+    void* m_entry;
+    uint8_t* m_exit;
+    std::vector<void*> m_blocks;
+    std::vector<uint8_t> m_hotness;
+    std::vector<bool> m_covered;
+    // exits to blocks that weren't compiled yet, patched into direct
+    // jumps once they are
+    std::vector<PendingLink> m_pendingLinks;
+};
@@ -1,104 +1,682 @@
 #pragma once
 
+#include "console.hpp"
+#include "decoder.hpp"
+
+#include <algorithm>
 #include <array>
 #include <assert.h>
 
 #include <cstdint>
+#include <cstring>
 #include <fmt/core.h>
-#include <signal.h>
-
-#ifdef WIN32
-#include <conio.h>
-#include <Windows.h>
-#undef max
-#endif
-
-namespace {
-// SOURCE:
-// https://github.com/justinmeiners/lc3-vm/blob/master/docs/src/lc3-win.c
-#ifdef WIN32
-HANDLE hStdin = INVALID_HANDLE_VALUE;
-DWORD fdwMode, fdwOldMode;
-#endif
-
-void disable_input_buffering()
-{
-    #ifdef WIN32
-    hStdin = GetStdHandle(STD_INPUT_HANDLE);
-    GetConsoleMode(hStdin, &fdwOldMode);     /* save old mode */
-    fdwMode = fdwOldMode ^ ENABLE_ECHO_INPUT /* no input echo */
-              ^ ENABLE_LINE_INPUT;           /* return when one or
-                                                more characters are available */
-    SetConsoleMode(hStdin, fdwMode);         /* set new mode */
-    FlushConsoleInputBuffer(hStdin);         /* clear buffer */
-    #endif
-}
-
-void restore_input_buffering() 
-{ 
-    #ifdef WIN32
-    SetConsoleMode(hStdin, fdwOldMode);
-    #endif 
-}
-
-uint16_t check_key()
-{
-    #ifdef WIN32
-    return WaitForSingleObject(hStdin, 1000) == WAIT_OBJECT_0 && _kbhit();
-    #else 
-    return 0;
-    #endif
-}
-
-void handle_interrupt(int signal)
-{
-    #ifdef WIN32
-    restore_input_buffering();
-    printf("\n");
-    exit(-2);
-    #endif
-}
-} // namespace
+#include <limits>
+#include <memory>
+#include <span>
+#include <utility>
+#include <vector>
+
+enum class MemoryFault : uint8_t {
+    NONE,
+    ILLEGAL_READ,
+    ILLEGAL_WRITE,
+    // a write cleared the clock enable bit of MachineControl
+    MACHINE_HALTED,
+    // the same with MachineControl::UNSUPPORTED_TRAP set
+    UNSUPPORTED_TRAP,
+    // a write changed when a device needs the CPU next (interrupts, the
+    // timer), the CPU looks at its events before going on
+    RESCHEDULE,
+};
+
+// Per-word flags, a word without any of them is plain RAM.
+enum MemoryAttribute : uint8_t {
+    RAM = 0,
+    // system space, reads, writes and fetches fault unless the memory is
+    // privileged (see setPrivileged)
+    PROTECTED = 1 << 0,
+    // writes fault
+    READ_ONLY = 1 << 1,
+    // reads and writes go to the MemoryMappedDevice mapped there
+    DEVICE = 1 << 2,
+    // fetching the word stops the emulator before it runs
+    BREAKPOINT = 1 << 3,
+    // covered by a translated block, writes are queued (see markTranslated)
+    TRANSLATED = 1 << 4,
+    // on a page that wasn't written since snapshot(), the first write to the
+    // page records it for restore()
+    CLEAN = 1 << 5,
+};
+
+class MemoryMappedDevice {
+  public:
+    virtual ~MemoryMappedDevice() = default;
+    virtual uint16_t read(uint16_t address) = 0;
+    virtual void write(uint16_t address, uint16_t value) = 0;
+    // registers kept in machine snapshot files (see CPU::saveSnapshot),
+    // loadState() gets exactly what saveState() returned
+    virtual std::vector<uint16_t> saveState() const { return {}; }
+    virtual void loadState(std::span<const uint16_t>) {}
+    // asked after every write, what the CPU has to do about it
+    virtual MemoryFault takeSignal() { return MemoryFault::NONE; }
+};
+
+// KBSR[15] is set while a key waits in KBDR, reading KBDR takes it. With
+// KBSR[14] set a waiting key requests the keyboard interrupt.
+class Keyboard : public MemoryMappedDevice {
+  public:
+    static constexpr uint16_t STATUS_REGISTER = 0xFE00;
+    static constexpr uint16_t DATA_REGISTER = 0xFE02;
+    static constexpr uint16_t READY = 1 << 15;
+    static constexpr uint16_t INTERRUPT_ENABLE = 1 << 14;
+    static constexpr uint8_t INTERRUPT_VECTOR = 0x80;
+    static constexpr uint8_t INTERRUPT_PRIORITY = 4;
+
+    // Keys come from `io`. Output still in `output` is flushed before
+    // polling, so a prompt is on screen before the program waits for a key.
+    void connect(IoDevice* io, OutputSink* output)
+    {
+        m_io = io;
+        m_output = output;
+    }
+
+    // moves the next key into KBDR unless one is already waiting there
+    bool poll()
+    {
+        if (!(m_status & READY) && m_io && m_io->hasInput()) {
+            m_status |= READY;
+            m_data = m_io->read();
+        }
+        return m_status & READY;
+    }
+
+    // the key waiting in KBDR or the next one, for GETC and IN
+    int takeInput()
+    {
+        if (m_status & READY) {
+            m_status &= ~READY;
+            return m_data;
+        }
+        return m_io->read();
+    }
+
+    bool isInterruptEnabled() const { return m_status & INTERRUPT_ENABLE; }
+    bool isInterruptRequested() const
+    {
+        return (m_status & (READY | INTERRUPT_ENABLE)) ==
+               (READY | INTERRUPT_ENABLE);
+    }
+
+    uint16_t read(uint16_t address) override
+    {
+        if (address == STATUS_REGISTER) {
+            if (m_output && !m_output->isEmpty()) {
+                m_output->flush();
+            }
+            poll();
+            return m_status;
+        }
+        m_status &= ~READY;
+        return m_data;
+    }
+
+    void write(uint16_t address, uint16_t value) override
+    {
+        if (address == STATUS_REGISTER) {
+            // only the interrupt enable bit is writable
+            m_status = (m_status & READY) | (value & INTERRUPT_ENABLE);
+            m_isChanged = true;
+        }
+        else {
+            m_data = value;
+        }
+    }
+
+    std::vector<uint16_t> saveState() const override
+    {
+        return {m_status, m_data};
+    }
+
+    void loadState(std::span<const uint16_t> state) override
+    {
+        m_status = state[0];
+        m_data = state[1];
+    }
+
+    MemoryFault takeSignal() override
+    {
+        return std::exchange(m_isChanged, false) ? MemoryFault::RESCHEDULE
+                                                 : MemoryFault::NONE;
+    }
+
+  private:
+    uint16_t m_status = 0;
+    uint16_t m_data = 0;
+    bool m_isChanged = false;
+    IoDevice* m_io = nullptr;
+    OutputSink* m_output = nullptr;
+};
+
+// Console output registers. The display never falls behind, so the status
+// register always reads as ready.
+class Display : public MemoryMappedDevice {
+  public:
+    static constexpr uint16_t STATUS_REGISTER = 0xFE04;
+    static constexpr uint16_t DATA_REGISTER = 0xFE06;
+
+    void connect(OutputSink* output) { m_output = output; }
+
+    uint16_t read(uint16_t address) override
+    {
+        return address == STATUS_REGISTER ? (1 << 15) : m_data;
+    }
+
+    void write(uint16_t address, uint16_t value) override
+    {
+        if (address == DATA_REGISTER) {
+            m_data = value;
+            if (m_output) {
+                m_output->put(static_cast<char>(value));
+            }
+        }
+    }
+
+  private:
+    uint16_t m_data = 0;
+    OutputSink* m_output = nullptr;
+};
+
+// Machine control register, clearing the clock enable bit halts the
+// machine. That is how the HALT routine of the built-in OS stops.
+class MachineControl : public MemoryMappedDevice {
+  public:
+    static constexpr uint16_t CONTROL_REGISTER = 0xFFFE;
+    static constexpr uint16_t CLOCK_ENABLE = 1 << 15;
+    // not part of the LC-3 spec: cleared together with CLOCK_ENABLE, the
+    // machine stops the way TRAP to a vector without a routine does
+    static constexpr uint16_t UNSUPPORTED_TRAP = 1 << 0;
+
+    uint16_t read(uint16_t) override { return m_control; }
+    void write(uint16_t, uint16_t value) override { m_control = value; }
+
+    MemoryFault takeSignal() override
+    {
+        if (m_control & CLOCK_ENABLE) {
+            return MemoryFault::NONE;
+        }
+        // stops after this instruction, the next run() goes on
+        bool isUnsupportedTrap = m_control & UNSUPPORTED_TRAP;
+        m_control = (m_control | CLOCK_ENABLE) & ~UNSUPPORTED_TRAP;
+        return isUnsupportedTrap ? MemoryFault::UNSUPPORTED_TRAP
+                                 : MemoryFault::MACHINE_HALTED;
+    }
+
+  private:
+    uint16_t m_control = CLOCK_ENABLE;
+};
+
+// Interval timer, not part of the LC-3 spec. Writing TMI (re)starts it,
+// every TMI instructions TMR[15] is set, and with TMR[14] set that
+// requests the timer interrupt. Taking the interrupt clears TMR[15].
+// A TMI of 0 stops the timer.
+class Timer : public MemoryMappedDevice {
+  public:
+    static constexpr uint16_t STATUS_REGISTER = 0xFE08;
+    static constexpr uint16_t INTERVAL_REGISTER = 0xFE0A;
+    static constexpr uint16_t READY = 1 << 15;
+    static constexpr uint16_t INTERRUPT_ENABLE = 1 << 14;
+    static constexpr uint8_t INTERRUPT_VECTOR = 0x81;
+    static constexpr uint8_t INTERRUPT_PRIORITY = 6;
+
+    uint16_t interval() const { return m_interval; }
+    void expire() { m_status |= READY; }
+    void acknowledge() { m_status &= ~READY; }
+    bool isInterruptRequested() const
+    {
+        return (m_status & (READY | INTERRUPT_ENABLE)) ==
+               (READY | INTERRUPT_ENABLE);
+    }
+    // whether the interval was set since the last call
+    bool takeRestart() { return std::exchange(m_isRestarted, false); }
+
+    uint16_t read(uint16_t address) override
+    {
+        return address == STATUS_REGISTER ? m_status : m_interval;
+    }
+
+    void write(uint16_t address, uint16_t value) override
+    {
+        if (address == STATUS_REGISTER) {
+            m_status = value & (READY | INTERRUPT_ENABLE);
+        }
+        else {
+            m_interval = value;
+            m_isRestarted = true;
+        }
+        m_isChanged = true;
+    }
+
+    std::vector<uint16_t> saveState() const override
+    {
+        return {m_status, m_interval};
+    }
+
+    // the interval starts over
+    void loadState(std::span<const uint16_t> state) override
+    {
+        m_status = state[0];
+        m_interval = state[1];
+        m_isRestarted = true;
+    }
+
+    MemoryFault takeSignal() override
+    {
+        return std::exchange(m_isChanged, false) ? MemoryFault::RESCHEDULE
+                                                 : MemoryFault::NONE;
+    }
+
+  private:
+    uint16_t m_status = 0;
+    uint16_t m_interval = 0;
+    bool m_isRestarted = false;
+    bool m_isChanged = false;
+};
 
 class Memory {
   private:
     static constexpr uint16_t START_OF_USER_PROGRAMS = 0x3000;
-    static constexpr uint16_t LC3_MEMORY_CAPCITY =
-        std::numeric_limits<uint16_t>::max();
-    static constexpr uint16_t KEYBOARD_STATUS_REGISTER = 0xFE00;
-    static constexpr uint16_t KEYBOARD_DATA_REGISTER = 0xFE02;
+    // every 16-bit address is valid, including 0xFFFF
+    static constexpr uint32_t LC3_MEMORY_CAPCITY =
+        std::numeric_limits<uint16_t>::max() + 1;
     using L3Memory = std::array<uint16_t, LC3_MEMORY_CAPCITY>;
+    using Attributes = std::array<uint8_t, LC3_MEMORY_CAPCITY>;
+
+  public:
+    // attributes that take each kind of access off the fast path
+    static constexpr uint8_t READ_CHECKED = PROTECTED | DEVICE;
+    static constexpr uint8_t WRITE_CHECKED =
+        PROTECTED | READ_ONLY | DEVICE | TRANSLATED | CLEAN;
+    // granularity of snapshot()/restore(), in words
+    static constexpr uint32_t PAGE_SIZE = 256;
+    static constexpr uint8_t FETCH_CHECKED = PROTECTED | BREAKPOINT;
 
   public:
-    Memory() {}
+    Memory()
+        : m_memory{}, m_decodedInstructions(LC3_MEMORY_CAPCITY),
+          m_attributes{}
+    {
+        addAttributes(0, START_OF_USER_PROGRAMS - 1, PROTECTED);
+        auto keyboard = std::make_unique<Keyboard>();
+        m_keyboard = keyboard.get();
+        mapDevice(Keyboard::STATUS_REGISTER, Keyboard::STATUS_REGISTER,
+                  keyboard.get());
+        mapDevice(Keyboard::DATA_REGISTER, Keyboard::DATA_REGISTER,
+                  keyboard.get());
+        m_devices.push_back(std::move(keyboard));
+
+        auto display = std::make_unique<Display>();
+        m_display = display.get();
+        mapDevice(Display::STATUS_REGISTER, Display::STATUS_REGISTER,
+                  display.get());
+        mapDevice(Display::DATA_REGISTER, Display::DATA_REGISTER,
+                  display.get());
+        m_devices.push_back(std::move(display));
+
+        auto machineControl = std::make_unique<MachineControl>();
+        mapDevice(MachineControl::CONTROL_REGISTER,
+                  MachineControl::CONTROL_REGISTER, machineControl.get());
+        m_devices.push_back(std::move(machineControl));
+
+        auto timer = std::make_unique<Timer>();
+        m_timer = timer.get();
+        mapDevice(Timer::STATUS_REGISTER, Timer::STATUS_REGISTER,
+                  timer.get());
+        mapDevice(Timer::INTERVAL_REGISTER, Timer::INTERVAL_REGISTER,
+                  timer.get());
+        m_devices.push_back(std::move(timer));
+    }
+
+    // Faulting accesses don't throw, they read as zero (or are dropped for
+    // writes) and are recorded until takeFault() is called.
+    uint16_t operator[](uint16_t address) noexcept
+    {
+        if (m_attributes[address] & READ_CHECKED) {
+            return readChecked(address);
+        }
+        return m_memory[address];
+    }
+
+    void write(uint16_t address, uint16_t value) noexcept
+    {
+        if (m_attributes[address] & WRITE_CHECKED) {
+            writeChecked(address, value);
+            return;
+        }
+        m_memory[address] = value;
+        m_decodedInstructions[address].handler = Handler::UNDECODED;
+    }
+
+    bool canFetch(uint16_t address) const
+    {
+        return !(m_attributes[address] & FETCH_CHECKED);
+    }
+
+    // Lets reads and writes reach system space, for code running there.
+    // Fetching from it still goes through fetchPrivileged().
+    void setPrivileged(bool isPrivileged) { m_isPrivileged = isPrivileged; }
+    bool isPrivileged() const { return m_isPrivileged; }
+
+    bool hasFault() const { return m_fault != MemoryFault::NONE; }
+
+    // first fault since the last call and its address
+    std::pair<MemoryFault, uint16_t> takeFault()
+    {
+        return {std::exchange(m_fault, MemoryFault::NONE), m_faultAddress};
+    }
+
+    // Instruction fetch. Words are decoded once and the result is reused
+    // until the word is overwritten. Words that can't be fetched are never
+    // decoded, so only the first fetch of a word looks at its attributes.
+    // Fetching them returns an UNDECODED instruction.
+    DecodedInstruction fetch(uint16_t address) noexcept
+    {
+        auto& decodedInstruction = m_decodedInstructions[address];
+        if (!decodedInstruction.isDecoded()) {
+            if (!canFetch(address)) {
+                return {};
+            }
+            decodedInstruction = decode(m_memory[address]);
+        }
+        return decodedInstruction;
+    }
+
+    // fetch() for privileged code. System space words are decoded every
+    // time instead of being cached, so fetch() keeps refusing them.
+    DecodedInstruction fetchPrivileged(uint16_t address) noexcept
+    {
+        if ((m_attributes[address] & FETCH_CHECKED) == PROTECTED) {
+            return decode(m_memory[address]);
+        }
+        return fetch(address);
+    }
+
+    void predecode(uint16_t start, uint16_t size)
+    {
+        for (uint32_t address = start; address < uint32_t(start) + size &&
+                                        address < LC3_MEMORY_CAPCITY;
+             ++address) {
+            fetch(address);
+        }
+    }
+
+    Keyboard& keyboard() { return *m_keyboard; }
+    Display& display() { return *m_display; }
+    Timer& timer() { return *m_timer; }
+
+    // raw contents, device registers aren't included
+    std::span<const uint16_t> words() const { return m_memory; }
+
+    // Replaces `count` words from `start` on, ignoring attributes, for
+    // loading whole images. `copy(destination, count)` fills them in one
+    // go. Decoded instructions over them are dropped.
+    template <typename Copy>
+    void assign(uint16_t start, uint32_t count, Copy copy)
+    {
+        count = std::min(count, LC3_MEMORY_CAPCITY - start);
+        for (uint32_t address = start; address < start + count; ++address) {
+            if (m_attributes[address] & CLEAN) {
+                markDirty(address);
+            }
+            dropTranslation(address);
+            m_decodedInstructions[address].handler = Handler::UNDECODED;
+        }
+        copy(&m_memory[start], count);
+    }
+
+    void assign(uint16_t start, const uint16_t* words, uint32_t count)
+    {
+        assign(start, count, [words](uint16_t* destination, uint32_t count) {
+            std::memcpy(destination, words, count * sizeof(uint16_t));
+        });
+    }
+
+    // state of the devices Memory owns, each prefixed with its size
+    std::vector<uint16_t> deviceState() const
+    {
+        std::vector<uint16_t> state;
+        for (const auto& device : m_devices) {
+            auto deviceState = device->saveState();
+            state.push_back(deviceState.size());
+            state.insert(state.end(), deviceState.begin(), deviceState.end());
+        }
+        return state;
+    }
+
+    // false if `state` doesn't come from the same set of devices
+    bool setDeviceState(std::span<const uint16_t> state)
+    {
+        size_t offset = 0;
+        for (const auto& device : m_devices) {
+            if (offset >= state.size() ||
+                state[offset] != device->saveState().size() ||
+                offset + 1 + state[offset] > state.size()) {
+                return false;
+            }
+            device->loadState(state.subspan(offset + 1, state[offset]));
+            offset += 1 + state[offset];
+        }
+        return offset == state.size();
+    }
+
+    // Number of words before the zero that ends the string at `address`,
+    // or before the first word a read of which is checked, whichever
+    // comes first. Those words can be read straight from words().
+    uint16_t plainStringLength(uint16_t address) const
+    {
+        uint32_t end = address;
+        while (end < LC3_MEMORY_CAPCITY && m_memory[end] != 0 &&
+               !(m_attributes[end] & READ_CHECKED)) {
+            ++end;
+        }
+        return end - address;
+    }
+
+    uint8_t attributes(uint16_t address) const
+    {
+        return m_attributes[address];
+    }
+
+    // [first, last], changing a translated word queues it like a write
+    // so blocks that were built without the new attributes get dropped
+    void addAttributes(uint16_t first, uint16_t last, uint8_t attributes)
+    {
+        for (uint32_t address = first; address <= last; ++address) {
+            dropTranslation(address);
+            m_attributes[address] |= attributes;
+            if (attributes & FETCH_CHECKED) {
+                m_decodedInstructions[address].handler = Handler::UNDECODED;
+            }
+        }
+    }
+
+    void removeAttributes(uint16_t first, uint16_t last, uint8_t attributes)
+    {
+        for (uint32_t address = first; address <= last; ++address) {
+            dropTranslation(address);
+            m_attributes[address] &= ~attributes;
+        }
+    }
+
+    // Accesses to [first, last] go to `device`, which has to outlive this
+    // Memory. Replaces whatever was mapped there before.
+    void mapDevice(uint16_t first, uint16_t last, MemoryMappedDevice* device)
+    {
+        std::erase_if(m_deviceMappings, [&](const DeviceMapping& mapping) {
+            return mapping.first >= first && mapping.last <= last;
+        });
+        m_deviceMappings.push_back({first, last, device});
+        addAttributes(first, last, DEVICE);
+    }
+
+    // Words covered by a translated block (see translateBlock), writes to
+    // them are queued so the owner of the blocks can drop stale ones.
+    void markTranslated(uint16_t start, uint32_t end)
+    {
+        for (uint32_t address = start; address < end; ++address) {
+            m_attributes[address] |= TRANSLATED;
+        }
+    }
+
+    // Remembers the contents of memory and the device registers, restore()
+    // brings them back. Only the pages written in between are copied, so
+    // restoring costs as much as the program touched. Attributes aren't
+    // part of the snapshot.
+    void snapshot()
+    {
+        if (!m_snapshot) {
+            m_snapshot = std::make_unique<L3Memory>();
+        }
+        *m_snapshot = m_memory;
+        m_snapshotDeviceState = deviceState();
+        m_dirtyPages.clear();
+        for (auto& attributes : m_attributes) {
+            attributes |= CLEAN;
+        }
+    }
 
-    uint16_t operator[](uint16_t address)
+    // back to the last snapshot(), does nothing without one
+    void restore()
     {
-        if (address == KEYBOARD_STATUS_REGISTER) {
-            if (check_key()) {
-                m_memory[KEYBOARD_STATUS_REGISTER] = (1 << 15);
-                m_memory[KEYBOARD_DATA_REGISTER] = getchar();
+        if (!m_snapshot) {
+            return;
+        }
+        for (uint16_t page : m_dirtyPages) {
+            uint32_t first = page * PAGE_SIZE;
+            for (uint32_t address = first; address < first + PAGE_SIZE;
+                 ++address) {
+                // unchanged words keep their decoded instruction and blocks
+                if (m_memory[address] != (*m_snapshot)[address]) {
+                    dropTranslation(address);
+                    m_memory[address] = (*m_snapshot)[address];
+                    m_decodedInstructions[address].handler =
+                        Handler::UNDECODED;
+                }
+                m_attributes[address] |= CLEAN;
             }
-            else {
-                m_memory[KEYBOARD_STATUS_REGISTER] = 0;
+        }
+        m_dirtyPages.clear();
+        setDeviceState(m_snapshotDeviceState);
+        m_fault = MemoryFault::NONE;
+    }
+
+    bool hasTranslatedWrites() const { return !m_translatedWrites.empty(); }
+
+    std::vector<uint16_t> takeTranslatedWrites()
+    {
+        return std::exchange(m_translatedWrites, {});
+    }
+
+  private:
+    struct DeviceMapping {
+        uint16_t first;
+        uint16_t last;
+        MemoryMappedDevice* device;
+    };
+
+    MemoryMappedDevice* deviceAt(uint16_t address) const
+    {
+        // there are only ever a handful of devices
+        for (auto it = m_deviceMappings.rbegin(); it != m_deviceMappings.rend();
+             ++it) {
+            if (address >= it->first && address <= it->last) {
+                return it->device;
             }
         }
-        else if (address < START_OF_USER_PROGRAMS) {
-            throw std::runtime_error(
-                fmt::format("Illegal memory access at address: {}", address));
+        return nullptr;
+    }
+
+    uint16_t readChecked(uint16_t address)
+    {
+        uint8_t attributes = m_attributes[address];
+        if ((attributes & PROTECTED) && !m_isPrivileged) {
+            setFault(MemoryFault::ILLEGAL_READ, address);
+            return 0;
+        }
+        if (attributes & DEVICE) {
+            return deviceAt(address)->read(address);
         }
         return m_memory[address];
     }
 
-    void write(uint16_t address, uint16_t value)
+    void writeChecked(uint16_t address, uint16_t value)
     {
-        if (address < START_OF_USER_PROGRAMS) {
-            throw std::runtime_error(
-                fmt::format("Illegal memory write at address: {}", address));
+        uint8_t attributes = m_attributes[address];
+        if ((attributes & READ_ONLY) ||
+            ((attributes & PROTECTED) && !m_isPrivileged)) {
+            setFault(MemoryFault::ILLEGAL_WRITE, address);
+            return;
+        }
+        if (attributes & DEVICE) {
+            auto* device = deviceAt(address);
+            device->write(address, value);
+            if (auto signal = device->takeSignal();
+                signal != MemoryFault::NONE) {
+                setFault(signal, address);
+            }
+            return;
+        }
+        if (attributes & CLEAN) {
+            markDirty(address);
         }
+        dropTranslation(address);
         m_memory[address] = value;
+        m_decodedInstructions[address].handler = Handler::UNDECODED;
+    }
+
+    // the rest of the page's writes stay on the fast path
+    void markDirty(uint16_t address)
+    {
+        uint32_t first = address & ~(PAGE_SIZE - 1);
+        for (uint32_t word = first; word < first + PAGE_SIZE; ++word) {
+            m_attributes[word] &= ~CLEAN;
+        }
+        m_dirtyPages.push_back(address / PAGE_SIZE);
+    }
+
+    void dropTranslation(uint16_t address)
+    {
+        if (m_attributes[address] & TRANSLATED) {
+            m_attributes[address] &= ~TRANSLATED;
+            m_translatedWrites.push_back(address);
+        }
+    }
+
+    void setFault(MemoryFault fault, uint16_t address)
+    {
+        if (m_fault == MemoryFault::NONE) {
+            m_fault = fault;
+            m_faultAddress = address;
+        }
     }
 
   private:
     L3Memory m_memory;
+    std::vector<DecodedInstruction> m_decodedInstructions;
+    Attributes m_attributes;
+    std::vector<uint16_t> m_translatedWrites;
+    // contents at the last snapshot() and the pages written since
+    std::unique_ptr<L3Memory> m_snapshot;
+    std::vector<uint16_t> m_dirtyPages;
+    std::vector<uint16_t> m_snapshotDeviceState;
+    std::vector<DeviceMapping> m_deviceMappings;
+    std::vector<std::unique_ptr<MemoryMappedDevice>> m_devices;
+    Keyboard* m_keyboard;
+    Display* m_display;
+    Timer* m_timer;
+    bool m_isPrivileged = false;
+    MemoryFault m_fault = MemoryFault::NONE;
+    uint16_t m_faultAddress = 0;
+
+    // generated code reads and writes m_memory directly
+    friend class Jit;
 };
\ No newline at end of file
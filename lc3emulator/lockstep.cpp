@@ -0,0 +1,567 @@
+#include "lockstep.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <map>
+#include <unordered_map>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define LC3_LANES_SSE2 1
+#include <immintrin.h>
+#else
+#define LC3_LANES_SSE2 0
+#endif
+
+#if LC3_LANES_SSE2 && defined(__GNUC__)
+#define LC3_LANES_AVX2 1
+#else
+#define LC3_LANES_AVX2 0
+#endif
+
+namespace {
+enum class LaneOperation : uint8_t {
+    ADD,
+    AND,
+    // NOT is XOR with 0xFFFF
+    XOR,
+};
+
+// Column markers in Lockstep::m_nextPcs, everything below is a PC.
+constexpr uint32_t STOPPED = 0x10000;
+constexpr uint32_t LEAVING = 0x10001;
+
+uint16_t apply(LaneOperation operation, uint16_t a, uint16_t b)
+{
+    switch (operation) {
+    case LaneOperation::ADD:
+        return a + b;
+    case LaneOperation::AND:
+        return a & b;
+    default:
+        return a ^ b;
+    }
+}
+
+bool isTaken(uint16_t conditionValue, uint8_t nzp)
+{
+    int16_t value = static_cast<int16_t>(conditionValue);
+    return ((nzp & 0b100) && value < 0) || ((nzp & 0b010) && value == 0) ||
+           ((nzp & 0b001) && value > 0);
+}
+
+// dst = a <op> b, or a <op> immediate when b is nullptr. The vector
+// versions use the scalar one for the lanes that don't fill a register.
+void binaryScalar(LaneOperation operation, uint16_t* dst, const uint16_t* a,
+                  const uint16_t* b, uint16_t immediate, size_t from,
+                  size_t count)
+{
+    for (size_t i = from; i < count; ++i) {
+        dst[i] = apply(operation, a[i], b ? b[i] : immediate);
+    }
+}
+
+// taken[i] = 0xFFFF if a BR with `nzp` is taken for condition value i,
+// returns how many are
+size_t branchScalar(const uint16_t* conditionValues, uint8_t nzp,
+                    uint16_t* taken, size_t from, size_t count)
+{
+    size_t takenCount = 0;
+    for (size_t i = from; i < count; ++i) {
+        taken[i] = isTaken(conditionValues[i], nzp) ? 0xFFFF : 0;
+        takenCount += taken[i] & 1;
+    }
+    return takenCount;
+}
+
+#if LC3_LANES_SSE2
+void binarySse2(LaneOperation operation, uint16_t* dst, const uint16_t* a,
+                const uint16_t* b, uint16_t immediate, size_t count)
+{
+    __m128i broadcast = _mm_set1_epi16(static_cast<int16_t>(immediate));
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i y =
+            b ? _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i))
+              : broadcast;
+        __m128i result = operation == LaneOperation::ADD ? _mm_add_epi16(x, y)
+                         : operation == LaneOperation::AND
+                             ? _mm_and_si128(x, y)
+                             : _mm_xor_si128(x, y);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), result);
+    }
+    binaryScalar(operation, dst, a, b, immediate, i, count);
+}
+
+size_t branchSse2(const uint16_t* conditionValues, uint8_t nzp,
+                  uint16_t* taken, size_t count)
+{
+    __m128i zero = _mm_setzero_si128();
+    size_t takenCount = 0;
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i value = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(conditionValues + i));
+        __m128i mask = zero;
+        if (nzp & 0b100) {
+            mask = _mm_or_si128(mask, _mm_cmpgt_epi16(zero, value));
+        }
+        if (nzp & 0b010) {
+            mask = _mm_or_si128(mask, _mm_cmpeq_epi16(value, zero));
+        }
+        if (nzp & 0b001) {
+            mask = _mm_or_si128(mask, _mm_cmpgt_epi16(value, zero));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(taken + i), mask);
+        // two mask bits per lane
+        takenCount += std::popcount<uint32_t>(_mm_movemask_epi8(mask)) / 2;
+    }
+    return takenCount + branchScalar(conditionValues, nzp, taken, i, count);
+}
+#endif
+
+#if LC3_LANES_AVX2
+__attribute__((target("avx2"))) void
+binaryAvx2(LaneOperation operation, uint16_t* dst, const uint16_t* a,
+           const uint16_t* b, uint16_t immediate, size_t count)
+{
+    __m256i broadcast = _mm256_set1_epi16(static_cast<int16_t>(immediate));
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m256i x =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i y =
+            b ? _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i))
+              : broadcast;
+        __m256i result = operation == LaneOperation::ADD
+                             ? _mm256_add_epi16(x, y)
+                         : operation == LaneOperation::AND
+                             ? _mm256_and_si256(x, y)
+                             : _mm256_xor_si256(x, y);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), result);
+    }
+    binaryScalar(operation, dst, a, b, immediate, i, count);
+}
+
+__attribute__((target("avx2"))) size_t
+branchAvx2(const uint16_t* conditionValues, uint8_t nzp, uint16_t* taken,
+           size_t count)
+{
+    __m256i zero = _mm256_setzero_si256();
+    size_t takenCount = 0;
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m256i value = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i*>(conditionValues + i));
+        __m256i mask = zero;
+        if (nzp & 0b100) {
+            mask = _mm256_or_si256(mask, _mm256_cmpgt_epi16(zero, value));
+        }
+        if (nzp & 0b010) {
+            mask = _mm256_or_si256(mask, _mm256_cmpeq_epi16(value, zero));
+        }
+        if (nzp & 0b001) {
+            mask = _mm256_or_si256(mask, _mm256_cmpgt_epi16(value, zero));
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(taken + i), mask);
+        takenCount += std::popcount<uint32_t>(_mm256_movemask_epi8(mask)) / 2;
+    }
+    return takenCount + branchScalar(conditionValues, nzp, taken, i, count);
+}
+#endif
+
+struct LaneKernels {
+    void (*binary)(LaneOperation operation, uint16_t* dst, const uint16_t* a,
+                   const uint16_t* b, uint16_t immediate, size_t count);
+    size_t (*branch)(const uint16_t* conditionValues, uint8_t nzp,
+                     uint16_t* taken, size_t count);
+};
+
+// picked once, AVX2 only where the CPU we run on has it
+const LaneKernels& laneKernels()
+{
+    static const LaneKernels kernels = []() -> LaneKernels {
+#if LC3_LANES_AVX2
+        if (__builtin_cpu_supports("avx2")) {
+            return {binaryAvx2, branchAvx2};
+        }
+#endif
+#if LC3_LANES_SSE2
+        return {binarySse2, branchSse2};
+#else
+        return {[](LaneOperation operation, uint16_t* dst, const uint16_t* a,
+                   const uint16_t* b, uint16_t immediate, size_t count) {
+                    binaryScalar(operation, dst, a, b, immediate, 0, count);
+                },
+                [](const uint16_t* conditionValues, uint8_t nzp,
+                   uint16_t* taken, size_t count) {
+                    return branchScalar(conditionValues, nzp, taken, 0, count);
+                }};
+#endif
+    }();
+    return kernels;
+}
+} // namespace
+
+Lockstep::Lockstep(size_t laneCount, Engine scalarEngine)
+    : m_maxInstructions(CPU::UNLIMITED), m_cycles(0)
+{
+    for (size_t i = 0; i < laneCount; ++i) {
+        m_lanes.push_back(std::make_unique<CPU>(scalarEngine));
+    }
+}
+
+std::vector<RunResult> Lockstep::run(uint64_t maxInstructions)
+{
+    m_maxInstructions = maxInstructions;
+    m_results.assign(m_lanes.size(), {});
+    m_pendingGroups.clear();
+    m_cycles = 0;
+    m_startCycles.clear();
+    for (const auto& cpu : m_lanes) {
+        m_startCycles.push_back(cpu->m_cycleCount);
+    }
+
+    std::map<uint16_t, std::vector<uint32_t>> lanesByPc;
+    for (uint32_t lane = 0; lane < m_lanes.size(); ++lane) {
+        auto& cpu = *m_lanes[lane];
+        // stores are checked against TRANSLATED, start from a clean queue
+        if (cpu.m_memory.hasTranslatedWrites()) {
+            cpu.invalidateBlocks();
+        }
+        // groups don't take interrupts or logged input, aren't observed,
+        // and count cycles by the first lane
+        if (cpu.m_memory.timer().interval() != 0 ||
+            cpu.m_memory.keyboard().isInterruptEnabled() ||
+            cpu.m_inputLog || cpu.isObserved() ||
+            cpu.m_cycleModel != m_lanes[0]->m_cycleModel) {
+            runScalar(lane, 0);
+            continue;
+        }
+        lanesByPc[cpu.m_pc].push_back(lane);
+    }
+    for (auto& [pc, lanes] : lanesByPc) {
+        m_pendingGroups.push_back(
+            {.lanes = std::move(lanes),
+             .retired = 0,
+             .cycles = 0,
+             .checkedWords = std::vector<bool>(
+                 std::numeric_limits<uint16_t>::max() + 1)});
+    }
+
+    while (!m_pendingGroups.empty()) {
+        auto group = std::move(m_pendingGroups.back());
+        m_pendingGroups.pop_back();
+        runGroup(std::move(group));
+    }
+    // lanes that stopped inside a group never returned from CPU::run()
+    for (auto& lane : m_lanes) {
+        lane->flushOutput();
+    }
+    return m_results;
+}
+
+void Lockstep::runScalar(uint32_t lane, uint64_t retired)
+{
+    auto& cpu = *m_lanes[lane];
+    cpu.m_instructionCount += retired;
+    cpu.m_cycleCount += m_cycles;
+    auto result = cpu.run(m_maxInstructions - retired);
+    result.instructionsRetired += retired;
+    // trap routines that ran on the lane's CPU charged it directly
+    result.cycles = cpu.m_cycleCount - m_startCycles[lane];
+    m_results[lane] = result;
+}
+
+void Lockstep::finish(uint32_t lane, uint64_t retired)
+{
+    auto& cpu = *m_lanes[lane];
+    cpu.m_instructionCount += retired;
+    cpu.m_cycleCount += m_cycles;
+    auto result = cpu.m_runResult;
+    result.instructionsRetired = retired;
+    result.cycles = cpu.m_cycleCount - m_startCycles[lane];
+    result.finalPc = cpu.m_pc;
+    m_results[lane] = result;
+}
+
+void Lockstep::storeColumn(size_t column, uint16_t pc)
+{
+    auto& cpu = *m_lanes[m_columnLanes[column]];
+    for (uint8_t i = 0; i < CPU::NUMBER_OF_REGISTERS; ++i) {
+        cpu.m_registers[i] = m_registers[i][column];
+    }
+    cpu.m_conditionValue = m_conditionValues[column];
+    cpu.m_pc = pc;
+}
+
+void Lockstep::loadColumn(size_t column)
+{
+    auto& cpu = *m_lanes[m_columnLanes[column]];
+    for (uint8_t i = 0; i < CPU::NUMBER_OF_REGISTERS; ++i) {
+        m_registers[i][column] = cpu.m_registers[i];
+    }
+    m_conditionValues[column] = cpu.m_conditionValue;
+}
+
+void Lockstep::splitGroup(uint16_t pc, uint64_t retired)
+{
+    std::map<uint16_t, std::vector<uint32_t>> newGroups;
+    size_t kept = 0;
+    for (size_t column = 0; column < m_columnLanes.size(); ++column) {
+        uint32_t lane = m_columnLanes[column];
+        uint32_t nextPc = m_nextPcs[column];
+        if (nextPc == STOPPED) {
+            finish(lane, retired);
+        }
+        else if (nextPc == LEAVING) {
+            // already stored, see the callers
+            runScalar(lane, retired);
+        }
+        else if (nextPc != pc) {
+            storeColumn(column, nextPc);
+            newGroups[nextPc].push_back(lane);
+        }
+        else {
+            for (auto& registerColumn : m_registers) {
+                registerColumn[kept] = registerColumn[column];
+            }
+            m_conditionValues[kept] = m_conditionValues[column];
+            m_columnLanes[kept] = lane;
+            kept++;
+        }
+    }
+    m_columnLanes.resize(kept);
+
+    for (auto& [groupPc, lanes] : newGroups) {
+        m_pendingGroups.push_back({.lanes = std::move(lanes),
+                                   .retired = retired,
+                                   .cycles = m_cycles,
+                                   .checkedWords = m_checkedWords});
+    }
+}
+
+DecodedInstruction Lockstep::fetch(uint16_t pc, uint64_t retired)
+{
+    auto instruction = m_lanes[m_columnLanes[0]]->m_memory.fetch(pc);
+    if (m_checkedWords[pc]) {
+        return instruction;
+    }
+
+    bool isDiverged = false;
+    for (size_t column = 0; column < m_columnLanes.size(); ++column) {
+        auto& memory = m_lanes[m_columnLanes[column]]->m_memory;
+        m_nextPcs[column] = pc;
+        if (memory.fetch(pc) != instruction) {
+            storeColumn(column, pc);
+            m_nextPcs[column] = LEAVING;
+            isDiverged = true;
+        }
+    }
+    if (isDiverged) {
+        splitGroup(pc, retired);
+    }
+    for (uint32_t lane : m_columnLanes) {
+        m_lanes[lane]->m_memory.markTranslated(pc, uint32_t(pc) + 1);
+    }
+    m_checkedWords[pc] = true;
+    return instruction;
+}
+
+void Lockstep::runGroup(Group group)
+{
+    m_columnLanes = std::move(group.lanes);
+    m_checkedWords = std::move(group.checkedWords);
+    size_t columns = m_columnLanes.size();
+    for (auto& registerColumn : m_registers) {
+        registerColumn.resize(columns);
+    }
+    m_conditionValues.resize(columns);
+    m_nextPcs.resize(columns);
+    m_taken.resize(columns);
+    for (size_t column = 0; column < columns; ++column) {
+        loadColumn(column);
+    }
+
+    const auto& kernels = laneKernels();
+    uint16_t pc = m_lanes[m_columnLanes[0]]->m_pc;
+    uint64_t retired = group.retired;
+    m_cycles = group.cycles;
+    const auto& cycleTable = m_lanes[m_columnLanes[0]]->m_cycleTable;
+    while (true) {
+        if (m_columnLanes.size() < MIN_GROUP_SIZE ||
+            retired == m_maxInstructions) {
+            // the scalar engines finish it, and stop on the budget
+            for (size_t column = 0; column < m_columnLanes.size(); ++column) {
+                storeColumn(column, pc);
+                runScalar(m_columnLanes[column], retired);
+            }
+            return;
+        }
+
+        auto instruction = fetch(pc, retired);
+        size_t count = m_columnLanes.size();
+        retired++;
+        m_cycles += cycleTable[static_cast<uint8_t>(instruction.handler)];
+        uint16_t nextPc = pc + 1;
+        uint16_t* destination =
+            m_registers[instruction.destinationRegister].data();
+        const uint16_t* source = m_registers[instruction.sourceRegister].data();
+        const uint16_t* secondSource =
+            instruction.isImmediate
+                ? nullptr
+                : m_registers[instruction.secondSourceRegister].data();
+        bool setsConditionalCodes = false;
+        bool isDiverged = false;
+
+        switch (instruction.handler) {
+        case Handler::ADD_REGISTER:
+        case Handler::ADD_IMMEDIATE:
+            kernels.binary(LaneOperation::ADD, destination, source,
+                           secondSource, instruction.immediateValue, count);
+            setsConditionalCodes = true;
+            break;
+        case Handler::AND_REGISTER:
+        case Handler::AND_IMMEDIATE:
+            kernels.binary(LaneOperation::AND, destination, source,
+                           secondSource, instruction.immediateValue, count);
+            setsConditionalCodes = true;
+            break;
+        case Handler::NOT:
+            kernels.binary(LaneOperation::XOR, destination, source, nullptr,
+                           0xFFFF, count);
+            setsConditionalCodes = true;
+            break;
+        case Handler::LEA:
+            std::fill_n(destination, count,
+                        static_cast<uint16_t>(nextPc +
+                                              instruction.immediateValue));
+            setsConditionalCodes = true;
+            break;
+        case Handler::JSR:
+            std::fill_n(m_registers[R7].data(), count, nextPc);
+            nextPc += instruction.immediateValue;
+            break;
+        case Handler::BR:
+        case Handler::BR_NZP:
+            nextPc += instruction.immediateValue;
+            break;
+        case Handler::BR_P:
+        case Handler::BR_Z:
+        case Handler::BR_ZP:
+        case Handler::BR_N:
+        case Handler::BR_NP:
+        case Handler::BR_NZ: {
+            uint16_t target = nextPc + instruction.immediateValue;
+            size_t takenCount =
+                kernels.branch(m_conditionValues.data(),
+                               instruction.destinationRegister,
+                               m_taken.data(), count);
+            if (takenCount == count) {
+                nextPc = target;
+            }
+            else if (takenCount != 0) {
+                for (size_t column = 0; column < count; ++column) {
+                    m_nextPcs[column] = m_taken[column] ? target : nextPc;
+                }
+                // the larger half stays
+                if (takenCount * 2 >= count) {
+                    nextPc = target;
+                }
+                isDiverged = true;
+            }
+            break;
+        }
+        case Handler::LD:
+        case Handler::LDI:
+        case Handler::LDR:
+        case Handler::ST:
+        case Handler::STI:
+        case Handler::STR: {
+            bool isLoad = instruction.handler == Handler::LD ||
+                          instruction.handler == Handler::LDI ||
+                          instruction.handler == Handler::LDR;
+            // every lane has its own memory
+            for (size_t column = 0; column < count; ++column) {
+                auto& cpu = *m_lanes[m_columnLanes[column]];
+                uint16_t address =
+                    instruction.handler == Handler::LDR ||
+                            instruction.handler == Handler::STR
+                        ? m_registers[instruction.sourceRegister][column] +
+                              instruction.immediateValue
+                        : pc + 1 + instruction.immediateValue;
+                if (instruction.handler == Handler::LDI ||
+                    instruction.handler == Handler::STI) {
+                    address = cpu.m_memory[address];
+                }
+                uint16_t value = 0;
+                if (isLoad) {
+                    value = cpu.m_memory[address];
+                }
+                else {
+                    cpu.m_memory.write(address, destination[column]);
+                }
+
+                m_nextPcs[column] = nextPc;
+                if (cpu.m_memory.hasFault()) {
+                    storeColumn(column, nextPc);
+                    // a device that wants the CPU back lets it go on alone
+                    m_nextPcs[column] =
+                        cpu.memoryFault(pc) ? LEAVING : STOPPED;
+                    isDiverged = true;
+                }
+                else if (isLoad) {
+                    destination[column] = value;
+                }
+                else if (cpu.m_memory.hasTranslatedWrites()) {
+                    // this lane's code isn't the same as the others' anymore
+                    storeColumn(column, nextPc);
+                    cpu.invalidateBlocks();
+                    m_nextPcs[column] = LEAVING;
+                    isDiverged = true;
+                }
+            }
+            setsConditionalCodes = isLoad;
+            break;
+        }
+        default: {
+            // JSRR, JMP/RET, TRAP, RTI and faults, one lane at a time
+            std::unordered_map<uint16_t, size_t> lanesPerPc;
+            for (size_t column = 0; column < count; ++column) {
+                auto& cpu = *m_lanes[m_columnLanes[column]];
+                storeColumn(column, nextPc);
+                if (cpu.execute(instruction)) {
+                    loadColumn(column);
+                    m_nextPcs[column] = cpu.m_pc;
+                    lanesPerPc[cpu.m_pc]++;
+                }
+                else {
+                    m_nextPcs[column] = STOPPED;
+                }
+            }
+            auto largest = std::max_element(
+                lanesPerPc.begin(), lanesPerPc.end(),
+                [](const auto& a, const auto& b) {
+                    return a.second < b.second;
+                });
+            if (largest != lanesPerPc.end()) {
+                nextPc = largest->first;
+            }
+            isDiverged = lanesPerPc.size() != 1 ||
+                         largest->second != m_columnLanes.size();
+            break;
+        }
+        }
+
+        if (setsConditionalCodes) {
+            std::copy_n(destination, count, m_conditionValues.begin());
+        }
+        if (isDiverged) {
+            splitGroup(nextPc, retired);
+            if (m_columnLanes.empty()) {
+                return;
+            }
+        }
+        pc = nextPc;
+    }
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "CPU.hpp"
+
+#include <array>
+#include <memory>
+#include <vector>
+
+// Runs many copies of one program, typically fed different inputs, side by
+// side. As long as the copies (lanes) agree on the PC, their registers and
+// condition values are kept in structure-of-arrays form and arithmetic runs
+// on all of them at once with SSE2/AVX2. A branch that goes both ways
+// splits the group: the larger half keeps going, the rest becomes a group
+// of its own, or runs on its CPU alone once it's too small to be worth it.
+class Lockstep {
+  public:
+    // smaller groups are handed to CPU::run()
+    static constexpr size_t MIN_GROUP_SIZE = 4;
+
+  public:
+    Lockstep(size_t laneCount, Engine scalarEngine = Engine::SWITCH);
+
+    size_t laneCount() const { return m_lanes.size(); }
+    // load the program and set up the console of every lane through this
+    CPU& lane(size_t index) { return *m_lanes[index]; }
+    // runs every lane until it stops, results are in lane order
+    std::vector<RunResult> run(uint64_t maxInstructions = CPU::UNLIMITED);
+
+  private:
+    struct Group {
+        std::vector<uint32_t> lanes;
+        // instructions every lane of the group retired before it was formed
+        uint64_t retired;
+        // and what those took
+        uint64_t cycles;
+        // words all lanes were seen to agree on, see fetch()
+        std::vector<bool> checkedWords;
+    };
+
+    void runGroup(Group group);
+    void runScalar(uint32_t lane, uint64_t retired);
+    // copies one column of the SoA state into/from the lane's CPU
+    void storeColumn(size_t column, uint16_t pc);
+    void loadColumn(size_t column);
+    // Moves the columns whose m_nextPcs entry isn't `pc` out of the group.
+    // They are stored back into their CPUs and become new groups, one per
+    // distinct PC. STOPPED columns are dropped, their CPU holds the result,
+    // LEAVING ones finish on their CPU.
+    void splitGroup(uint16_t pc, uint64_t retired);
+    // checks every lane holds the same instruction at `pc` the first time
+    // it is fetched, after that stores to it are caught by the TRANSLATED
+    // attribute
+    DecodedInstruction fetch(uint16_t pc, uint64_t retired);
+    void finish(uint32_t lane, uint64_t retired);
+
+  private:
+    std::vector<std::unique_ptr<CPU>> m_lanes;
+    std::vector<RunResult> m_results;
+    std::vector<Group> m_pendingGroups;
+    uint64_t m_maxInstructions;
+    // cycles every lane of the running group has taken in this run, lanes
+    // that leave the group add them to their CPU
+    uint64_t m_cycles;
+    // CPU::cycleCount() of every lane when run() was called
+    std::vector<uint64_t> m_startCycles;
+
+    // state of the group being run, column i belongs to m_columnLanes[i]
+    std::vector<uint32_t> m_columnLanes;
+    std::vector<bool> m_checkedWords;
+    std::array<std::vector<uint16_t>, CPU::NUMBER_OF_REGISTERS> m_registers;
+    std::vector<uint16_t> m_conditionValues;
+    // per column scratch: where each lane goes next, or STOPPED/LEAVING
+    std::vector<uint32_t> m_nextPcs;
+    std::vector<uint16_t> m_taken;
+};
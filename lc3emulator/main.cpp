@@ -1,25 +1,301 @@
+#include <bitset>
+#include <chrono>
+#include <csignal>
 #include <exception>
+#include <fstream>
 #include <iostream>
+#include <sstream>
 
 #include "CPU.hpp"
+#include "arguments.hpp"
+
+#if LC3_FD_IO_AVAILABLE
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace {
+// "all", "none" or a list of trap vectors like x20,x25
+bool parseNativeTraps(const std::string& list, std::bitset<256>& traps)
+{
+    traps.reset();
+    if (list == "all") {
+        traps.set();
+        return true;
+    }
+    if (list == "none") {
+        return true;
+    }
+    std::istringstream vectors(list);
+    std::string vector;
+    while (std::getline(vectors, vector, ',')) {
+        if (vector.size() < 2 || (vector[0] != 'x' && vector[0] != 'X')) {
+            return false;
+        }
+        size_t parsed = 0;
+        unsigned long value = 0;
+        try {
+            value = std::stoul(vector.substr(1), &parsed, 16);
+        }
+        catch (const std::exception&) {
+            return false;
+        }
+        if (parsed != vector.size() - 1 || value >= traps.size()) {
+            return false;
+        }
+        traps.set(value);
+    }
+    return true;
+}
+
+#if LC3_FD_IO_AVAILABLE
+// a descriptor opened for --input or --output, -1 for the terminal
+struct OwnedFd {
+    explicit OwnedFd(int fd) : fd(fd) {}
+    OwnedFd(const OwnedFd&) = delete;
+    OwnedFd& operator=(const OwnedFd&) = delete;
+    ~OwnedFd()
+    {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    int fd;
+};
+#endif
+} // namespace
 
 int main(int argc, char* argv[])
 {
     signal(SIGINT, handle_interrupt);
     disable_input_buffering();
 
-    if (argc < 2) {
-        std::cout << "usage: lc3emulator filename" << std::endl;
+    std::vector<std::string> images;
+    bool dumpLoadedWords = false;
+    std::string resumeFrom;
+    std::string saveTo;
+    std::string inputPath;
+    std::string outputPath;
+    Engine engine = Engine::SWITCH;
+    uint64_t maxInstructions = CPU::UNLIMITED;
+    std::bitset<256> nativeTraps;
+    nativeTraps.set();
+    CycleModel cycleModel = CycleModel::standard();
+    bool printStats = false;
+    std::string profilePath;
+    std::string foldedPath;
+    std::string symbolsPath;
+    std::string tracePath;
+    std::string recordInputPath;
+    std::string replayInputPath;
+    bool isBadArgument = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string argument = argv[i];
+        if (argument == "--engine" && i + 1 < argc) {
+            std::string engineName = argv[++i];
+            if (!parseEngine(engineName, engine)) {
+                std::cout << "unknown engine: " << engineName << std::endl;
+                return -1;
+            }
+        }
+        else if (argument == "--max-instructions" && i + 1 < argc) {
+            std::string limit = argv[++i];
+            if (!parseCount(limit, maxInstructions)) {
+                std::cout << "invalid instruction limit: " << limit
+                          << std::endl;
+                return -1;
+            }
+        }
+        else if (argument == "--native-traps" && i + 1 < argc) {
+            std::string list = argv[++i];
+            if (!parseNativeTraps(list, nativeTraps)) {
+                std::cout << "invalid trap list: " << list << std::endl;
+                return -1;
+            }
+        }
+        else if (argument == "--cycle-model" && i + 1 < argc) {
+            std::string list = argv[++i];
+            if (!parseCycleModel(list, cycleModel)) {
+                std::cout << "invalid cycle model: " << list << std::endl;
+                return -1;
+            }
+        }
+        else if (argument == "--stats") {
+            printStats = true;
+        }
+        else if (argument == "--profile" && i + 1 < argc) {
+            profilePath = argv[++i];
+        }
+        else if (argument == "--folded" && i + 1 < argc) {
+            foldedPath = argv[++i];
+        }
+        else if (argument == "--symbols" && i + 1 < argc) {
+            symbolsPath = argv[++i];
+        }
+        else if (argument == "--trace" && i + 1 < argc) {
+            tracePath = argv[++i];
+        }
+        else if (argument == "--record-input" && i + 1 < argc) {
+            recordInputPath = argv[++i];
+        }
+        else if (argument == "--replay-input" && i + 1 < argc) {
+            replayInputPath = argv[++i];
+        }
+        else if (argument == "--resume" && i + 1 < argc) {
+            resumeFrom = argv[++i];
+        }
+        else if (argument == "--save-snapshot" && i + 1 < argc) {
+            saveTo = argv[++i];
+        }
+#if LC3_FD_IO_AVAILABLE
+        else if (argument == "--input" && i + 1 < argc) {
+            inputPath = argv[++i];
+        }
+        else if (argument == "--output" && i + 1 < argc) {
+            outputPath = argv[++i];
+        }
+#endif
+        else if (argument == "--dump") {
+            dumpLoadedWords = true;
+        }
+        else if (argument.rfind("--", 0) == 0) {
+            // an unknown option or one missing its value
+            isBadArgument = true;
+        }
+        else {
+            images.push_back(argument);
+        }
+    }
+
+    if (isBadArgument || images.empty() == resumeFrom.empty() ||
+        (!recordInputPath.empty() && !replayInputPath.empty())) {
+        std::cout << "usage: lc3emulator [--engine switch|threaded|block|jit] "
+                     "[--max-instructions count] [--save-snapshot file] "
+                     "[--dump] [--input file] [--output file] "
+                     "[--native-traps all|none|x20,...] "
+                     "[--cycle-model LDR=6,memory=10,...] [--stats] "
+                     "[--profile report] [--folded stacks] "
+                     "[--symbols file.sym] [--trace file] "
+                     "[--record-input log|--replay-input log] "
+                     "filename [segment...]|--resume snapshot"
+                  << std::endl;
         return -1;
     }
 
-    std::string fileToRun = argv[1];
     try {
-        CPU cpu;
-        cpu.load(fileToRun);
-        cpu.emulate();
+#if LC3_FD_IO_AVAILABLE
+        // console from/to files instead of the terminal, straight through
+        // their descriptors
+        auto openFd = [](const std::string& path, int flags) {
+            if (path.empty()) {
+                return -1;
+            }
+            int fd = open(path.c_str(), flags, 0644);
+            if (fd < 0) {
+                throw std::runtime_error(
+                    fmt::format("Couldn't open a file: `{}`", path));
+            }
+            return fd;
+        };
+        // declared before the CPU, so both outlive it
+        OwnedFd inputFd(openFd(inputPath, O_RDONLY));
+        OwnedFd outputFd(openFd(outputPath, O_WRONLY | O_CREAT | O_TRUNC));
+        std::unique_ptr<FileDescriptorIo> fileIo;
+        if (inputFd.fd >= 0 || outputFd.fd >= 0) {
+            fileIo = std::make_unique<FileDescriptorIo>(
+                inputFd.fd >= 0 ? inputFd.fd : STDIN_FILENO,
+                outputFd.fd >= 0 ? outputFd.fd : STDOUT_FILENO);
+        }
+#endif
+        // wraps the CPU's console, declared first so it outlives the CPU
+        // that writes to it
+        std::unique_ptr<InputLog> inputLog;
+        CPU cpu(engine);
+        for (size_t vector = 0; vector < nativeTraps.size(); ++vector) {
+            cpu.setNativeTrap(vector, nativeTraps[vector]);
+        }
+        cpu.setCycleModel(cycleModel);
+        Symbols symbols;
+        if (!symbolsPath.empty()) {
+            symbols = Symbols(symbolsPath);
+        }
+        Profiler profiler;
+        if (!profilePath.empty() || !foldedPath.empty()) {
+            cpu.setProfiler(&profiler);
+        }
+        std::unique_ptr<TraceWriter> tracer;
+        if (!tracePath.empty()) {
+            tracer = std::make_unique<TraceWriter>(tracePath);
+            cpu.setTracer(tracer.get());
+        }
+#if LC3_FD_IO_AVAILABLE
+        if (fileIo) {
+            cpu.setIo(*fileIo);
+        }
+#endif
+        if (!recordInputPath.empty()) {
+            inputLog = std::make_unique<InputLog>(
+                InputLog::Mode::RECORD, cpu.io(), recordInputPath);
+        }
+        else if (!replayInputPath.empty()) {
+            inputLog = std::make_unique<InputLog>(
+                InputLog::Mode::REPLAY, cpu.io(), replayInputPath);
+        }
+        if (inputLog) {
+            cpu.setInputLog(*inputLog);
+        }
+        if (resumeFrom.empty()) {
+            cpu.load(images, dumpLoadedWords);
+        }
+        else {
+            cpu.loadSnapshot(resumeFrom);
+        }
+        auto started = std::chrono::steady_clock::now();
+        auto result = cpu.run(maxInstructions);
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - started;
+        if (result.reason != StopReason::HALT) {
+            std::cout << "LC3 EMULATOR ERROR: " << describeStop(result)
+                      << std::endl;
+        }
+        // on stderr, so it doesn't end up in --output
+        if (printStats) {
+            double instructions = result.instructionsRetired;
+            std::cerr << fmt::format(
+                "{} instructions, {} cycles ({:.2f} per instruction), "
+                "{:.1f} MIPS\n",
+                result.instructionsRetired, result.cycles,
+                instructions == 0 ? 0 : result.cycles / instructions,
+                instructions / elapsed.count() / 1e6);
+        }
+        auto writeProfile = [&](const std::string& path, auto write) {
+            if (path.empty()) {
+                return;
+            }
+            std::ofstream file(path);
+            if (!file.is_open()) {
+                throw std::runtime_error(
+                    fmt::format("Couldn't open a file: `{}`", path));
+            }
+            write(file);
+        };
+        writeProfile(profilePath, [&](std::ostream& out) {
+            profiler.writeReport(out, symbols);
+        });
+        writeProfile(foldedPath, [&](std::ostream& out) {
+            profiler.writeFoldedStacks(out, symbols);
+        });
+        if (tracer) {
+            tracer->close();
+        }
+        // wherever it stopped, --resume continues from there
+        if (!saveTo.empty()) {
+            cpu.saveSnapshot(saveTo);
+        }
     }
-    catch (std::exception e) {
+    catch (const std::exception& e) {
         std::cout << "LC3 EMULATOR ERROR: " << e.what() << std::endl;
     }
-}
\ No newline at end of file
+    restore_input_buffering();
+}
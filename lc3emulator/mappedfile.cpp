@@ -0,0 +1,65 @@
+#include "mappedfile.hpp"
+
+#include <fmt/core.h>
+#include <stdexcept>
+
+#if LC3_MMAP_AVAILABLE
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <fstream>
+#include <iterator>
+#endif
+
+#if LC3_MMAP_AVAILABLE
+MappedFile::MappedFile(const std::string& path) : m_data(nullptr), m_size(0)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat status;
+    if (fd < 0 || fstat(fd, &status) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        throw std::runtime_error(
+            fmt::format("Couldn't open a file: `{}`", path));
+    }
+
+    m_size = status.st_size;
+    // mmap() doesn't take empty mappings
+    if (m_size != 0) {
+        void* data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error(
+                fmt::format("Couldn't map a file: `{}`", path));
+        }
+        m_data = static_cast<const uint8_t*>(data);
+    }
+    // the mapping keeps the file alive
+    close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+    if (m_data) {
+        munmap(const_cast<uint8_t*>(m_data), m_size);
+    }
+}
+#else
+MappedFile::MappedFile(const std::string& path)
+{
+    std::ifstream ifs(path, std::ios::binary);
+    if (!ifs.is_open()) {
+        throw std::runtime_error(
+            fmt::format("Couldn't open a file: `{}`", path));
+    }
+    m_content.assign(std::istreambuf_iterator<char>(ifs),
+                     std::istreambuf_iterator<char>());
+    m_data = m_content.data();
+    m_size = m_content.size();
+}
+
+MappedFile::~MappedFile() = default;
+#endif
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define LC3_MMAP_AVAILABLE 1
+#else
+#define LC3_MMAP_AVAILABLE 0
+#endif
+
+// Read-only view of a whole file. Mapped where mmap is available, so
+// opening even a large file costs the same until its pages are touched,
+// read into memory everywhere else. Throws std::runtime_error if the file
+// can't be opened.
+class MappedFile {
+  public:
+    explicit MappedFile(const std::string& path);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const uint8_t* data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+  private:
+    const uint8_t* m_data;
+    size_t m_size;
+#if !LC3_MMAP_AVAILABLE
+    std::vector<uint8_t> m_content;
+#endif
+};
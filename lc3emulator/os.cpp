@@ -0,0 +1,298 @@
+#include "os.hpp"
+
+#include "decoder.hpp"
+#include "lc3memory.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <map>
+#include <string>
+#include <string_view>
+
+namespace {
+// n/z/p bits of BR
+constexpr uint8_t N = 0b100;
+constexpr uint8_t Z = 0b010;
+constexpr uint8_t P = 0b001;
+
+constexpr uint16_t RET = 0xC1C0;
+
+// opcode and bits [11:9], labels fill in the offset
+constexpr uint16_t op(InstructionOpCode opCode, uint8_t bits11To9 = 0)
+{
+    return (static_cast<uint16_t>(opCode) << 12) | (bits11To9 << 9);
+}
+
+constexpr uint16_t addImmediate(Register destination, Register source,
+                                int8_t value)
+{
+    return op(InstructionOpCode::ADD, destination) | (source << 6) | 0x20 |
+           (value & 0x1F);
+}
+
+constexpr uint16_t addRegister(Register destination, Register source,
+                               Register secondSource)
+{
+    return op(InstructionOpCode::ADD, destination) | (source << 6) |
+           secondSource;
+}
+
+constexpr uint16_t andImmediate(Register destination, Register source,
+                                int8_t value)
+{
+    return op(InstructionOpCode::AND, destination) | (source << 6) | 0x20 |
+           (value & 0x1F);
+}
+
+constexpr uint16_t andRegister(Register destination, Register source,
+                               Register secondSource)
+{
+    return op(InstructionOpCode::AND, destination) | (source << 6) |
+           secondSource;
+}
+
+constexpr uint16_t loadBaseOffset(Register destination, Register base,
+                                  int8_t offset)
+{
+    return op(InstructionOpCode::LDR, destination) | (base << 6) |
+           (offset & 0x3F);
+}
+
+constexpr uint16_t trap(Traps vector)
+{
+    return op(InstructionOpCode::TRAP) | static_cast<uint8_t>(vector);
+}
+
+// Just enough of an assembler for the OS: words are emitted in order and
+// PC-relative offsets to labels are patched in by finish().
+class Assembler {
+  public:
+    explicit Assembler(uint16_t origin) : m_origin(origin) {}
+
+    uint16_t here() const { return m_origin + m_words.size(); }
+    void label(const std::string& name) { m_labels[name] = here(); }
+    uint16_t address(const std::string& name) const
+    {
+        return m_labels.at(name);
+    }
+
+    void emit(uint16_t word) { m_words.push_back(word); }
+    // `word` with a PCoffset9 to `target`
+    void emit(uint16_t word, const std::string& target)
+    {
+        m_fixups.push_back({m_words.size(), target});
+        emit(word);
+    }
+    void fill(uint16_t value) { emit(value); }
+    void stringz(std::string_view text)
+    {
+        for (char c : text) {
+            emit(static_cast<uint8_t>(c));
+        }
+        emit(0);
+    }
+
+    // the words, from the origin on
+    std::vector<uint16_t> finish()
+    {
+        for (const auto& fixup : m_fixups) {
+            int offset =
+                int(address(fixup.target)) - int(m_origin + fixup.index + 1);
+            assert(offset >= -256 && offset < 256);
+            m_words[fixup.index] |= offset & 0x1FF;
+        }
+        return m_words;
+    }
+
+  private:
+    struct Fixup {
+        size_t index;
+        std::string target;
+    };
+
+    uint16_t m_origin;
+    std::vector<uint16_t> m_words;
+    std::map<std::string, uint16_t> m_labels;
+    std::vector<Fixup> m_fixups;
+};
+
+OsImage assemble()
+{
+    using Op = InstructionOpCode;
+    Assembler as(OsImage::CODE_START);
+    // waits for the display and writes `value`, `scratch` is clobbered
+    auto display = [&](Register value, Register scratch,
+                       const std::string& wait) {
+        as.label(wait);
+        as.emit(op(Op::LDI, scratch), "DSR");
+        as.emit(op(Op::BR, Z | P), wait);
+        as.emit(op(Op::STI, value), "DDR");
+    };
+
+    as.label("GETC");
+    as.emit(op(Op::LDI, R0), "KBSR");
+    as.emit(op(Op::BR, Z | P), "GETC");
+    as.emit(op(Op::LDI, R0), "KBDR");
+    as.emit(RET);
+
+    as.label("OUT");
+    as.emit(op(Op::ST, R1), "OUT_R1");
+    display(R0, R1, "OUT_WAIT");
+    as.emit(op(Op::LD, R1), "OUT_R1");
+    as.emit(RET);
+
+    // like the native PUTS, ends the line
+    as.label("PUTS");
+    as.emit(op(Op::ST, R0), "PUTS_R0");
+    as.emit(op(Op::ST, R1), "PUTS_R1");
+    as.emit(op(Op::ST, R2), "PUTS_R2");
+    as.label("PUTS_LOOP");
+    as.emit(loadBaseOffset(R1, R0, 0));
+    as.emit(op(Op::BR, Z), "PUTS_END");
+    display(R1, R2, "PUTS_WAIT");
+    as.emit(addImmediate(R0, R0, 1));
+    as.emit(op(Op::BR, N | Z | P), "PUTS_LOOP");
+    as.label("PUTS_END");
+    as.emit(op(Op::LD, R1), "NEWLINE");
+    display(R1, R2, "PUTS_NEWLINE");
+    as.emit(op(Op::LD, R0), "PUTS_R0");
+    as.emit(op(Op::LD, R1), "PUTS_R1");
+    as.emit(op(Op::LD, R2), "PUTS_R2");
+    as.emit(RET);
+
+    as.label("IN");
+    as.emit(op(Op::ST, R7), "IN_R7");
+    as.emit(trap(Traps::GETC));
+    as.emit(trap(Traps::T_OUT));
+    as.emit(op(Op::LD, R7), "IN_R7");
+    as.emit(RET);
+
+    // Two characters a word, low byte first. There is no right shift, so
+    // the high byte is put together bit by bit.
+    as.label("PUTSP");
+    for (auto reg : {R0, R1, R2, R3, R4, R5}) {
+        as.emit(op(Op::ST, reg), "PUTSP_R" + std::to_string(reg));
+    }
+    as.label("PUTSP_LOOP");
+    as.emit(loadBaseOffset(R1, R0, 0));
+    as.emit(op(Op::BR, Z), "PUTSP_END");
+    as.emit(op(Op::LD, R2), "LOW_BYTE");
+    as.emit(andRegister(R2, R1, R2));
+    display(R2, R3, "PUTSP_LOW");
+    as.emit(andImmediate(R2, R2, 0));
+    as.emit(op(Op::LD, R3), "BIT_8");
+    as.emit(andImmediate(R4, R4, 0));
+    as.emit(addImmediate(R4, R4, 1));
+    as.label("PUTSP_BIT");
+    as.emit(andRegister(R5, R1, R3));
+    as.emit(op(Op::BR, Z), "PUTSP_NEXT_BIT");
+    as.emit(addRegister(R2, R2, R4));
+    as.label("PUTSP_NEXT_BIT");
+    as.emit(addRegister(R4, R4, R4));
+    // x8000 shifts out to zero after the last bit
+    as.emit(addRegister(R3, R3, R3));
+    as.emit(op(Op::BR, N | P), "PUTSP_BIT");
+    as.emit(addImmediate(R2, R2, 0));
+    as.emit(op(Op::BR, Z), "PUTSP_NEXT");
+    display(R2, R3, "PUTSP_HIGH");
+    as.label("PUTSP_NEXT");
+    as.emit(addImmediate(R0, R0, 1));
+    as.emit(op(Op::BR, N | Z | P), "PUTSP_LOOP");
+    as.label("PUTSP_END");
+    for (auto reg : {R0, R1, R2, R3, R4, R5}) {
+        as.emit(op(Op::LD, reg), "PUTSP_R" + std::to_string(reg));
+    }
+    as.emit(RET);
+
+    // stops the clock, if the machine is started again it goes on after
+    // the TRAP
+    as.label("HALT");
+    as.emit(op(Op::ST, R0), "HALT_R0");
+    as.emit(op(Op::ST, R1), "HALT_R1");
+    as.emit(op(Op::ST, R7), "HALT_R7");
+    as.emit(op(Op::LEA, R0), "HALT_MESSAGE");
+    as.emit(trap(Traps::PUTS));
+    as.emit(op(Op::LD, R7), "HALT_R7");
+    as.emit(op(Op::LDI, R1), "MCR");
+    as.emit(op(Op::LD, R0), "CLOCK_OFF");
+    as.emit(andRegister(R0, R1, R0));
+    as.emit(op(Op::STI, R0), "MCR");
+    as.emit(op(Op::LD, R0), "HALT_R0");
+    as.emit(op(Op::LD, R1), "HALT_R1");
+    as.emit(RET);
+
+    // the same, but the machine stops as for an unsupported trap
+    as.label("BAD_TRAP");
+    as.emit(op(Op::ST, R0), "BAD_TRAP_R0");
+    as.emit(op(Op::ST, R1), "BAD_TRAP_R1");
+    as.emit(op(Op::LDI, R1), "MCR");
+    as.emit(op(Op::LD, R0), "CLOCK_OFF");
+    as.emit(andRegister(R0, R1, R0));
+    as.emit(addImmediate(R0, R0, MachineControl::UNSUPPORTED_TRAP));
+    as.emit(op(Op::STI, R0), "MCR");
+    as.emit(op(Op::LD, R0), "BAD_TRAP_R0");
+    as.emit(op(Op::LD, R1), "BAD_TRAP_R1");
+    as.emit(RET);
+
+    // nothing enables an interrupt without installing its handler first
+    as.label("BAD_INTERRUPT");
+    as.emit(op(Op::LEA, R0), "BAD_INTERRUPT_MESSAGE");
+    as.emit(trap(Traps::PUTS));
+    as.label("BAD_INTERRUPT_HALT");
+    as.emit(trap(Traps::HALT));
+    as.emit(op(Op::BR, N | Z | P), "BAD_INTERRUPT_HALT");
+
+    auto data = [&](const std::string& name, uint16_t value) {
+        as.label(name);
+        as.fill(value);
+    };
+    data("KBSR", Keyboard::STATUS_REGISTER);
+    data("KBDR", Keyboard::DATA_REGISTER);
+    data("DSR", Display::STATUS_REGISTER);
+    data("DDR", Display::DATA_REGISTER);
+    data("MCR", MachineControl::CONTROL_REGISTER);
+    data("CLOCK_OFF",
+         ~(MachineControl::CLOCK_ENABLE | MachineControl::UNSUPPORTED_TRAP) &
+             0xFFFF);
+    data("LOW_BYTE", 0x00FF);
+    data("BIT_8", 0x0100);
+    data("NEWLINE", '\n');
+    for (const char* slot :
+         {"OUT_R1", "PUTS_R0", "PUTS_R1", "PUTS_R2", "IN_R7", "HALT_R0",
+          "HALT_R1", "HALT_R7", "BAD_TRAP_R0", "BAD_TRAP_R1"}) {
+        data(slot, 0);
+    }
+    for (auto reg : {R0, R1, R2, R3, R4, R5}) {
+        data("PUTSP_R" + std::to_string(reg), 0);
+    }
+    as.label("HALT_MESSAGE");
+    as.stringz("HALT");
+    as.label("BAD_INTERRUPT_MESSAGE");
+    as.stringz("Unexpected interrupt");
+
+    OsImage os;
+    os.trapRoutines.fill(as.address("BAD_TRAP"));
+    os.trapRoutines[static_cast<uint8_t>(Traps::GETC)] = as.address("GETC");
+    os.trapRoutines[static_cast<uint8_t>(Traps::T_OUT)] = as.address("OUT");
+    os.trapRoutines[static_cast<uint8_t>(Traps::PUTS)] = as.address("PUTS");
+    os.trapRoutines[static_cast<uint8_t>(Traps::T_IN)] = as.address("IN");
+    os.trapRoutines[static_cast<uint8_t>(Traps::PUTSP)] = as.address("PUTSP");
+    os.trapRoutines[static_cast<uint8_t>(Traps::HALT)] = as.address("HALT");
+
+    auto code = as.finish();
+    os.words.assign(OsImage::CODE_START - OsImage::TRAP_VECTOR_TABLE, 0);
+    std::copy(os.trapRoutines.begin(), os.trapRoutines.end(),
+              os.words.begin());
+    std::fill_n(os.words.begin() + OsImage::INTERRUPT_VECTOR_TABLE,
+                OsImage::INTERRUPT_VECTOR_COUNT,
+                as.address("BAD_INTERRUPT"));
+    os.words.insert(os.words.end(), code.begin(), code.end());
+    return os;
+}
+} // namespace
+
+const OsImage& builtInOs()
+{
+    static const OsImage os = assemble();
+    return os;
+}
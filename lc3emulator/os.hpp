@@ -0,0 +1,35 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+// The operating system every CPU starts with: the trap vector table at
+// x0000-x00FF, the interrupt vector table at x0100-x01FF and the routines
+// they point to from CODE_START on. Trap routines return with RET and keep
+// every register but R0 (their result) and R7 (where TRAP put the return
+// address). Vectors without a routine stop the machine as an unsupported
+// trap. Routines only stop the machine (through MachineControl) with R7
+// holding the return address of the TRAP that called them.
+struct OsImage {
+    static constexpr uint16_t TRAP_VECTOR_TABLE = 0x0000;
+    static constexpr uint16_t TRAP_VECTOR_COUNT = 256;
+    static constexpr uint16_t INTERRUPT_VECTOR_TABLE = 0x0100;
+    static constexpr uint16_t INTERRUPT_VECTOR_COUNT = 256;
+    static constexpr uint16_t CODE_START = 0x0200;
+
+    // from TRAP_VECTOR_TABLE up to the end of the code
+    std::vector<uint16_t> words;
+    // the table as built, a program that installs its own handler changes
+    // its entry in memory
+    std::array<uint16_t, TRAP_VECTOR_COUNT> trapRoutines;
+
+    bool isCode(uint16_t address) const
+    {
+        return address >= CODE_START &&
+               address < TRAP_VECTOR_TABLE + words.size();
+    }
+};
+
+// assembled on first use
+const OsImage& builtInOs();
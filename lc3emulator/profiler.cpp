@@ -0,0 +1,180 @@
+#include "profiler.hpp"
+
+#include <algorithm>
+#include <fmt/core.h>
+#include <fstream>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+// x3003 or 3003
+bool parseAddress(std::string text, uint16_t& address)
+{
+    if (!text.empty() && (text[0] == 'x' || text[0] == 'X')) {
+        text = text.substr(1);
+    }
+    size_t parsed = 0;
+    unsigned long value = 0;
+    try {
+        value = std::stoul(text, &parsed, 16);
+    }
+    catch (const std::exception&) {
+        return false;
+    }
+    if (parsed != text.size() || value > 0xFFFF) {
+        return false;
+    }
+    address = value;
+    return true;
+}
+
+double percent(uint64_t part, uint64_t total)
+{
+    return total == 0 ? 0 : 100.0 * part / total;
+}
+} // namespace
+
+Symbols::Symbols(const std::string& path)
+{
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        throw std::runtime_error(
+            fmt::format("Couldn't open a file: `{}`", path));
+    }
+    for (std::string line; std::getline(file, line);) {
+        // lc3as puts its table in comments
+        if (line.starts_with("//")) {
+            line = line.substr(2);
+        }
+        std::istringstream fields(line);
+        std::string name, address, rest;
+        uint16_t value = 0;
+        if (fields >> name >> address && !(fields >> rest) &&
+            parseAddress(address, value)) {
+            add(name, value);
+        }
+    }
+}
+
+void Symbols::add(const std::string& name, uint16_t address)
+{
+    m_names.emplace(address, name);
+}
+
+std::string Symbols::describe(uint16_t address) const
+{
+    auto after = m_names.upper_bound(address);
+    if (after == m_names.begin()) {
+        return fmt::format("x{:04X}", address);
+    }
+    auto [labelAddress, name] = *std::prev(after);
+    if (labelAddress == address) {
+        return name;
+    }
+    return fmt::format("{}+{}", name, address - labelAddress);
+}
+
+Profiler::Profiler()
+    : m_executions(0x10000), m_cycles(0x10000), m_opCodeExecutions{},
+      m_opCodeCycles{}, m_frames(1), m_current(ROOT), m_hasStarted(false)
+{
+}
+
+void Profiler::count(uint16_t pc, InstructionOpCode opCode, uint64_t cycles)
+{
+    if (!m_hasStarted) {
+        m_frames[ROOT].function = pc;
+        m_hasStarted = true;
+    }
+    m_executions[pc]++;
+    m_cycles[pc] += cycles;
+    m_opCodeExecutions[static_cast<uint8_t>(opCode)]++;
+    m_opCodeCycles[static_cast<uint8_t>(opCode)] += cycles;
+    m_frames[m_current].cycles += cycles;
+}
+
+void Profiler::call(uint16_t target)
+{
+    auto [callee, isNew] = m_frames[m_current].callees.emplace(
+        target, static_cast<uint32_t>(m_frames.size()));
+    uint32_t frame = callee->second;
+    if (isNew) {
+        m_frames.push_back({.function = target,
+                            .parent = m_current,
+                            .cycles = 0,
+                            .callees = {}});
+    }
+    m_current = frame;
+}
+
+void Profiler::ret()
+{
+    // a RET without a call is just a jump
+    if (m_current != ROOT) {
+        m_current = m_frames[m_current].parent;
+    }
+}
+
+void Profiler::writeFoldedStacks(std::ostream& out,
+                                 const Symbols& symbols) const
+{
+    // frames are created after their parents, so their stacks are too
+    std::vector<std::string> stacks(m_frames.size());
+    for (uint32_t i = 0; i < m_frames.size(); ++i) {
+        const auto& frame = m_frames[i];
+        std::string name = symbols.describe(frame.function);
+        stacks[i] = i == ROOT ? name : stacks[frame.parent] + ";" + name;
+        if (frame.cycles != 0) {
+            out << stacks[i] << ' ' << frame.cycles << '\n';
+        }
+    }
+}
+
+void Profiler::writeReport(std::ostream& out, const Symbols& symbols,
+                           size_t count) const
+{
+    uint64_t totalCycles =
+        std::accumulate(m_opCodeCycles.begin(), m_opCodeCycles.end(),
+                        uint64_t(0));
+    uint64_t totalExecutions =
+        std::accumulate(m_opCodeExecutions.begin(), m_opCodeExecutions.end(),
+                        uint64_t(0));
+    out << fmt::format("{} instructions, {} cycles\n\n", totalExecutions,
+                       totalCycles);
+
+    out << fmt::format("{:<8}{:>14}{:>16}{:>8}\n", "opcode", "executions",
+                       "cycles", "%");
+    for (uint8_t opCode = 0; opCode < m_opCodeExecutions.size(); ++opCode) {
+        if (m_opCodeExecutions[opCode] != 0) {
+            out << fmt::format("{:<8}{:>14}{:>16}{:>8.2f}\n",
+                               opCodeName(InstructionOpCode(opCode)),
+                               m_opCodeExecutions[opCode],
+                               m_opCodeCycles[opCode],
+                               percent(m_opCodeCycles[opCode], totalCycles));
+        }
+    }
+
+    std::vector<uint16_t> hottest;
+    for (uint32_t address = 0; address < m_cycles.size(); ++address) {
+        if (m_executions[address] != 0) {
+            hottest.push_back(address);
+        }
+    }
+    count = std::min(count, hottest.size());
+    std::partial_sort(hottest.begin(), hottest.begin() + count,
+                      hottest.end(), [&](uint16_t a, uint16_t b) {
+                          return m_cycles[a] != m_cycles[b]
+                                     ? m_cycles[a] > m_cycles[b]
+                                     : a < b;
+                      });
+    out << fmt::format("\n{:<8}{:<24}{:>14}{:>16}{:>8}\n", "address",
+                       "location", "executions", "cycles", "%");
+    for (size_t i = 0; i < count; ++i) {
+        uint16_t address = hottest[i];
+        out << fmt::format("x{:04X}   {:<24}{:>14}{:>16}{:>8.2f}\n", address,
+                           symbols.describe(address), m_executions[address],
+                           m_cycles[address],
+                           percent(m_cycles[address], totalCycles));
+    }
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "decoder.hpp"
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Labels of an assembled program, read from the symbol table lc3asm (and
+// lc3as) writes next to the object file:
+//     //	Symbol Name       Page Address
+//     //	----------------  ------------
+//     //	LOOP              3003
+// Lines of just a name and an address (x3003 or 3003) work too.
+class Symbols {
+  public:
+    Symbols() = default;
+    // throws std::runtime_error if the file can't be opened
+    explicit Symbols(const std::string& path);
+
+    void add(const std::string& name, uint16_t address);
+    // the label at `address` or the nearest one before it, like LOOP+2,
+    // x3005 if there is none
+    std::string describe(uint16_t address) const;
+    bool empty() const { return m_names.empty(); }
+
+  private:
+    std::map<uint16_t, std::string> m_names;
+};
+
+// Exact execution profile of a CPU, see CPU::setProfiler(). Counts every
+// retired instruction by address and by opcode, and charges its cycles to
+// the call stack it ran under. JSR/JSRR, traps that run through the OS and
+// interrupts push a frame, RET (JMP R7) and RTI pop one.
+class Profiler {
+  public:
+    Profiler();
+
+    void count(uint16_t pc, InstructionOpCode opCode, uint64_t cycles);
+    void call(uint16_t target);
+    void ret();
+
+    uint64_t executions(uint16_t address) const
+    {
+        return m_executions[address];
+    }
+    uint64_t executions(InstructionOpCode opCode) const
+    {
+        return m_opCodeExecutions[static_cast<uint8_t>(opCode)];
+    }
+    uint64_t cycles(uint16_t address) const { return m_cycles[address]; }
+
+    // One line per call stack, outermost frame first, with the cycles
+    // spent in its innermost frame: what flamegraph.pl takes.
+    void writeFoldedStacks(std::ostream& out, const Symbols& symbols) const;
+    // opcodes and the `count` addresses that took the most cycles
+    void writeReport(std::ostream& out, const Symbols& symbols,
+                     size_t count = 20) const;
+
+  private:
+    struct Frame {
+        // entry address of the subroutine
+        uint16_t function;
+        uint32_t parent;
+        uint64_t cycles;
+        std::map<uint16_t, uint32_t> callees;
+    };
+
+    static constexpr uint32_t ROOT = 0;
+
+    std::vector<uint64_t> m_executions;
+    std::vector<uint64_t> m_cycles;
+    std::array<uint64_t, 16> m_opCodeExecutions;
+    std::array<uint64_t, 16> m_opCodeCycles;
+    // every call stack seen, as a tree, ROOT is where the run started
+    std::vector<Frame> m_frames;
+    uint32_t m_current;
+    bool m_hasStarted;
+};
@@ -0,0 +1,175 @@
+#include "trace.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cstring>
+#include <fmt/core.h>
+#include <stdexcept>
+
+namespace {
+constexpr uint8_t MEMORY_WRITE = 0x01;
+// pc, instruction, mask, flags, eight registers, address and value
+constexpr size_t MAX_RECORD_SIZE = 2 + 2 + 1 + 1 + 8 * 2 + 2 + 2;
+constexpr size_t PUBLISH_SIZE = 4096;
+} // namespace
+
+TraceWriter::TraceWriter(const std::string& path, size_t capacity)
+    : m_file(path, std::ios::binary),
+      m_buffer(std::bit_ceil(std::max(capacity, MAX_RECORD_SIZE))),
+      m_mask(m_buffer.size() - 1), m_head(0), m_publishedHead(0), m_tail(0),
+      m_knownTail(0), m_isClosing(false), m_hasFailed(false)
+{
+    if (!m_file.is_open()) {
+        throw std::runtime_error(
+            fmt::format("Couldn't create a file: `{}`", path));
+    }
+    m_file.write(TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    uint8_t version[] = {TRACE_VERSION & 0xFF, TRACE_VERSION >> 8};
+    m_file.write(reinterpret_cast<const char*>(version), sizeof(version));
+    m_writer = std::thread([this] { spill(); });
+}
+
+TraceWriter::~TraceWriter()
+{
+    if (m_writer.joinable()) {
+        m_publishedHead.store(m_head, std::memory_order_release);
+        m_isClosing.store(true, std::memory_order_release);
+        m_writer.join();
+    }
+}
+
+void TraceWriter::record(const TraceRecord& record)
+{
+    if (m_head + MAX_RECORD_SIZE - m_knownTail > m_buffer.size()) {
+        // the writer thread is a whole buffer behind
+        m_publishedHead.store(m_head, std::memory_order_release);
+        while (m_head + MAX_RECORD_SIZE -
+                   (m_knownTail = m_tail.load(std::memory_order_acquire)) >
+               m_buffer.size()) {
+            std::this_thread::yield();
+        }
+    }
+    // packed on the stack first, stores through m_buffer could alias
+    // anything
+    uint8_t packed[MAX_RECORD_SIZE];
+    size_t size = 0;
+    auto put16 = [&](uint16_t word) {
+        packed[size++] = word & 0xFF;
+        packed[size++] = word >> 8;
+    };
+    put16(record.pc);
+    put16(record.instruction);
+    packed[size++] = record.registerMask;
+    packed[size++] = record.hasMemoryWrite ? MEMORY_WRITE : 0;
+    for (uint8_t i = 0; i < record.registers.size(); ++i) {
+        if (record.registerMask & (1 << i)) {
+            put16(record.registers[i]);
+        }
+    }
+    if (record.hasMemoryWrite) {
+        put16(record.address);
+        put16(record.value);
+    }
+    size_t start = m_head & m_mask;
+    size_t first = std::min(size, m_buffer.size() - start);
+    std::memcpy(&m_buffer[start], packed, first);
+    std::memcpy(&m_buffer[0], packed + first, size - first);
+    m_head += size;
+    if (m_head - m_publishedHead.load(std::memory_order_relaxed) >=
+        PUBLISH_SIZE) {
+        m_publishedHead.store(m_head, std::memory_order_release);
+    }
+}
+
+void TraceWriter::close()
+{
+    if (!m_writer.joinable()) {
+        return;
+    }
+    m_publishedHead.store(m_head, std::memory_order_release);
+    m_isClosing.store(true, std::memory_order_release);
+    m_writer.join();
+    m_file.close();
+    if (m_hasFailed || m_file.fail()) {
+        throw std::runtime_error("Couldn't write the trace");
+    }
+}
+
+void TraceWriter::spill()
+{
+    size_t tail = 0;
+    while (true) {
+        // everything published before closing is written out
+        bool isClosing = m_isClosing.load(std::memory_order_acquire);
+        size_t head = m_publishedHead.load(std::memory_order_acquire);
+        if (head == tail) {
+            if (isClosing) {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+        // at most two pieces, the second one from the start of the buffer
+        while (tail != head) {
+            size_t start = tail & m_mask;
+            size_t size = std::min(head - tail, m_buffer.size() - start);
+            m_file.write(reinterpret_cast<const char*>(&m_buffer[start]),
+                         size);
+            tail += size;
+        }
+        if (!m_file) {
+            m_hasFailed = true;
+        }
+        m_tail.store(tail, std::memory_order_release);
+    }
+    m_file.flush();
+}
+
+TraceReader::TraceReader(const std::string& path)
+    : m_file(path, std::ios::binary)
+{
+    if (!m_file.is_open()) {
+        throw std::runtime_error(
+            fmt::format("Couldn't open a file: `{}`", path));
+    }
+    char magic[sizeof(TRACE_MAGIC)] = {};
+    m_file.read(magic, sizeof(magic));
+    if (!m_file || !std::equal(magic, magic + sizeof(magic), TRACE_MAGIC) ||
+        read16() != TRACE_VERSION) {
+        throw std::runtime_error(
+            fmt::format("Not a trace file: `{}`", path));
+    }
+}
+
+bool TraceReader::next(TraceRecord& record)
+{
+    if (m_file.peek() == std::ifstream::traits_type::eof()) {
+        return false;
+    }
+    record = {};
+    record.pc = read16();
+    record.instruction = read16();
+    record.registerMask = m_file.get();
+    record.hasMemoryWrite = m_file.get() & MEMORY_WRITE;
+    for (uint8_t i = 0; i < record.registers.size(); ++i) {
+        if (record.registerMask & (1 << i)) {
+            record.registers[i] = read16();
+        }
+    }
+    if (record.hasMemoryWrite) {
+        record.address = read16();
+        record.value = read16();
+    }
+    if (!m_file) {
+        throw std::runtime_error("The trace ends in the middle of a record");
+    }
+    return true;
+}
+
+uint16_t TraceReader::read16()
+{
+    uint8_t low = m_file.get();
+    uint8_t high = m_file.get();
+    return low | (high << 8);
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// One retired instruction: where it ran, the word that ran, the registers
+// it changed and the word it stored, if any.
+struct TraceRecord {
+    uint16_t pc;
+    uint16_t instruction;
+    // bit n set when Rn changed, registers[n] is its new value then
+    uint8_t registerMask;
+    std::array<uint16_t, 8> registers;
+    bool hasMemoryWrite;
+    uint16_t address;
+    uint16_t value;
+
+    bool operator==(const TraceRecord&) const = default;
+};
+
+// Trace files start with TRACE_MAGIC and TRACE_VERSION, then hold one
+// packed little-endian record per instruction:
+//     pc, instruction           2 + 2 bytes
+//     register mask, flags      1 + 1 bytes
+//     a value per mask bit      2 bytes each
+//     address, value            2 + 2 bytes if flags has MEMORY_WRITE
+inline constexpr char TRACE_MAGIC[4] = {'L', 'C', '3', 'T'};
+inline constexpr uint16_t TRACE_VERSION = 1;
+
+// Writes a trace file. record() packs into a lock-free ring buffer that a
+// writer thread spills to the file, so tracing costs the interpreter a
+// few stores per instruction. It only waits when the disk falls a whole
+// buffer behind.
+class TraceWriter {
+  public:
+    static constexpr size_t DEFAULT_CAPACITY = size_t(1) << 22;
+
+    // throws std::runtime_error if the file can't be created, `capacity`
+    // is rounded up to a power of two
+    explicit TraceWriter(const std::string& path,
+                         size_t capacity = DEFAULT_CAPACITY);
+    ~TraceWriter();
+    TraceWriter(const TraceWriter&) = delete;
+    TraceWriter& operator=(const TraceWriter&) = delete;
+
+    void record(const TraceRecord& record);
+    // writes out the rest of the buffer and closes the file, throws
+    // std::runtime_error if any write failed
+    void close();
+
+  private:
+    void spill();
+
+  private:
+    std::ofstream m_file;
+    std::vector<uint8_t> m_buffer;
+    size_t m_mask;
+    // Only the recording thread moves the head and only the writer thread
+    // moves the tail. Both count bytes since the start. The head is
+    // published a page at a time, so the two threads rarely touch the same
+    // cache line.
+    size_t m_head;
+    alignas(64) std::atomic<size_t> m_publishedHead;
+    alignas(64) std::atomic<size_t> m_tail;
+    // the tail as last seen by the recording thread
+    alignas(64) size_t m_knownTail;
+    std::atomic<bool> m_isClosing;
+    std::atomic<bool> m_hasFailed;
+    std::thread m_writer;
+};
+
+// Reads what TraceWriter wrote, record by record.
+class TraceReader {
+  public:
+    // throws std::runtime_error if the file can't be opened or isn't a
+    // trace
+    explicit TraceReader(const std::string& path);
+
+    // false at the end of the file, throws std::runtime_error on a
+    // truncated record
+    bool next(TraceRecord& record);
+
+  private:
+    uint16_t read16();
+
+  private:
+    std::ifstream m_file;
+};
+
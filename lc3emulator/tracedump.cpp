@@ -0,0 +1,91 @@
+#include <exception>
+#include <fmt/core.h>
+#include <iostream>
+#include <string>
+
+#include "arguments.hpp"
+#include "profiler.hpp"
+#include "trace.hpp"
+
+// Prints a trace written by `lc3emulator --trace` as disassembly, one line
+// per instruction:
+//
+//     x3002  7581  STR R2, R6, #1          [x4001]=x0005
+//     x3003  127F  ADD R1, R1, #-1         R1=x0063
+//
+// --skip and --count select a window of a long trace, --symbols adds the
+// label of every address.
+
+int main(int argc, char* argv[])
+{
+    std::string tracePath;
+    std::string symbolsPath;
+    uint64_t skip = 0;
+    uint64_t count = UINT64_MAX;
+    bool isBadArgument = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string argument = argv[i];
+        if (argument == "--skip" && i + 1 < argc) {
+            isBadArgument |= !parseCount(argv[++i], skip);
+        }
+        else if (argument == "--count" && i + 1 < argc) {
+            isBadArgument |= !parseCount(argv[++i], count);
+        }
+        else if (argument == "--symbols" && i + 1 < argc) {
+            symbolsPath = argv[++i];
+        }
+        else if (argument.rfind("--", 0) == 0) {
+            // an unknown option or one missing its value
+            isBadArgument = true;
+        }
+        else {
+            tracePath = argument;
+        }
+    }
+    if (isBadArgument || tracePath.empty()) {
+        std::cerr << "usage: lc3trace [--skip records] [--count records] "
+                     "[--symbols file.sym] trace"
+                  << std::endl;
+        return -1;
+    }
+
+    try {
+        Symbols symbols;
+        if (!symbolsPath.empty()) {
+            symbols = Symbols(symbolsPath);
+        }
+        TraceReader reader(tracePath);
+        TraceRecord record;
+        for (uint64_t index = 0; count != 0 && reader.next(record); ++index) {
+            if (index < skip) {
+                continue;
+            }
+            --count;
+            std::string line = fmt::format("x{:04X}  ", record.pc);
+            if (!symbols.empty()) {
+                line += fmt::format("{:<16}", symbols.describe(record.pc));
+            }
+            line += fmt::format(
+                "{:04X}  {:<24}", record.instruction,
+                disassemble(record.instruction, record.pc));
+            for (uint8_t i = 0; i < record.registers.size(); ++i) {
+                if (record.registerMask & (1 << i)) {
+                    line += fmt::format("R{}=x{:04X} ", i,
+                                        record.registers[i]);
+                }
+            }
+            if (record.hasMemoryWrite) {
+                line += fmt::format("[x{:04X}]=x{:04X}", record.address,
+                                    record.value);
+            }
+            while (!line.empty() && line.back() == ' ') {
+                line.pop_back();
+            }
+            std::cout << line << '\n';
+        }
+    }
+    catch (const std::exception& e) {
+        std::cerr << "LC3 TRACE ERROR: " << e.what() << std::endl;
+        return -1;
+    }
+}